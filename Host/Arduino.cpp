@@ -0,0 +1,129 @@
+#include <Arduino.h>
+
+// 64 bits so millis() doesn't jump back to 0 when micros() wraps
+static uint64_t _hostMicros = 0;
+static void (*_pinHook)(uint8_t pin, uint8_t val) = NULL;
+static uint32_t _randomState = 1;
+
+HostSerial Serial;
+
+uint32_t millis() {
+    return (uint32_t)(_hostMicros / 1000);
+}
+
+uint32_t micros() {
+    return (uint32_t)_hostMicros;
+}
+
+// Busy waits would never end on a clock nobody moves, so they move it.
+void delay(uint32_t ms) {
+    _hostMicros += (uint64_t)ms * 1000;
+}
+
+void delayMicroseconds(uint32_t us) {
+    _hostMicros += us;
+}
+
+void hostSetMicros(uint32_t us) {
+    _hostMicros = us;
+}
+
+void hostAdvance(uint32_t us) {
+    _hostMicros += us;
+}
+
+void pinMode(uint8_t pin, uint8_t mode) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+    if (_pinHook != NULL) {
+        _pinHook(pin, val);
+    }
+}
+
+int digitalRead(uint8_t pin) {
+    return LOW;
+}
+
+void hostSetPinHook(void (*hook)(uint8_t pin, uint8_t val)) {
+    _pinHook = hook;
+}
+
+void attachInterrupt(uint8_t irq, void (*isr)(), int mode) {
+}
+
+void detachInterrupt(uint8_t irq) {
+}
+
+uint32_t disableInterrupts() {
+    return 0;
+}
+
+void restoreInterrupts(uint32_t st) {
+}
+
+// xorshift32 - the same sequence on every machine for a given seed
+long random(long max) {
+    if (max <= 0) {
+        return 0;
+    }
+    _randomState ^= _randomState << 13;
+    _randomState ^= _randomState >> 17;
+    _randomState ^= _randomState << 5;
+    return _randomState % max;
+}
+
+long random(long min, long max) {
+    if (min >= max) {
+        return min;
+    }
+    return min + random(max - min);
+}
+
+void randomSeed(unsigned long seed) {
+    _randomState = seed ? seed : 1;
+}
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+    size_t n = 0;
+    while (size--) {
+        n += write(*buffer++);
+    }
+    return n;
+}
+
+size_t Print::printNumber(unsigned long n, uint8_t base) {
+    char buf[8 * sizeof(long) + 1];
+    char *str = &buf[sizeof(buf) - 1];
+
+    if (base < 2) {
+        base = 10;
+    }
+
+    *str = '\0';
+    do {
+        unsigned long m = n;
+        n /= base;
+        char c = m - base * n;
+        *--str = c < 10 ? c + '0' : c + 'A' - 10;
+    } while (n);
+
+    return write(str);
+}
+
+size_t Print::print(long n, int base) {
+    if (base == DEC && n < 0) {
+        return print('-') + printNumber(-(unsigned long)n, DEC);
+    }
+    return printNumber(n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+    return printNumber(n, base);
+}
+
+size_t Print::print(double n, int digits) {
+    char buf[48];
+    snprintf(buf, sizeof(buf), "%.*f", digits, n);
+    return write(buf);
+}
@@ -0,0 +1,123 @@
+#ifndef _HOST_ARDUINO_H
+#define _HOST_ARDUINO_H
+
+/* Just enough of the Arduino core to build Mesh and VirtualRadio as a
+ * normal Linux program.  Time does not pass on its own: the program
+ * moves the clock with hostAdvance() so simulations are repeatable and
+ * can run faster (or slower) than real time.
+ *
+ *   g++ -O2 -IHost -IL2 -IMesh -IVirtualRadio sim.cpp Host/Arduino.cpp \
+ *       Mesh/Mesh.cpp Mesh/MeshStream.cpp VirtualRadio/VirtualRadio.cpp
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <type_traits>
+
+#ifndef ARDUINO
+#define ARDUINO 100
+#endif
+
+typedef uint8_t boolean;
+typedef uint8_t byte;
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+// Templates rather than the usual macros so STL headers still work
+template <class A, class B> inline typename std::common_type<A, B>::type min(A a, B b) { return a < b ? a : b; }
+template <class A, class B> inline typename std::common_type<A, B>::type max(A a, B b) { return a > b ? a : b; }
+template <class T, class L, class H> inline T constrain(T x, L lo, H hi) { return x < lo ? lo : (x > hi ? hi : x); }
+
+// Simulated clock
+extern uint32_t millis();
+extern uint32_t micros();
+extern void delay(uint32_t ms);
+extern void delayMicroseconds(uint32_t us);
+extern void hostSetMicros(uint32_t us);
+extern void hostAdvance(uint32_t us);
+
+// Pins go nowhere, but a hook can watch them (e.g. a node's LED)
+extern void pinMode(uint8_t pin, uint8_t mode);
+extern void digitalWrite(uint8_t pin, uint8_t val);
+extern int digitalRead(uint8_t pin);
+extern void hostSetPinHook(void (*hook)(uint8_t pin, uint8_t val));
+extern void attachInterrupt(uint8_t irq, void (*isr)(), int mode);
+extern void detachInterrupt(uint8_t irq);
+extern uint32_t disableInterrupts();
+extern void restoreInterrupts(uint32_t st);
+
+extern long random(long max);
+extern long random(long min, long max);
+extern void randomSeed(unsigned long seed);
+
+class Print;
+
+class Printable {
+    public:
+        virtual size_t printTo(Print &p) const = 0;
+};
+
+class Print {
+    private:
+        size_t printNumber(unsigned long n, uint8_t base);
+
+    public:
+        virtual size_t write(uint8_t c) = 0;
+        virtual size_t write(const uint8_t *buffer, size_t size);
+        size_t write(const char *str) { return str ? write((const uint8_t *)str, strlen(str)) : 0; }
+
+        size_t print(const char *str) { return write(str); }
+        size_t print(char c) { return write((uint8_t)c); }
+        size_t print(unsigned char n, int base = DEC) { return print((unsigned long)n, base); }
+        size_t print(int n, int base = DEC) { return print((long)n, base); }
+        size_t print(unsigned int n, int base = DEC) { return print((unsigned long)n, base); }
+        size_t print(long n, int base = DEC);
+        size_t print(unsigned long n, int base = DEC);
+        size_t print(double n, int digits = 2);
+        size_t print(const Printable &p) { return p.printTo(*this); }
+
+        size_t println() { return write("\r\n"); }
+        template <class T> size_t println(T v) { size_t n = print(v); return n + println(); }
+        template <class T> size_t println(T v, int f) { size_t n = print(v, f); return n + println(); }
+};
+
+class Stream : public Print {
+    public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+        virtual void flush() = 0;
+};
+
+// Serial writes to stdout and never has anything to read
+class HostSerial : public Stream {
+    public:
+        void begin(uint32_t baud) {}
+        size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+        size_t write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, stdout); }
+        using Print::write;
+        int available() { return 0; }
+        int read() { return -1; }
+        int peek() { return -1; }
+        void flush() { fflush(stdout); }
+};
+
+extern HostSerial Serial;
+
+#endif
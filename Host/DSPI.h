@@ -0,0 +1,20 @@
+#ifndef _HOST_DSPI_H
+#define _HOST_DSPI_H
+
+/* The part of chipKIT's DGSPI interface the nRF24L01 driver uses.  On
+ * its own it is a bus with nothing on it: every transfer reads back
+ * 0xFF.  A model of a device derives from it and answers instead.
+ */
+
+#include <Arduino.h>
+
+class DGSPI {
+    public:
+        virtual ~DGSPI() { }
+        virtual bool begin() { return true; }
+        virtual bool end() { return true; }
+        virtual bool setSpeed(uint32_t speed) { return true; }
+        virtual uint8_t transfer(uint8_t val) { return 0xFF; }
+};
+
+#endif
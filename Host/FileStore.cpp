@@ -0,0 +1,45 @@
+#include <FileStore.h>
+
+FileStore::FileStore(uint16_t size, const char *path) : _size(size), _writes(0) {
+    if (path == NULL) {
+        _file = tmpfile();
+    } else {
+        _file = fopen(path, "r+b");
+        if (_file == NULL) {
+            _file = fopen(path, "w+b");
+        }
+    }
+}
+
+FileStore::~FileStore() {
+    if (_file != NULL) {
+        fclose(_file);
+    }
+}
+
+uint8_t FileStore::read(uint16_t addr) {
+    if (_file == NULL || addr >= _size || fseek(_file, addr, SEEK_SET) != 0) {
+        return 0xFF;
+    }
+    int c = fgetc(_file);
+    return c == EOF ? 0xFF : c;
+}
+
+// Anything between the old end of the file and addr is filled as erased
+void FileStore::write(uint16_t addr, uint8_t val) {
+    if (_file == NULL || addr >= _size || fseek(_file, 0, SEEK_END) != 0) {
+        return;
+    }
+    for (long end = ftell(_file); end < addr; end++) {
+        fputc(0xFF, _file);
+    }
+    fseek(_file, addr, SEEK_SET);
+    fputc(val, _file);
+    _writes++;
+}
+
+void FileStore::commit() {
+    if (_file != NULL) {
+        fflush(_file);
+    }
+}
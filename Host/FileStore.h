@@ -0,0 +1,32 @@
+#ifndef _HOST_FILESTORE_H
+#define _HOST_FILESTORE_H
+
+/* A MeshStore kept in a file, standing in for a node's EEPROM so that
+ * routing snapshots outlive the Mesh (or the whole program) that saved
+ * them.  Bytes never written read back as 0xFF, as erased EEPROM does.
+ * With no path the file is temporary.
+ */
+
+#include <Arduino.h>
+#include <MeshStore.h>
+
+class FileStore : public MeshStore {
+    private:
+        FILE *_file;
+        uint16_t _size;
+        uint32_t _writes;
+
+    public:
+        FileStore(uint16_t size, const char *path = NULL);
+        ~FileStore();
+
+        uint16_t size() { return _size; }
+        uint8_t read(uint16_t addr);
+        void write(uint16_t addr, uint8_t val);
+        void commit();
+
+        /*! Bytes written so far, to see the wear a snapshot causes */
+        uint32_t getWrites() { return _writes; }
+};
+
+#endif
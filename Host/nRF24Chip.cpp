@@ -0,0 +1,170 @@
+#include <nRF24Chip.h>
+
+// Values from the datasheet's register map
+nRF24Chip::nRF24Chip(uint8_t csn, uint8_t ce) : _csn(csn), _ce(ce) {
+    memset(_reg, 0, sizeof(_reg));
+    _reg[0x00][0] = 0x08; // CONFIG
+    _reg[0x01][0] = 0x3F; // EN_AA
+    _reg[0x02][0] = 0x03; // EN_RXADDR
+    _reg[0x03][0] = 0x03; // SETUP_AW
+    _reg[0x04][0] = 0x03; // SETUP_RETR
+    _reg[0x05][0] = 0x02; // RF_CH
+    _reg[0x06][0] = 0x0F; // RF_SETUP
+    memset(_reg[0x0A], 0xE7, 5);
+    memset(_reg[0x0B], 0xC2, 5);
+    _reg[0x0C][0] = 0xC3;
+    _reg[0x0D][0] = 0xC4;
+    _reg[0x0E][0] = 0xC5;
+    _reg[0x0F][0] = 0xC6;
+    memset(_reg[0x10], 0xE7, 5);
+    _status = 0;
+    _rxCount = 0;
+    _txCount = 0;
+    _selected = false;
+    _command = 0xFF;
+    _pos = 0;
+    _popRX = false;
+    _transactions = 0;
+    _rxDropped = 0;
+    _failNext = 0;
+    sentCount = 0;
+}
+
+uint8_t nRF24Chip::regWidth(uint8_t reg) {
+    return (reg == 0x0A || reg == 0x0B || reg == 0x10) ? 5 : 1;
+}
+
+boolean nRF24Chip::dynamicPipe(uint8_t pipe) {
+    return (_reg[0x1D][0] & 0x04) && (_reg[0x1C][0] & (1 << pipe));
+}
+
+uint8_t nRF24Chip::fifoStatus() {
+    return (_rxCount == 0 ? 0x01 : 0) | (_rxCount == NRF24CHIP_FIFO ? 0x02 : 0) |
+        (_txCount == 0 ? 0x10 : 0) | (_txCount == NRF24CHIP_FIFO ? 0x20 : 0);
+}
+
+uint8_t nRF24Chip::readReg(uint8_t reg, uint8_t pos) {
+    if (reg == 0x07) {
+        return (_status & 0x70) | (_rxCount > 0 ? _rx[0].pipe << 1 : 0x0E) |
+            (_txCount == NRF24CHIP_FIFO ? 0x01 : 0);
+    }
+    if (reg == 0x17) {
+        return fifoStatus();
+    }
+    return pos < regWidth(reg) ? _reg[reg][pos] : 0x00;
+}
+
+// Writing a 1 to an interrupt flag in STATUS clears it
+void nRF24Chip::writeReg(uint8_t reg, uint8_t pos, uint8_t val) {
+    if (reg == 0x07) {
+        _status &= ~(val & 0x70);
+    } else if (reg == 0x17 || reg == 0x08 || reg == 0x09) {
+        return; // Read only
+    } else if (pos < regWidth(reg)) {
+        _reg[reg][pos] = val;
+    }
+}
+
+uint8_t nRF24Chip::transfer(uint8_t val) {
+    if (!_selected) {
+        return 0xFF;
+    }
+    uint8_t pos = _pos++;
+    if (pos == 0) {
+        _command = val;
+        uint8_t status = readReg(0x07, 0);
+        if (val == 0xE1) {
+            _txCount = 0;
+        } else if (val == 0xE2) {
+            _rxCount = 0;
+        }
+        return status;
+    }
+
+    uint8_t cmd = _command;
+    if (cmd < 0x20) {
+        return readReg(cmd & 0x1F, pos - 1);
+    }
+    if (cmd < 0x40) {
+        writeReg(cmd & 0x1F, pos - 1, val);
+        return 0xFF;
+    }
+    // The datasheet only gives a width for a dynamic payload, so anything
+    // else reads as 0 here
+    if (cmd == 0x60) {
+        return _rxCount > 0 && dynamicPipe(_rx[0].pipe) ? _rx[0].len : 0;
+    }
+    if (cmd == 0x61) {
+        if (_rxCount == 0) {
+            return 0x00;
+        }
+        // Fixed width pipes always give RX_PW_Px bytes
+        struct chipframe *f = &_rx[0];
+        uint8_t len = dynamicPipe(f->pipe) ? f->len : _reg[0x11 + f->pipe][0];
+        _popRX = true;
+        return pos - 1 < len && pos - 1 < f->len ? f->data[pos - 1] : 0x00;
+    }
+    if ((cmd == 0xA0 || cmd == 0xB0) && _txCount < NRF24CHIP_FIFO && pos <= 32) {
+        _tx[_txCount].data[pos - 1] = val;
+        _tx[_txCount].len = pos;
+    }
+    return 0xFF;
+}
+
+void nRF24Chip::pin(uint8_t pin, uint8_t val) {
+    if (pin == _csn) {
+        if (val == LOW && !_selected) {
+            _selected = true;
+            _pos = 0;
+            _popRX = false;
+            _transactions++;
+        } else if (val == HIGH && _selected) {
+            _selected = false;
+            if ((_command == 0xA0 || _command == 0xB0) && _pos > 1 && _txCount < NRF24CHIP_FIFO) {
+                _txCount++;
+            }
+            if (_popRX && _rxCount > 0) {
+                _rxCount--;
+                memmove(&_rx[0], &_rx[1], _rxCount * sizeof(struct chipframe));
+            }
+        }
+    } else if (pin == _ce && val == HIGH) {
+        transmit();
+    }
+}
+
+// A pulse on CE in standby sends the payload at the front of the TX
+// FIFO.  Nothing more goes until MAX_RT has been cleared.
+void nRF24Chip::transmit() {
+    if ((_reg[0x00][0] & 0x03) != 0x02 || _txCount == 0 || (_status & 0x10)) {
+        return;
+    }
+    if (_failNext > 0) {
+        _failNext--;
+        _reg[0x08][0] = (_reg[0x08][0] & 0xF0) | (_reg[0x04][0] & 0x0F);
+        _status |= 0x10;
+        return;
+    }
+    struct chipframe *f = &sent[sentCount % NRF24CHIP_SENT];
+    memcpy(f, &_tx[0], sizeof(struct chipframe));
+    memcpy(f->addr, _reg[0x10], 5);
+    sentCount++;
+    _txCount--;
+    memmove(&_tx[0], &_tx[1], _txCount * sizeof(struct chipframe));
+    _reg[0x08][0] &= 0xF0;
+    _status |= 0x20;
+}
+
+boolean nRF24Chip::receive(uint8_t pipe, const uint8_t *data, uint8_t len) {
+    if (_rxCount == NRF24CHIP_FIFO) {
+        _rxDropped++;
+        return false;
+    }
+    struct chipframe *f = &_rx[_rxCount++];
+    memset(f->data, 0, sizeof(f->data));
+    memcpy(f->data, data, min(len, 32));
+    f->len = len;
+    f->pipe = pipe;
+    _status |= 0x40;
+    return true;
+}
@@ -0,0 +1,83 @@
+#ifndef _HOST_NRF24CHIP_H
+#define _HOST_NRF24CHIP_H
+
+/* An nRF24L01+ on the end of a DGSPI, as far as its registers, FIFOs
+ * and interrupt flags go, so the driver can be run and checked off the
+ * target.  There is no air: frames are handed to receive(), and the
+ * last NRF24CHIP_SENT the chip sent are kept in sent[] (sentCount counts
+ * them all).  The program watches the pins with hostSetPinHook() and
+ * passes them on to pin(), and calls the driver's isrHandler() itself
+ * whenever it wants an interrupt to happen.
+ *
+ *   g++ -DARDUINO=100 -IHost -IL2 -InRF24L01 test.cpp Host/Arduino.cpp \
+ *       Host/nRF24Chip.cpp nRF24L01/nRF24L01.cpp
+ */
+
+#include <Arduino.h>
+#include <DSPI.h>
+
+#define NRF24CHIP_FIFO 3
+#define NRF24CHIP_SENT 16
+
+struct chipframe {
+    uint8_t data[32];
+    uint8_t len;
+    uint8_t pipe;
+    uint8_t addr[5]; // TX_ADDR it went to, for frames sent
+};
+
+class nRF24Chip : public DGSPI {
+    private:
+        uint8_t _csn;
+        uint8_t _ce;
+        uint8_t _reg[32][5];
+        uint8_t _status;
+
+        struct chipframe _rx[NRF24CHIP_FIFO];
+        uint8_t _rxCount;
+        struct chipframe _tx[NRF24CHIP_FIFO];
+        uint8_t _txCount;
+
+        // The transaction in progress
+        boolean _selected;
+        uint8_t _command;
+        uint8_t _pos;
+        boolean _popRX;
+
+        uint32_t _transactions;
+        uint32_t _rxDropped;
+        uint8_t _failNext;
+
+        uint8_t regWidth(uint8_t reg);
+        void writeReg(uint8_t reg, uint8_t pos, uint8_t val);
+        uint8_t readReg(uint8_t reg, uint8_t pos);
+        uint8_t fifoStatus();
+        boolean dynamicPipe(uint8_t pipe);
+        void transmit();
+
+    public:
+        struct chipframe sent[NRF24CHIP_SENT];
+        uint8_t sentCount;
+
+        nRF24Chip(uint8_t csn, uint8_t ce);
+
+        uint8_t transfer(uint8_t val);
+        void pin(uint8_t pin, uint8_t val);
+
+        /*! A frame arrives on a pipe.  False if the RX FIFO was full and
+         *  the chip lost it.  A len over 32 stands for a corrupt dynamic
+         *  payload, which R_RX_PL_WID reports as such */
+        boolean receive(uint8_t pipe, const uint8_t *data, uint8_t len);
+        /*! The next count frames sent hit MAX_RT rather than TX_DS */
+        void failNext(uint8_t count) { _failNext = count; }
+
+        uint8_t getRegister(uint8_t reg) { return _reg[reg & 0x1F][0]; }
+        uint8_t rxWaiting() { return _rxCount; }
+        /*! Chip select cycles so far */
+        uint32_t getTransactions() { return _transactions; }
+        uint32_t getRXDropped() { return _rxDropped; }
+        /*! The IRQ pin would be low */
+        boolean interruptPending() { return (_status & 0x70) != 0; }
+};
+
+#endif
@@ -3,18 +3,52 @@
 
 /* Layer 2 device interface */
 
+// Unicast delivery counts for one neighbour
+struct linkstats {
+    uint16_t frames;    // Unicasts that finished, delivered or not
+    uint16_t delivered; // ... of which were acknowledged
+    uint16_t attempts;  // Times they went on the air, retries included
+};
+
 class L2 {
     public:
-        /*! Send a packet to a specific host */
-        virtual void unicastPacket(uint8_t *addr, uint8_t *data) = 0;
-        /*! Send a packet to all directly connected hosts */
-        virtual void broadcastPacket(uint8_t *data) = 0;
+        // Transmit status returned by unicastPacket() and broadcastPacket()
+        static const int Queued  = 0; // Accepted for transmission
+        static const int Full    = 1; // No room to queue it - try again later
+        static const int Dropped = 2; // The device can't send at the moment
+
+        /*! Queue a packet to a specific host */
+        virtual int unicastPacket(uint8_t *addr, uint8_t *data) = 0;
+        /*! Queue a packet to all directly connected hosts */
+        virtual int broadcastPacket(uint8_t *data) = 0;
         /*! Returns if (and maybe how many) any packets are available to read */
         virtual int available() = 0;
         /*! Read one packet into the buffer */
         virtual void readPacket(uint8_t *buffer) = 0;
+        /*! As unicastPacket() but only the first len bytes matter.  Devices
+         *  with fixed size frames send the whole buffer regardless */
+        virtual int unicastFrame(uint8_t *addr, uint8_t *data, uint8_t len) { return unicastPacket(addr, data); }
+        /*! As broadcastPacket() but only the first len bytes matter */
+        virtual int broadcastFrame(uint8_t *data, uint8_t len) { return broadcastPacket(data); }
+        /*! As readPacket() but returns the number of bytes received, or 0 if the device can't tell */
+        virtual uint8_t readFrame(uint8_t *buffer) { readPacket(buffer); return 0; }
+        /*! Also receive frames multicast to group.  False if the device
+         *  can't filter for it, in which case it only gets them as broadcasts */
+        virtual boolean joinGroup(uint16_t group) { return false; }
+        virtual void leaveGroup(uint16_t group) { }
+        /*! Queue a packet to the devices that joined group.  Devices
+         *  without groups broadcast it */
+        virtual int multicastFrame(uint16_t group, uint8_t *data, uint8_t len) { return broadcastFrame(data, len); }
+        /*! Listen on channel, and send on it too.  False if the device
+         *  only has the one */
+        virtual boolean setChannel(uint8_t channel) { return false; }
+        /*! Frames queued from now on are sent on channel, the device going
+         *  back to its own channel to listen once they are out */
+        virtual void setTxChannel(uint8_t channel) { }
         /*! Place the devices hardware address into buffer returning the length of the address */
         virtual int getHardwareAddress(uint8_t *buffer) = 0;
+        /*! Unicast counts for addr since the last call, which clears them.  False if the device doesn't keep any */
+        virtual boolean readLinkStats(uint8_t *addr, struct linkstats *stats) { return false; }
 };
 
 #endif
@@ -1,5 +1,315 @@
 
 #include <Mesh.h>
+#include <MeshStream.h>
+
+Mesh::Mesh() : _ledpin(255), _devlist(NULL), _routeCount(0), _devcount(0), _evictions(0), _routeGen(1), _id(65535) {
+    memset(_routes, 0, sizeof(_routes));
+    memset(_fib, 0, sizeof(_fib));
+    memset(_txStats, 0, sizeof(_txStats));
+    _victim = NULL;
+    _victimGen = 0;
+    _inProcess = false;
+    _processStart = 0;
+    _budget = 0;
+    _rxNext = 0;
+#ifdef MESH_STATS
+    memset(&_stats, 0, sizeof(_stats));
+#endif
+    _freehosts = NULL;
+    for (int i = MESH_MAX_HOSTS - 1; i >= 0; i--) {
+        _hostpool[i].next = _freehosts;
+        _freehosts = &_hostpool[i];
+    }
+    _oldest[0] = _oldest[1] = NULL;
+    _newest[0] = _newest[1] = NULL;
+    _timeout[0] = MESH_DIRECT_TIMEOUT;
+    _timeout[1] = MESH_REMOTE_TIMEOUT;
+    _lastTriggered = 0;
+    _lastFull = 0;
+    _iamJitter = 0;
+    _fullJitter = 0;
+    _triggerJitter = 0;
+    _fullPending = false;
+    _icanBusy = false;
+    _icanFull = false;
+    _icanNext = 0;
+    _changes = 0;
+    _withdrawCount = 0;
+    _holdCount = 0;
+    _ctrlBytes = 0;
+    _ctrlBytesLast = 0;
+    _ctrlStart = 0;
+    _lastETX = 0;
+    _broadcastCallback = NULL;
+    _unicastCallback = NULL;
+    _broadcastMessageCallback = NULL;
+    _unicastMessageCallback = NULL;
+    for (int i = 0; i < MESH_FRAG_SLOTS; i++) {
+        _frags[i].busy = false;
+    }
+    _fragOut.busy = false;
+    _fragOut.waiting = false;
+    _fragId = 0;
+    _fragDrops = 0;
+    for (int i = 0; i < MESH_AGGR_SLOTS; i++) {
+        _aggr[i].busy = false;
+    }
+    _aggrDelay = 0;
+    _aggrFrames = 0;
+    _aggrMessages = 0;
+    _streams = NULL;
+
+    _floodSeq = 0;
+    memset(_floodFilter, 0, sizeof(_floodFilter));
+    _floodGen = 0;
+    _floodEntries = 0;
+    for (int i = 0; i < MESH_FLOOD_QUEUE; i++) {
+        _floodQueue[i].busy = false;
+    }
+    for (int i = 0; i < MESH_TWOHOP_SLOTS; i++) {
+        _twohop[i].via = Direct;
+    }
+    _relayPruning = true;
+    _pathWeighting = false;
+    _floodSent = 0;
+    _floodDelivered = 0;
+    _floodDuplicates = 0;
+    _floodPruned = 0;
+    _floodDrops = 0;
+
+    _groupCount = 0;
+    _groupsChanged = false;
+    _lastGroupReport = 0;
+    _groupJitter = 0;
+    memset(_members, 0, sizeof(_members));
+    _groupCallback = NULL;
+
+    _channelCount = 0;
+
+    _store = NULL;
+    _lastSave = 0;
+    _savedGen = 0;
+    _saving = false;
+}
+
+void Mesh::sendControl(struct packet *pkt) {
+    calcCS(pkt);
+    for (struct device *d = _devlist; d; d = d->next) {
+        queuePacket(d, NULL, pkt, PriorityControl);
+        _ctrlBytes += sizeof(struct packet);
+    }
+}
+
+struct device *Mesh::findDevice(L2 *dev) {
+    for (struct device *d = _devlist; d; d = d->next) {
+        if (d->dev == dev) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Queue a packet (already checksummed) for a device, and give the device
+// a chance to take it straight away.  A NULL hop means broadcast, to
+// everyone or only those filtering for group.
+int Mesh::queuePacket(struct device *d, struct host *hop, struct packet *pkt, uint8_t priority, uint16_t group) {
+    if (d == NULL || priority > PriorityNormal) {
+        return L2::Dropped;
+    }
+    struct txqueue *q = &d->queue[priority];
+    uint8_t depth = q->head - q->tail;
+    if (depth > q->mask) {
+        serviceQueue(d);
+        depth = q->head - q->tail;
+        if (depth > q->mask) {
+            _txStats[priority].drops++;
+            MESH_COUNT(d->stats.queueFull);
+            return L2::Full;
+        }
+    }
+    struct txentry *e = &q->ring[q->head & q->mask];
+    memcpy(&e->pkt, pkt, sizeof(struct packet));
+    e->broadcast = hop == NULL;
+    e->group = group;
+    if (hop != NULL) {
+        memcpy(e->hwaddr, hop->hwaddr, MESH_HWADDR_LEN);
+        e->channels = 1 << homeChannel(hop->id);
+    } else {
+        e->channels = broadcastChannels(d, pkt);
+    }
+    e->queued = millis();
+    q->head++;
+    if (depth + 1 > _txStats[priority].depthMax) {
+        _txStats[priority].depthMax = depth + 1;
+    }
+    // StaticMesh::process() sends everything on its way out
+    if (!_inProcess) {
+        serviceQueue(d);
+    }
+    return L2::Queued;
+}
+
+// The next frame to hand to a device, highest priority first, or NULL.
+// Management frames wait while the token bucket is empty but don't hold
+// up anything behind them.
+struct txentry *Mesh::nextFrame(struct device *d, uint8_t &priority) {
+    uint32_t elapsed = millis() - d->lastRefill;
+    if (elapsed > 0) {
+        d->lastRefill += elapsed;
+        d->tokens = min(d->tokens + min(elapsed, 1000UL * MESH_CTRL_BURST) * MESH_CTRL_RATE, 1000UL * MESH_CTRL_BURST);
+    }
+
+    for (uint8_t p = PriorityControl; p <= PriorityNormal; p++) {
+        struct txqueue *q = &d->queue[p];
+        if (q->head == q->tail || (p == PriorityControl && d->tokens < 1000)) {
+            continue;
+        }
+        priority = p;
+        return &q->ring[q->tail & q->mask];
+    }
+    return NULL;
+}
+
+// The device has taken (or refused outright) the frame nextFrame() gave
+void Mesh::frameDone(struct device *d, uint8_t priority, int status) {
+    struct txqueue *q = &d->queue[priority];
+    struct txentry *e = &q->ring[q->tail & q->mask];
+    q->tail++;
+    if (priority == PriorityControl) {
+        d->tokens -= 1000;
+    }
+    if (status == L2::Queued) {
+        MESH_COUNT(d->stats.tx);
+        uint32_t sojourn = millis() - e->queued;
+        _txStats[priority].sent++;
+        _txStats[priority].sojourn += sojourn;
+        if (sojourn > _txStats[priority].sojournMax) {
+            _txStats[priority].sojournMax = sojourn;
+        }
+    } else {
+        _txStats[priority].drops++;
+        MESH_COUNT(d->stats.txDropped);
+    }
+}
+
+// Hand frames to the device until it is full or there are none left.
+// Once it is full, workPending() leaves its frames be until it takes
+// one again.
+void Mesh::serviceQueue(struct device *d) {
+    uint8_t p;
+    struct txentry *e;
+    while ((e = nextFrame(d, p)) != NULL) {
+        int status;
+        if (d->retune) {
+            d->dev->setTxChannel(frameChannel(e));
+        }
+        if (e->broadcast && e->group != Broadcast) {
+            status = d->dev->multicastFrame(e->group, (uint8_t *)&e->pkt, frameLength(&e->pkt));
+        } else if (e->broadcast) {
+            status = d->dev->broadcastFrame((uint8_t *)&e->pkt, frameLength(&e->pkt));
+        } else {
+            status = d->dev->unicastFrame(e->hwaddr, (uint8_t *)&e->pkt, frameLength(&e->pkt));
+        }
+        d->full = status == L2::Full;
+        if (d->full) {
+            return;
+        }
+        if (moreChannels(d, e, status)) {
+            continue;
+        }
+        frameDone(d, p, status);
+    }
+}
+
+uint8_t Mesh::frameChannel(struct txentry *e) {
+    uint8_t c = 0;
+    while (c < _channelCount - 1 && !(e->channels & (1 << c))) {
+        c++;
+    }
+    return _channels[c];
+}
+
+// A broadcast stays at the head of the queue until it has been out on
+// every channel it needs
+boolean Mesh::moreChannels(struct device *d, struct txentry *e, int status) {
+    if (!d->retune || status != L2::Queued) {
+        return false;
+    }
+    e->channels &= e->channels - 1;
+    return e->channels != 0;
+}
+
+void Mesh::serviceQueues(struct device *skip) {
+    for (struct device *d = _devlist; d; d = d->next) {
+        if (d != skip) {
+            serviceQueue(d);
+        }
+    }
+}
+
+#ifdef MESH_STATS
+void Mesh::timeProcess(uint32_t us) {
+    _stats.processCalls++;
+    if (us > _stats.processMax) {
+        _stats.processMax = us;
+    }
+    uint8_t b = 0;
+    for (uint32_t limit = 16; us >= limit && b < MESH_STATS_BUCKETS - 1; limit <<= 1) {
+        b++;
+    }
+    _stats.processTime[b]++;
+}
+#endif
+
+boolean Mesh::getStats(struct meshstats *stats) {
+#ifdef MESH_STATS
+    memcpy(stats, &_stats, sizeof(struct meshstats));
+    stats->routes = _routeCount;
+    stats->evictions = _evictions;
+    return true;
+#else
+    memset(stats, 0, sizeof(struct meshstats));
+    return false;
+#endif
+}
+
+boolean Mesh::getDeviceStats(L2 &dev, struct devstats *stats) {
+#ifdef MESH_STATS
+    struct device *d = findDevice(&dev);
+    if (d != NULL) {
+        memcpy(stats, &d->stats, sizeof(struct devstats));
+        return true;
+    }
+#endif
+    memset(stats, 0, sizeof(struct devstats));
+    return false;
+}
+
+void Mesh::resetStats() {
+#ifdef MESH_STATS
+    memset(&_stats, 0, sizeof(_stats));
+    for (struct device *d = _devlist; d; d = d->next) {
+        memset(&d->stats, 0, sizeof(d->stats));
+    }
+#endif
+}
+
+uint16_t Mesh::getQueueDepth(uint8_t priority) {
+    uint16_t depth = 0;
+    if (priority <= PriorityNormal) {
+        for (struct device *d = _devlist; d; d = d->next) {
+            depth += (uint8_t)(d->queue[priority].head - d->queue[priority].tail);
+        }
+    }
+    return depth;
+}
+
+uint32_t Mesh::getQueueSojourn(uint8_t priority) {
+    if (priority > PriorityNormal || _txStats[priority].sent == 0) {
+        return 0;
+    }
+    return _txStats[priority].sojourn / _txStats[priority].sent;
+}
 
 void Mesh::sendIAM() {
     for (struct device *d = _devlist; d; d = d->next) {
@@ -10,207 +320,1567 @@ void Mesh::sendIAM() {
         pkt.ttl = 1; // Never forward
         pkt.datalen = d->dev->getHardwareAddress(pkt.data);
         calcCS(&pkt);
-        d->dev->broadcastPacket((uint8_t *)&pkt);
+        queuePacket(d, NULL, &pkt, PriorityControl);
+        _ctrlBytes += sizeof(struct packet);
+    }
+}
+
+// ICAN frames start with the ID of the next hop that all the routes in
+// the frame go through (Direct for our own neighbours) followed by
+// three bytes per route: ID and our cost to reach it.  Grouping by next
+// hop lets a neighbour spot routes that lead back through itself.
+void Mesh::addICANEntry(struct packet *frames, uint8_t &used, uint16_t via, uint16_t id, uint8_t cost) {
+    struct packet *pkt = NULL;
+    for (int i = 0; i < used; i++) {
+        if (((frames[i].data[0] << 8) | frames[i].data[1]) == via) {
+            pkt = &frames[i];
+            break;
+        }
+    }
+    if (pkt == NULL) {
+        if (used < MESH_ICAN_FRAMES) {
+            pkt = &frames[used++];
+        } else {
+            pkt = &frames[0];
+            sendControl(pkt);
+        }
+        pkt->sender = _id;
+        pkt->receiver = Broadcast;
+        pkt->type = ICAN;
+        pkt->ttl = 1;
+        pkt->data[0] = via >> 8;
+        pkt->data[1] = via & 0xFF;
+        pkt->datalen = 2;
+    }
+    pkt->data[pkt->datalen++] = id >> 8;
+    pkt->data[pkt->datalen++] = id & 0xFF;
+    pkt->data[pkt->datalen++] = cost;
+    if (pkt->datalen + 3 > MTU) {
+        sendControl(pkt);
+        pkt->datalen = 2;
+    }
+}
+
+// Announce either every destination we know (full) or just those that
+// have changed since the last announcement, plus any we have lost.
+void Mesh::sendICAN(boolean full) {
+    _icanBusy = true;
+    _icanFull = full;
+    _icanNext = 0;
+    continueICAN();
+}
+
+// An update stops when the control queue is nearly full and carries on
+// from the same slot once it has drained, rather than overflow it.
+void Mesh::continueICAN() {
+    struct packet frames[MESH_ICAN_FRAMES];
+    uint8_t used = 0;
+    uint16_t first = _icanNext;
+
+    for (; _icanNext < MESH_ROUTE_SLOTS; _icanNext++) {
+        if (!_icanFull && _changes == 0) {
+            _icanNext = MESH_ROUTE_SLOTS;
+            break;
+        }
+        // Each slot can finish one frame, and the ones in hand
+        // have to be sent if we stop
+        if (controlRoom() <= MESH_ICAN_FRAMES) {
+            break;
+        }
+        // A big table is walked over several calls on a budget
+        if (_icanNext != first && (_icanNext & 15) == 0 && overBudget()) {
+            break;
+        }
+        boolean changed = false;
+        for (struct host *h = _routes[_icanNext]; h; h = h->next) {
+            if (h->flags & HOST_CHANGED) {
+                changed = true;
+                h->flags &= ~HOST_CHANGED;
+                _changes--;
+            }
+        }
+        if (_routes[_icanNext] && (_icanFull || changed)) {
+            struct host *best = bestRoute(_routes[_icanNext]->id);
+            if (best != NULL && !(best->flags & HOST_PROVISIONAL)) {
+                addICANEntry(frames, used, best->nexthop, best->id, best->cost);
+            } else if (best == NULL && changed) {
+                // Routes we can't use are no use to the neighbours either
+                addICANEntry(frames, used, Direct, _routes[_icanNext]->id, Unreachable);
+            }
+        }
+    }
+    // Withdrawals can finish another frame on their way out
+    if (_icanNext == MESH_ROUTE_SLOTS && controlRoom() > MESH_ICAN_FRAMES + 1) {
+        for (int i = 0; i < _withdrawCount; i++) {
+            addICANEntry(frames, used, Direct, _withdrawn[i], Unreachable);
+        }
+        _withdrawCount = 0;
+        _icanBusy = false;
+    }
+    for (int i = 0; i < used; i++) {
+        if (frames[i].datalen > 2) {
+            sendControl(&frames[i]);
+        }
+    }
+}
+
+// Free control queue entries on the fullest device
+uint8_t Mesh::controlRoom() {
+    uint8_t room = MESH_TXQ_CONTROL;
+    for (struct device *d = _devlist; d; d = d->next) {
+        uint8_t depth = d->queue[PriorityControl].head - d->queue[PriorityControl].tail;
+        room = min(room, (uint8_t)(MESH_TXQ_CONTROL - depth));
+    }
+    return room;
+}
+
+void Mesh::routeChanged(struct host *hst) {
+    _routeGen++;
+    MESH_COUNT(_stats.routeChanges);
+    if (!(hst->flags & HOST_CHANGED)) {
+        hst->flags |= HOST_CHANGED;
+        _changes++;
+    }
+}
+
+void Mesh::routeLost(uint16_t id) {
+    _routeGen++;
+    struct host *h = getRoutes(id);
+    if (h != NULL) {
+        routeChanged(h);
+        return;
+    }
+    for (int i = 0; i < _withdrawCount; i++) {
+        if (_withdrawn[i] == id) {
+            return;
+        }
+    }
+    // If the list overflows the neighbours will time the route out instead
+    if (_withdrawCount < MESH_WITHDRAW_SLOTS) {
+        _withdrawn[_withdrawCount++] = id;
+    }
+}
+
+// Losing the cheapest route to a host holds it down.  Later losses
+// while it is held can only lower the limit.
+void Mesh::holdDown(struct host *hst) {
+    for (struct host *h = getRoutes(hst->id); h; h = h->next) {
+        if (h->cost < hst->cost) {
+            return;
+        }
+    }
+    struct holddown *hd = NULL;
+    for (int i = 0; i < _holdCount; i++) {
+        if (_holddown[i].id == hst->id) {
+            _holddown[i].cost = min(_holddown[i].cost, hst->cost);
+            return;
+        }
+        if (hd == NULL || (int32_t)(_holddown[i].since - hd->since) < 0) {
+            hd = &_holddown[i];
+        }
+    }
+    // When they are all in use the oldest is let go early
+    if (_holdCount < MESH_HOLDDOWN_SLOTS) {
+        hd = &_holddown[_holdCount++];
+    }
+    hd->id = hst->id;
+    hd->cost = hst->cost;
+    hd->since = millis();
+}
+
+// Dearest route to id that may be used
+uint8_t Mesh::holdLimit(uint16_t id) {
+    for (int i = 0; i < _holdCount; i++) {
+        if (_holddown[i].id == id) {
+            return _holddown[i].cost;
+        }
+    }
+    return 255;
+}
+
+// Whatever routes are left once a hold down is over are good again
+void Mesh::expireHolddowns() {
+    for (int i = 0; i < _holdCount; ) {
+        if (millis() - _holddown[i].since <= MESH_HOLDDOWN_TIME) {
+            i++;
+            continue;
+        }
+        struct host *h = getRoutes(_holddown[i].id);
+        _holddown[i] = _holddown[--_holdCount];
+        if (h != NULL) {
+            routeChanged(h);
+        }
+    }
+}
+
+uint16_t Mesh::hashId(uint16_t id) {
+    uint16_t h = id * 40503U;
+    h ^= h >> 7;
+    return h;
+}
+
+uint16_t Mesh::hashSlot(uint16_t id) const {
+    return hashId(id) & (MESH_ROUTE_SLOTS - 1);
+}
+
+int Mesh::findSlot(uint16_t id) const {
+    uint16_t mask = MESH_ROUTE_SLOTS - 1;
+    for (uint16_t i = hashSlot(id); _routes[i]; i = (i + 1) & mask) {
+        if (_routes[i]->id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void Mesh::insertSlot(struct host *hst) {
+    uint16_t mask = MESH_ROUTE_SLOTS - 1;
+    uint16_t i = hashSlot(hst->id);
+    while (_routes[i]) {
+        i = (i + 1) & mask;
+    }
+    _routes[i] = hst;
+}
+
+// Backward shift deletion - pull later members of the probe
+// sequence into the hole so lookups never need tombstones.
+void Mesh::removeSlot(int slot) {
+    uint16_t mask = MESH_ROUTE_SLOTS - 1;
+    uint16_t i = slot;
+    _routes[i] = NULL;
+    for (uint16_t j = (i + 1) & mask; _routes[j]; j = (j + 1) & mask) {
+        uint16_t k = hashSlot(_routes[j]->id);
+        if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+            _routes[i] = _routes[j];
+            _routes[j] = NULL;
+            i = j;
+        }
+    }
+    _routeCount--;
+}
+
+struct host *Mesh::getRoutes(uint16_t id) const {
+    int slot = findSlot(id);
+    if (slot < 0) {
+        return NULL;
+    }
+    return _routes[slot];
+}
+
+void Mesh::deleteHost(struct host *hst) {
+    int slot = findSlot(hst->id);
+    if (slot < 0) {
+        return;
+    }
+    if (_routes[slot] == hst) {
+        if (hst->next) {
+            _routes[slot] = hst->next;
+        } else {
+            removeSlot(slot);
+        }
+    } else {
+        struct host *h = _routes[slot];
+        while (h->next && h->next != hst) {
+            h = h->next;
+        }
+        if (h->next == NULL) {
+            return;
+        }
+        h->next = hst->next;
+    }
+    if (hst->flags & HOST_CHANGED) {
+        _changes--;
+    }
+    expiryUnlink(hst);
+    hst->next = _freehosts;
+    _freehosts = hst;
+    MESH_COUNT(_stats.routesRemoved);
+    holdDown(hst);
+    routeLost(hst->id);
+
+    // Routes through a neighbour we have lost go with it, so that a
+    // dearer route through someone else takes over straight away
+    if (hst->nexthop == Direct) {
+        struct host *h = _oldest[1];
+        while (h != NULL) {
+            struct host *newer = h->newer;
+            if (h->nexthop == hst->id) {
+                deleteHost(h);
+            }
+            h = newer;
+        }
+    }
+}
+
+// Whether there is another route to the same host
+boolean Mesh::isAlternate(struct host *hst) {
+    int slot = findSlot(hst->id);
+    return slot >= 0 && (_routes[slot] != hst || hst->next != NULL);
+}
+
+// When the pool is exhausted the least useful remote route makes way:
+// one of several to the same host before the only route to one, then
+// the highest cost, then the oldest.  Direct neighbours are only ever
+// displaced by another direct neighbour.
+//
+// Finding it means walking the whole table, so the answer is kept until
+// the routes next change.  A full pool turns most new routes away, and
+// a routing update full of them then costs one walk, not one each.
+// Refreshes don't count as changes, so the oldest of equals may be a
+// little out of date.
+struct host *Mesh::evictionVictim(uint16_t nexthop) {
+    if (_victimGen != _routeGen) {
+        _victimGen = _routeGen;
+        _victim = NULL;
+        boolean victimAlternate = false;
+        for (int i = 0; i < MESH_ROUTE_SLOTS; i++) {
+            boolean alternate = _routes[i] != NULL && _routes[i]->next != NULL;
+            for (struct host *h = _routes[i]; h; h = h->next) {
+                if (_victim == NULL) {
+                    _victim = h;
+                    victimAlternate = alternate;
+                    continue;
+                }
+                if ((h->nexthop == Direct) != (_victim->nexthop == Direct)) {
+                    if (_victim->nexthop == Direct) {
+                        _victim = h;
+                        victimAlternate = alternate;
+                    }
+                    continue;
+                }
+                if (alternate != victimAlternate) {
+                    if (alternate) {
+                        _victim = h;
+                        victimAlternate = true;
+                    }
+                    continue;
+                }
+                if (h->cost > _victim->cost || (h->cost == _victim->cost && (int32_t)(_victim->lastseen - h->lastseen) > 0)) {
+                    _victim = h;
+                    victimAlternate = alternate;
+                }
+            }
+        }
+    }
+    if (_victim == NULL || (_victim->nexthop == Direct && nexthop != Direct)) {
+        return NULL;
+    }
+    return _victim;
+}
+
+// A route to a host we have no other way to reach always gets in ahead
+// of a spare route to another; otherwise a cheaper one has to turn up.
+struct host *Mesh::allocHost(uint16_t nexthop, uint8_t cost, boolean alternate) {
+    if (_freehosts == NULL) {
+        struct host *victim = evictionVictim(nexthop);
+        if (victim == NULL) {
+            return NULL;
+        }
+        if (nexthop != Direct && victim->cost <= cost && (alternate || !isAlternate(victim))) {
+            return NULL;
+        }
+        deleteHost(victim);
+        _evictions++;
+    }
+    struct host *h = _freehosts;
+    _freehosts = h->next;
+    return h;
+}
+
+void Mesh::expiryAppend(struct host *hst) {
+    uint8_t c = routeClass(hst);
+    hst->newer = NULL;
+    hst->older = _newest[c];
+    if (_newest[c]) {
+        _newest[c]->newer = hst;
+    } else {
+        _oldest[c] = hst;
+    }
+    _newest[c] = hst;
+}
+
+void Mesh::expiryUnlink(struct host *hst) {
+    uint8_t c = routeClass(hst);
+    if (hst->older) {
+        hst->older->newer = hst->newer;
+    } else {
+        _oldest[c] = hst->newer;
+    }
+    if (hst->newer) {
+        hst->newer->older = hst->older;
+    } else {
+        _newest[c] = hst->older;
+    }
+}
+
+// Only the oldest route of each class ever needs looking at, so a pass
+// with nothing due costs two comparisons.
+void Mesh::expireHosts() {
+    uint32_t now = millis();
+    uint8_t batch = 0;
+    for (int c = 0; c < 2; c++) {
+        while (_oldest[c] && now - _oldest[c]->lastseen > _timeout[c]) {
+            if (batch == MESH_EXPIRE_BATCH || (batch > 0 && overBudget())) {
+                return;
+            }
+            batch++;
+            deleteHost(_oldest[c]);
+        }
+    }
+}
+
+struct host *Mesh::getHost(uint16_t id, uint16_t nexthop) {
+    for (struct host *h = getRoutes(id); h; h = h->next) {
+        if (h->nexthop == nexthop) {
+            return h;
+        }
+    }
+    return NULL;
+}
+
+void Mesh::addRoute(uint16_t id, uint16_t nexthop, uint8_t cost, L2 *dev, uint8_t hwlen, uint8_t *hwaddr) {
+    // Point blank refuse to add myself!
+
+    if (id == _id) {
+        return;
+    }
+
+    int slot = findSlot(id);
+    struct host *exist = NULL;
+    if (slot >= 0) {
+        // Routes through other neighbours are kept even for a host we
+        // can hear directly, since a poor link may cost more than them.
+        for (struct host *h = _routes[slot]; h; h = h->next) {
+            if (h->nexthop == nexthop) {
+                exist = h;
+            }
+        }
+    }
+
+    if (exist != NULL) {
+        if (nexthop == Direct) {
+            memcpy(exist->hwaddr, hwaddr, min(hwlen, MESH_HWADDR_LEN));
+        }
+        // A restored route is only passed on once it has been heard
+        if (exist->device != dev || exist->cost != cost || (exist->flags & HOST_PROVISIONAL)) {
+            routeChanged(exist);
+        }
+        exist->flags &= ~HOST_PROVISIONAL;
+        exist->device = dev;
+        exist->cost = cost;
+        exist->lastseen = millis();
+        expiryUnlink(exist);
+        expiryAppend(exist);
+        return;
+    }
+
+    struct host *newhost = allocHost(nexthop, cost, slot >= 0);
+    if (newhost == NULL) {
+        return;
+    }
+    // Eviction may have reshuffled the table
+    slot = findSlot(id);
+
+    newhost->id = id;
+    newhost->device = dev;
+    newhost->lastseen = millis();
+    newhost->nexthop = nexthop;
+    newhost->cost = cost;
+    newhost->flags = 0;
+    newhost->etx = 16;
+    if (nexthop == Direct) {
+        memcpy(newhost->hwaddr, hwaddr, min(hwlen, MESH_HWADDR_LEN));
+    }
+
+    if (slot >= 0) {
+        newhost->next = _routes[slot];
+        _routes[slot] = newhost;
+    } else {
+        newhost->next = NULL;
+        insertSlot(newhost);
+        _routeCount++;
+    }
+    expiryAppend(newhost);
+    MESH_COUNT(_stats.routesAdded);
+    routeChanged(newhost);
+
+    // Bring a new neighbour up to date without waiting for the next
+    // scheduled full update
+    if (nexthop == Direct) {
+        _fullPending = true;
+        _groupsChanged = _groupsChanged || _groupCount > 0;
+    }
+}
+
+void Mesh::addRoutesFromPacket(struct packet *pkt, L2 *dev) {
+    if (pkt->datalen < 2) {
+        return;
+    }
+    uint16_t via = (pkt->data[0] << 8) | pkt->data[1];
+    uint8_t link = linkCost(pkt->sender);
+
+    for (int i = 2; i + 2 < pkt->datalen; i += 3) {
+        uint16_t id = (pkt->data[i] << 8) | pkt->data[i+1];
+        uint8_t cost = pkt->data[i+2];
+
+        if (via == Direct) {
+            noteTwoHop(pkt->sender, id, cost != Unreachable);
+        }
+
+        // Split horizon: a route the sender reaches through us is no
+        // use to us, and neither is one the sender has lost.
+        if (via == _id || cost == Unreachable || cost + link > MESH_MAX_COST) {
+            struct host *h = getHost(id, pkt->sender);
+            if (h != NULL) {
+                deleteHost(h);
+            } else if (via == _id && bestRoute(id) == NULL) {
+                // Still counting on us for a host we have lost, so
+                // it missed the withdrawal
+                routeLost(id);
+            }
+            continue;
+        }
+
+        addRoute(id, pkt->sender, cost + link, dev, 0, NULL);
+    }
+}
+
+uint8_t Mesh::linkCost(uint16_t neighbour) {
+    struct host *h = getHost(neighbour, Direct);
+    if (h == NULL) {
+        return MESH_LINK_UNIT;
+    }
+    return h->cost;
+}
+
+uint8_t Mesh::getLinkETX(uint16_t id) {
+    struct host *h = getHost(id, Direct);
+    if (h == NULL) {
+        return 0;
+    }
+    return h->etx;
+}
+
+// Fold each neighbour's latest delivery counts into its ETX.  A batch
+// with nothing delivered counts as the worst the radio can do.
+void Mesh::updateLinkCosts() {
+    if (millis() - _lastETX < MESH_ETX_INTERVAL) {
+        return;
+    }
+    _lastETX = millis();
+
+    struct host *next;
+    for (struct host *h = _oldest[0]; h; h = next) {
+        next = h->newer;
+        struct linkstats ls;
+        if (!h->device->readLinkStats(h->hwaddr, &ls) || ls.frames == 0) {
+            continue;
+        }
+        uint32_t sample = 255;
+        if (ls.delivered > 0) {
+            sample = min((uint32_t)ls.attempts * 16 / ls.delivered, 255UL);
+        }
+        h->etx = constrain((int)h->etx + ((int)sample - (int)h->etx) / MESH_ETX_WEIGHT, 16, 255);
+
+        int cost = constrain((h->etx * MESH_LINK_UNIT + 8) / 16, MESH_LINK_UNIT, MESH_MAX_COST);
+        if (abs(cost - h->cost) * MESH_ETX_HYSTERESIS > h->cost) {
+            setLinkCost(h, cost);
+        }
+    }
+}
+
+// Routes through a neighbour move by as much as the link to it does
+void Mesh::setLinkCost(struct host *hst, uint8_t cost) {
+    int delta = cost - hst->cost;
+    hst->cost = cost;
+    routeChanged(hst);
+
+    struct host *next;
+    for (struct host *h = _oldest[1]; h; h = next) {
+        next = h->newer;
+        if (h->nexthop != hst->id) {
+            continue;
+        }
+        if (h->cost + delta > MESH_MAX_COST) {
+            deleteHost(h);
+        } else {
+            h->cost += delta;
+            routeChanged(h);
+        }
+    }
+}
+
+// Only routes through a neighbour we have count.  An ICAN can arrive
+// before the sender's IAM, and we can't send to it until that does.
+// Neither do routes dearer than a held down host's limit.
+struct host *Mesh::bestRoute(uint16_t dest) {
+    struct host *least = NULL;
+    uint8_t limit = _holdCount > 0 ? holdLimit(dest) : 255;
+    for (struct host *h = getRoutes(dest); h; h = h->next) {
+        if (h->nexthop != Direct && getHost(h->nexthop, Direct) == NULL) {
+            continue;
+        }
+        if (h->cost > limit) {
+            continue;
+        }
+        if (least == NULL || h->cost < least->cost) {
+            least = h;
+        }
+    }
+    return least;
+}
+
+// Find the direct neighbours that the cheapest routes to dest go
+// through, up to MESH_MAX_PATHS of them.  None if dest can't be reached.
+uint8_t Mesh::resolveRoutes(uint16_t dest, struct host **hops) {
+    struct host *least = bestRoute(dest);
+    if (least == NULL) {
+        return 0;
+    }
+    uint8_t paths = 0;
+    for (struct host *h = getRoutes(dest); h && paths < MESH_MAX_PATHS; h = h->next) {
+        if (h->cost != least->cost) {
+            continue;
+        }
+        struct host *hop = h->nexthop == Direct ? h : getHost(h->nexthop, Direct);
+        if (hop != NULL) {
+            hops[paths++] = hop;
+        }
+    }
+    return paths;
+}
+
+struct fibentry *Mesh::lookupFIB(uint16_t dest) {
+    struct fibentry *f = &_fib[hashId(dest) & (MESH_FIB_SLOTS - 1)];
+    if (f->dest != dest || f->gen != _routeGen) {
+        f->dest = dest;
+        f->gen = _routeGen;
+        f->paths = resolveRoutes(dest, f->hops);
+    }
+    return f;
+}
+
+// With more than one path each flow takes the one that scores highest
+// for it.  Its packets stay in order, and losing a path only moves the
+// flows that were on it.
+struct host *Mesh::getLeastCostRoute(uint16_t dest, uint16_t source) {
+    if (dest == Direct || dest == Broadcast) {
+        return NULL;
+    }
+    struct fibentry *f = lookupFIB(dest);
+    if (f->paths == 0) {
+        return NULL;
+    }
+    struct host *best = f->hops[0];
+    uint32_t bestScore = 0;
+    uint16_t flow = hashId(hashId(source) ^ dest);
+    for (int i = 0; i < f->paths && f->paths > 1; i++) {
+        struct host *h = f->hops[i];
+        uint32_t score = hashId(flow ^ hashId(h->id)) + 1UL;
+        if (_pathWeighting) {
+            score = score * 16 / max(h->etx, 16);
+        }
+        if (score > bestScore) {
+            best = h;
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+uint8_t Mesh::getPathCount(uint16_t id) {
+    if (id == Direct || id == Broadcast) {
+        return 0;
+    }
+    return lookupFIB(id)->paths;
+}
+
+void Mesh::processPacket(struct packet *pkt, struct device *d) {
+    if (_ledpin != 255) { digitalWrite(_ledpin, HIGH); }
+
+    if (isGroup(pkt->receiver)) {
+        if (pkt->type == FLOOD) {
+            processFlood(pkt);
+        }
+    } else if (pkt->receiver == Broadcast) {
+        switch (pkt->type) {
+            case IAM:
+                addHostFromPacket(pkt, d->dev);
+                break;
+            case ICAN:
+                addRoutesFromPacket(pkt, d->dev);
+                break;
+            case FRAG:
+                processFragment(pkt);
+                break;
+            case FLOOD:
+                processFlood(pkt);
+                break;
+            default:
+                deliver(true, pkt->sender, pkt->type, pkt->data, pkt->datalen);
+        }
+    } else {
+        if (pkt->receiver != _id) {
+            pkt->ttl--;
+            if (pkt->ttl > 0) {
+                struct host *hop = getLeastCostRoute(pkt->receiver, pkt->sender);
+                if (hop != NULL) {
+                    struct device *out = findDevice(hop->device);
+                    if (queuePacket(out, hop, pkt, PriorityForward) == L2::Queued) {
+                        MESH_COUNT(out->stats.forwarded);
+                    }
+                } else {
+                    MESH_COUNT(d->stats.noRoute);
+                }
+            } else {
+                MESH_COUNT(d->stats.ttlExpired);
+            }
+        } else {
+            switch (pkt->type) {
+                case FRAG:
+                    processFragment(pkt);
+                    break;
+                case AGGR:
+                    processAggregate(pkt);
+                    break;
+                case STREAM:
+                    processStream(pkt);
+                    break;
+                default:
+                    deliver(false, pkt->sender, pkt->type, pkt->data, pkt->datalen);
+            }
+        }
+    }
+    if (_ledpin != 255) { digitalWrite(_ledpin, LOW); }
+}
+
+void Mesh::deliver(boolean broadcast, uint16_t sender, uint8_t type, uint8_t *data, uint16_t len) {
+    if (broadcast) {
+        if (_broadcastMessageCallback) {
+            _broadcastMessageCallback(sender, type, data, len);
+        } else if (_broadcastCallback && len <= 255) {
+            _broadcastCallback(sender, type, data, len);
+        }
+    } else {
+        if (_unicastMessageCallback) {
+            _unicastMessageCallback(sender, type, data, len);
+        } else if (_unicastCallback && len <= 255) {
+            _unicastCallback(sender, type, data, len);
+        }
+    }
+}
+
+// Find the slot collecting a message, or claim one for it.  A sender
+// already using its share of the slots gives up its oldest message.
+struct fragslot *Mesh::getFragSlot(uint16_t sender, uint8_t msgid, boolean broadcast) {
+    struct fragslot *spare = NULL;
+    struct fragslot *oldest = NULL;
+    uint8_t inuse = 0;
+
+    for (int i = 0; i < MESH_FRAG_SLOTS; i++) {
+        struct fragslot *f = &_frags[i];
+        if (f->busy && millis() - f->started > MESH_FRAG_TIMEOUT) {
+            f->busy = false;
+            _fragDrops += f->received;
+        }
+        if (!f->busy) {
+            if (spare == NULL) {
+                spare = f;
+            }
+            continue;
+        }
+        if (f->sender == sender && f->broadcast == broadcast) {
+            if (f->msgid == msgid) {
+                return f;
+            }
+            inuse++;
+            if (oldest == NULL || (int32_t)(oldest->started - f->started) > 0) {
+                oldest = f;
+            }
+        }
+    }
+
+    if (inuse >= MESH_FRAG_PER_SENDER) {
+        _fragDrops += oldest->received;
+        spare = oldest;
+    }
+    if (spare == NULL) {
+        return NULL;
+    }
+
+    spare->busy = true;
+    spare->sender = sender;
+    spare->msgid = msgid;
+    spare->broadcast = broadcast;
+    spare->received = 0;
+    spare->len = 0;
+    spare->started = millis();
+    memset(spare->have, 0, sizeof(spare->have));
+    return spare;
+}
+
+void Mesh::processFragment(struct packet *pkt) {
+    if (pkt->datalen < 4) {
+        return;
+    }
+    uint8_t idx = pkt->data[2];
+    uint8_t count = pkt->data[3];
+    uint8_t chunk = pkt->datalen - 4;
+
+    if (idx >= count || idx * FragMTU + chunk > MESH_FRAG_MAXLEN) {
+        _fragDrops++;
+        return;
+    }
+
+    struct fragslot *f = getFragSlot(pkt->sender, pkt->data[1], pkt->receiver == Broadcast);
+    if (f == NULL) {
+        _fragDrops++;
+        return;
+    }
+
+    if (f->have[idx >> 3] & (1 << (idx & 7))) {
+        return; // Duplicate
+    }
+    f->have[idx >> 3] |= (1 << (idx & 7));
+    f->type = pkt->data[0];
+    f->count = count;
+    f->received++;
+    memcpy(f->data + idx * FragMTU, pkt->data + 4, chunk);
+    if (idx == count - 1) {
+        f->len = idx * FragMTU + chunk;
+    }
+
+    if (f->received == f->count) {
+        f->busy = false;
+        deliver(f->broadcast, f->sender, f->type, f->data, f->len);
+    }
+}
+
+// Only one message goes out in fragments at a time.  What the queue has
+// no room for now waits for queueFragments() to be called from process(),
+// so the message is on its way once this returns true.
+boolean Mesh::sendFragments(uint16_t destination, uint8_t type, uint8_t *data, int len, uint8_t priority) {
+    if (_fragOut.busy || len > MESH_FRAG_MAXLEN) {
+        return false;
+    }
+    struct fragsend *f = &_fragOut;
+    f->destination = destination;
+    f->type = type;
+    f->msgid = _fragId++;
+    f->count = (len + FragMTU - 1) / FragMTU;
+    f->next = 0;
+    f->priority = priority;
+    f->len = len;
+    f->started = millis();
+    memcpy(f->data, data, len);
+    f->busy = true;
+    queueFragments();
+    return f->busy || f->next == f->count;
+}
+
+// Queue as many of the fragments still to go as there is room and time
+// for.  The message is abandoned if the route goes, or if it is still
+// going when the receiver would have given up on it.
+void Mesh::queueFragments() {
+    struct fragsend *f = &_fragOut;
+    f->waiting = false;
+    while (f->busy) {
+        struct host *h = getLeastCostRoute(f->destination);
+        if (h == NULL) {
+            MESH_COUNT(_stats.sendNoRoute);
+            f->busy = false;
+            return;
+        }
+        if (millis() - f->started > MESH_FRAG_TIMEOUT) {
+            f->busy = false;
+            return;
+        }
+        // Not counted as a drop when it only has to wait its turn
+        struct device *d = findDevice(h->device);
+        if (d != NULL && f->priority <= PriorityNormal) {
+            struct txqueue *q = &d->queue[f->priority];
+            if ((uint8_t)(q->head - q->tail) > q->mask) {
+                f->waiting = true;
+                return;
+            }
+        }
+        if (f->next > 0 && overBudget()) {
+            return;
+        }
+        struct packet pkt;
+        int chunk = min(f->len - f->next * FragMTU, FragMTU);
+        pkt.sender = _id;
+        pkt.receiver = f->destination;
+        pkt.type = FRAG;
+        pkt.ttl = 255;
+        pkt.datalen = chunk + 4;
+        pkt.data[0] = f->type;
+        pkt.data[1] = f->msgid;
+        pkt.data[2] = f->next;
+        pkt.data[3] = f->count;
+        memcpy(pkt.data + 4, f->data + f->next * FragMTU, chunk);
+        calcCS(&pkt);
+
+        if (queuePacket(d, h, &pkt, f->priority) != L2::Queued) {
+            f->busy = false;
+            return;
+        }
+        if (++f->next == f->count) {
+            f->busy = false;
+        }
+    }
+}
+
+void Mesh::setAggregation(uint32_t delay) {
+    if (delay == 0) {
+        flush();
+    }
+    _aggrDelay = delay;
+}
+
+// Add a message to the frame waiting for its destination, starting one
+// if there isn't one.  A frame that can't take it goes now, as does the
+// longest waiting one when every slot is in use.
+boolean Mesh::aggregate(uint16_t destination, uint8_t type, uint8_t *data, uint8_t len) {
+    if (getLeastCostRoute(destination) == NULL) {
+        MESH_COUNT(_stats.sendNoRoute);
+        return false;
+    }
+    struct aggrslot *a = NULL;
+    struct aggrslot *spare = NULL;
+    for (int i = 0; i < MESH_AGGR_SLOTS; i++) {
+        struct aggrslot *s = &_aggr[i];
+        if (s->busy && s->pkt.receiver == destination) {
+            a = s;
+            break;
+        }
+        if (spare == NULL || (spare->busy && (!s->busy || (int32_t)(s->started - spare->started) < 0))) {
+            spare = s;
+        }
+    }
+    if (a != NULL && a->pkt.datalen + AggrHeader + len > MTU) {
+        sendAggregate(a);
+    }
+    if (a == NULL || !a->busy) {
+        if (a == NULL) {
+            a = spare;
+            if (a->busy) {
+                sendAggregate(a);
+            }
+        }
+        a->busy = true;
+        a->count = 0;
+        a->started = millis();
+        a->pkt.sender = _id;
+        a->pkt.receiver = destination;
+        a->pkt.type = AGGR;
+        a->pkt.ttl = 255;
+        a->pkt.datalen = 0;
+    }
+    a->pkt.data[a->pkt.datalen++] = type;
+    a->pkt.data[a->pkt.datalen++] = len;
+    if (len > 0) {
+        memcpy(a->pkt.data + a->pkt.datalen, data, len);
+        a->pkt.datalen += len;
+    }
+    a->count++;
+    // No room for even an empty message, so there's no point waiting
+    if (a->pkt.datalen + AggrHeader > MTU) {
+        sendAggregate(a);
+    }
+    return true;
+}
+
+// A frame holding just the one message goes as a plain packet
+void Mesh::sendAggregate(struct aggrslot *a) {
+    a->busy = false;
+    struct host *h = getLeastCostRoute(a->pkt.receiver);
+    if (h == NULL) {
+        return;
+    }
+    if (a->count == 1) {
+        uint8_t len = a->pkt.data[1];
+        a->pkt.type = a->pkt.data[0];
+        memmove(a->pkt.data, a->pkt.data + AggrHeader, len);
+        a->pkt.datalen = len;
+    } else {
+        _aggrFrames++;
+        _aggrMessages += a->count;
+    }
+    calcCS(&a->pkt);
+    queuePacket(findDevice(h->device), h, &a->pkt, PriorityNormal);
+}
+
+// Send the frames for destination (or all of them for Broadcast), or
+// with due only those that have waited long enough.
+void Mesh::flushAggregates(uint16_t destination, boolean due) {
+    for (int i = 0; i < MESH_AGGR_SLOTS; i++) {
+        struct aggrslot *a = &_aggr[i];
+        if (!a->busy) {
+            continue;
+        }
+        if (destination != Broadcast && a->pkt.receiver != destination) {
+            continue;
+        }
+        if (due && millis() - a->started < _aggrDelay) {
+            continue;
+        }
+        sendAggregate(a);
+    }
+}
+
+// Hand each message to the unicast callback in the order they were
+// packed.  A record running off the end of the frame ends it.
+void Mesh::processAggregate(struct packet *pkt) {
+    uint8_t pos = 0;
+    while (pos + AggrHeader <= pkt->datalen) {
+        uint8_t type = pkt->data[pos];
+        uint8_t len = pkt->data[pos + 1];
+        pos += AggrHeader;
+        if (pos + len > pkt->datalen) {
+            return;
+        }
+        deliver(false, pkt->sender, type, pkt->data + pos, len);
+        pos += len;
+    }
+}
+
+// Two hop table.  Entries are dropped when the neighbour withdraws them
+// or hasn't mentioned them for as long as a remote route would last.
+void Mesh::noteTwoHop(uint16_t via, uint16_t id, boolean reachable) {
+    if (id == _id) {
+        return;
+    }
+    struct twohop *spare = NULL;
+    for (int i = 0; i < MESH_TWOHOP_SLOTS; i++) {
+        struct twohop *t = &_twohop[i];
+        if (t->via == via && t->id == id) {
+            if (reachable) {
+                t->lastseen = millis();
+            } else {
+                t->via = Direct;
+            }
+            return;
+        }
+        if (t->via == Direct || millis() - t->lastseen > _timeout[1]) {
+            spare = t;
+        } else if (spare == NULL || (spare->via != Direct && t->lastseen < spare->lastseen)) {
+            spare = t;
+        }
+    }
+    if (reachable) {
+        spare->via = via;
+        spare->id = id;
+        spare->lastseen = millis();
+    }
+}
+
+boolean Mesh::hasTwoHop(uint16_t via, uint16_t id) {
+    for (int i = 0; i < MESH_TWOHOP_SLOTS; i++) {
+        struct twohop *t = &_twohop[i];
+        if (t->via == via && t->id == id) {
+            return millis() - t->lastseen <= _timeout[1];
+        }
+    }
+    return false;
+}
+
+// Two generations of Bloom filter: look in both, add to the current one.
+// Three bits per flood are taken from one well mixed hash.
+boolean Mesh::floodSeen(uint16_t sender, uint16_t seq, boolean remember) {
+    uint32_t h = ((uint32_t)sender << 16) | seq;
+    h ^= h >> 16;
+    h *= 0x85EBCA6BUL;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35UL;
+    h ^= h >> 16;
+
+    uint16_t bits[3];
+    for (int i = 0; i < 3; i++) {
+        bits[i] = (h >> (i * 10)) % MESH_FLOOD_FILTER_BITS;
+    }
+
+    for (int g = 0; g < 2; g++) {
+        boolean all = true;
+        for (int i = 0; i < 3; i++) {
+            if (!(_floodFilter[g][bits[i] >> 3] & (1 << (bits[i] & 7)))) {
+                all = false;
+                break;
+            }
+        }
+        if (all) {
+            return true;
+        }
+    }
+
+    if (remember) {
+        if (_floodEntries >= MESH_FLOOD_FILTER_ENTRIES) {
+            _floodGen ^= 1;
+            memset(_floodFilter[_floodGen], 0, sizeof(_floodFilter[_floodGen]));
+            _floodEntries = 0;
+        }
+        for (int i = 0; i < 3; i++) {
+            _floodFilter[_floodGen][bits[i] >> 3] |= (1 << (bits[i] & 7));
+        }
+        _floodEntries++;
+    }
+    return false;
+}
+
+// Relaying is only worth it if one of our neighbours isn't a neighbour
+// of any node we have heard the flood from (or the one that started it).
+boolean Mesh::floodUseful(struct floodrelay *r) {
+    if (r->pkt.receiver != Broadcast) {
+        return groupRelay(r, NULL);
+    }
+    if (!_relayPruning) {
+        return true;
+    }
+    for (struct host *h = _oldest[0]; h; h = h->newer) {
+        if (h->id == r->pkt.sender) {
+            continue;
+        }
+        boolean covered = false;
+        for (int i = 0; i < r->heard && !covered; i++) {
+            covered = h->id == r->from[i] || hasTwoHop(r->from[i], h->id);
+        }
+        if (!covered) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void Mesh::processFlood(struct packet *pkt) {
+    if (pkt->datalen < MTU - FloodMTU || pkt->sender == _id) {
+        return;
+    }
+    uint16_t seq = (pkt->data[1] << 8) | pkt->data[2];
+    uint16_t from = (pkt->data[3] << 8) | pkt->data[4];
+
+    if (floodSeen(pkt->sender, seq, true)) {
+        _floodDuplicates++;
+        // Another copy of one we're waiting to relay: note who sent it
+        for (int i = 0; i < MESH_FLOOD_QUEUE; i++) {
+            struct floodrelay *r = &_floodQueue[i];
+            if (r->busy && r->pkt.sender == pkt->sender &&
+                r->pkt.data[1] == pkt->data[1] && r->pkt.data[2] == pkt->data[2]) {
+                if (r->heard < MESH_FLOOD_HEARD) {
+                    r->from[r->heard++] = from;
+                }
+                break;
+            }
+        }
+        return;
     }
-}
 
-void Mesh::sendICAN() {
-    for (struct device *d = _devlist; d; d = d->next) {
-        struct packet pkt = {_id, Broadcast, ICAN, 1, 0, 0};
-        for (struct host *h = _hostlist; h; h = h->next) {
-            pkt.data[pkt.datalen++] = h->id >> 8;
-            pkt.data[pkt.datalen++] = h->id & 0xFF;
-            pkt.data[pkt.datalen++] = h->cost + 1;
-            if (pkt.datalen == 24) {
-            calcCS(&pkt);
-                d->dev->broadcastPacket((uint8_t *)&pkt);
-                pkt.datalen = 0;
+    if (pkt->ttl > 1) {
+        struct floodrelay *r = NULL;
+        for (int i = 0; i < MESH_FLOOD_QUEUE; i++) {
+            if (!_floodQueue[i].busy) {
+                r = &_floodQueue[i];
+                break;
             }
         }
-        if (pkt.datalen > 0) {
-            calcCS(&pkt);
-            d->dev->broadcastPacket((uint8_t *)&pkt);
+        if (r == NULL) {
+            _floodDrops++;
+        } else {
+            memcpy(&r->pkt, pkt, sizeof(struct packet));
+            r->heard = 0;
+            r->from[r->heard++] = from;
+            if (!floodUseful(r)) {
+                _floodPruned++;
+            } else {
+                r->pkt.ttl--;
+                r->pkt.data[3] = _id >> 8;
+                r->pkt.data[4] = _id & 0xFF;
+                calcCS(&r->pkt);
+                r->due = millis() + random(MESH_FLOOD_JITTER + 1);
+                r->busy = true;
+            }
         }
     }
-}
 
-void Mesh::deleteHost(struct host *hst) {
-    if (_hostlist == hst) {
-        _hostlist = _hostlist->next;
-        free(hst->hwaddr);
-        free(hst);
-        return;
-    }
-    for (struct host *h = _hostlist; h->next; h = h->next) {
-        if (h->next == hst) {
-            h->next = hst->next;
-            free(hst->hwaddr);
-            free(hst);
-            return;
+    if (pkt->receiver == Broadcast && pkt->data[0] == GROUPS) {
+        processGroupReport(pkt->sender, pkt->data + 5, pkt->datalen - 5);
+    } else if (pkt->receiver == Broadcast) {
+        _floodDelivered++;
+        deliver(true, pkt->sender, pkt->data[0], pkt->data + 5, pkt->datalen - 5);
+    } else if (inGroup(pkt->receiver)) {
+        _floodDelivered++;
+        if (_groupCallback) {
+            _groupCallback(pkt->receiver, pkt->sender, pkt->data[0], pkt->data + 5, pkt->datalen - 5);
+        } else {
+            deliver(true, pkt->sender, pkt->data[0], pkt->data + 5, pkt->datalen - 5);
         }
     }
 }
 
-void Mesh::expireHosts() {
-    for (struct host *h = _hostlist; h; h = h->next) {
-        if (millis() - h->lastseen > 30000) {
-            deleteHost(h);
-            return;
+void Mesh::relayFloods() {
+    for (int i = 0; i < MESH_FLOOD_QUEUE; i++) {
+        struct floodrelay *r = &_floodQueue[i];
+        if (r->busy && (int32_t)(millis() - r->due) >= 0) {
+            r->busy = false;
+            boolean hw = false;
+            if (r->pkt.receiver == Broadcast ? !floodUseful(r) : !groupRelay(r, &hw)) {
+                _floodPruned++;
+                continue;
+            }
+            for (struct device *d = _devlist; d; d = d->next) {
+                queuePacket(d, NULL, &r->pkt, PriorityForward, hw ? r->pkt.receiver : Broadcast);
+                _floodSent++;
+            }
         }
     }
 }
 
-struct host *Mesh::getHost(uint16_t id, uint16_t nexthop) {
-    for (struct host *h = _hostlist; h; h = h->next) {
-        if (h->id == id && h->nexthop == nexthop) {
-            return h;
-        }
+boolean Mesh::floodPacket(uint8_t type, uint8_t *data, uint8_t len, uint8_t hops) {
+    if (type >= IAM) {
+        return false;
     }
-    return NULL;
+    return sendFlood(Broadcast, type, data, len, hops);
 }
 
-void Mesh::addRoute(uint16_t id, uint16_t nexthop, uint8_t cost, L2 *dev, uint8_t hwlen, uint8_t *hwaddr) {
-    // Point blank refuse to add myself!
+// A flood to a group only goes out if it has members we can reach
+boolean Mesh::sendFlood(uint16_t receiver, uint8_t type, uint8_t *data, uint8_t len, uint8_t hops) {
+    if (len > FloodMTU || hops == 0 || _id == Direct || _id == Broadcast) {
+        return false;
+    }
+    struct floodrelay r;
+    struct packet &pkt = r.pkt;
+    pkt.sender = _id;
+    pkt.receiver = receiver;
+    pkt.type = FLOOD;
+    pkt.ttl = hops;
+    pkt.datalen = len + 5;
+    pkt.data[0] = type;
+    pkt.data[1] = _floodSeq >> 8;
+    pkt.data[2] = _floodSeq & 0xFF;
+    pkt.data[3] = _id >> 8;
+    pkt.data[4] = _id & 0xFF;
+    if (len > 0) {
+        memcpy(pkt.data + 5, data, len);
+    }
+    calcCS(&pkt);
 
-    if (id == _id) {
-        return;
+    boolean hw = false;
+    r.heard = 0;
+    if (receiver != Broadcast && !groupRelay(&r, &hw)) {
+        return false;
     }
+    floodSeen(_id, _floodSeq, true);
+    _floodSeq++;
 
-    // Not interested in routes we're directly connected to
-    if (nexthop != Direct) {
-        struct host *direct = getHost(id, Direct);
-        if (direct != NULL) {
-            return;
+    boolean queued = false;
+    for (struct device *d = _devlist; d; d = d->next) {
+        if (queuePacket(d, NULL, &pkt, PriorityNormal, hw ? receiver : Broadcast) == L2::Queued) {
+            queued = true;
         }
+        _floodSent++;
     }
+    return queued;
+}
 
-    struct host *exist = getHost(id, nexthop);
-    if (exist != NULL) {
-        if (nexthop == Direct) {
-            exist->hwaddr = (uint8_t *)realloc(exist->hwaddr, hwlen);
-            memcpy(exist->hwaddr, hwaddr, hwlen);
+// A group flood is only worth sending if a member we know of is reached
+// through a neighbour that hasn't already had it.  It can go to the
+// group's hardware address if all those neighbours are members whose
+// radios filter for it; anyone else would miss it.
+boolean Mesh::groupRelay(struct floodrelay *r, boolean *hw) {
+    uint16_t group = r->pkt.receiver;
+    boolean needed = false;
+    boolean filtered = true;
+    for (int i = 0; i < MESH_GROUP_MEMBERS; i++) {
+        struct groupmember *m = &_members[i];
+        if (m->group != group || millis() - m->lastseen > MESH_GROUP_TIMEOUT ||
+            m->host == _id || m->host == r->pkt.sender) {
+            continue;
+        }
+        struct host *h = getLeastCostRoute(m->host, r->pkt.sender);
+        if (h == NULL) {
+            continue;
+        }
+        boolean covered = false;
+        for (int j = 0; j < r->heard && !covered; j++) {
+            covered = h->id == r->from[j];
+        }
+        if (!covered) {
+            needed = true;
+            if (!memberHW(group, h->id)) {
+                filtered = false;
+            }
         }
-        exist->device = dev;
-        exist->nexthop = nexthop;
-        exist->cost = cost;
-        exist->lastseen = millis();
-        return;
     }
-
-    struct host *newhost = (struct host *)malloc(sizeof(struct host));
-    newhost->id = id;
-    newhost->device = dev;
-    newhost->lastseen = millis();
-    newhost->nexthop = nexthop;
-    newhost->cost = cost;
-    if (nexthop == Direct) {
-        newhost->hwaddr = (uint8_t *)malloc(hwlen);
-        memcpy(newhost->hwaddr, hwaddr, hwlen);
+    if (hw != NULL) {
+        *hw = filtered;
     }
-    newhost->next = NULL;
-    
-    if (_hostlist == NULL) {
-        _hostlist = newhost;
-    } else {
-        struct host *h = _hostlist;
-        while (h->next) {
-            h = h->next;
+    return needed;
+}
+
+boolean Mesh::memberHW(uint16_t group, uint16_t host) {
+    for (int i = 0; i < MESH_GROUP_MEMBERS; i++) {
+        struct groupmember *m = &_members[i];
+        if (m->group == group && m->host == host) {
+            return m->hw && millis() - m->lastseen <= MESH_GROUP_TIMEOUT;
         }
-        h->next = newhost;
     }
+    return false;
 }
 
-void Mesh::addRoutesFromPacket(struct packet *pkt, L2 *dev) {
-    for (int i = 0; i < pkt->datalen; i += 3) {
-        uint16_t id = (pkt->data[i] << 8) | pkt->data[i+1];
-        uint8_t cost = pkt->data[i+2];
-
-        addRoute(id, pkt->sender, cost, dev, 0, NULL);
+boolean Mesh::joinGroup(uint16_t group) {
+    if (!isGroup(group) || inGroup(group)) {
+        return isGroup(group);
+    }
+    if (_groupCount >= MESH_MAX_GROUPS) {
+        return false;
+    }
+    boolean hw = _devlist != NULL;
+    for (struct device *d = _devlist; d; d = d->next) {
+        if (!d->dev->joinGroup(group)) {
+            hw = false;
+        }
     }
+    _groups[_groupCount] = group;
+    _groupHW[_groupCount] = hw;
+    _groupCount++;
+    _groupsChanged = true;
+    return true;
 }
 
-struct host *Mesh::getLeastCostRoute(uint16_t dest) {
-    struct host *least = NULL;
-    uint8_t leastcost = 255;
-    for (struct host *h = _hostlist; h; h = h->next) {
-        if (h->id == dest) {
-            if (h->cost < leastcost) {
-                leastcost = h->cost;
-                least = h;
+void Mesh::leaveGroup(uint16_t group) {
+    for (int i = 0; i < _groupCount; i++) {
+        if (_groups[i] == group) {
+            for (struct device *d = _devlist; d; d = d->next) {
+                d->dev->leaveGroup(group);
             }
+            _groupCount--;
+            _groups[i] = _groups[_groupCount];
+            _groupHW[i] = _groupHW[_groupCount];
+            _groupsChanged = true;
+            return;
         }
     }
-    if (least->nexthop == Direct) {
-        return least;
+}
+
+boolean Mesh::inGroup(uint16_t group) {
+    for (int i = 0; i < _groupCount; i++) {
+        if (_groups[i] == group) {
+            return true;
+        }
     }
-    
-    for (struct host *h = _hostlist; h; h = h->next) {
-        if (h->id == least->nexthop && h->nexthop == Direct) {
-            return h;
+    return false;
+}
+
+uint8_t Mesh::getGroupMembers(uint16_t group) {
+    uint8_t count = 0;
+    for (int i = 0; i < MESH_GROUP_MEMBERS; i++) {
+        if (_members[i].group == group && millis() - _members[i].lastseen <= MESH_GROUP_TIMEOUT) {
+            count++;
         }
     }
-    return NULL;
+    return count;
 }
 
-void Mesh::processPacket(struct packet *pkt, L2 *dev) {
-    if (_ledpin != 255) { digitalWrite(_ledpin, HIGH); }
+// Our groups, three bytes each: the group and whether we filter for it
+// in hardware.  An empty report clears out ones we have left.
+void Mesh::sendGroupReport() {
+    uint8_t data[MESH_MAX_GROUPS * 3];
+    for (int i = 0; i < _groupCount; i++) {
+        data[i * 3] = _groups[i] >> 8;
+        data[i * 3 + 1] = _groups[i] & 0xFF;
+        data[i * 3 + 2] = _groupHW[i] ? 1 : 0;
+    }
+    _lastGroupReport = millis();
+    _groupJitter = jitter(MESH_GROUP_INTERVAL);
+    _groupsChanged = false;
+    sendFlood(Broadcast, GROUPS, data, _groupCount * 3, MESH_FLOOD_TTL);
+}
 
-    if (pkt->receiver == Broadcast) {
-        switch (pkt->type) {
-            case IAM:
-                addHostFromPacket(pkt, dev);
-                break;
-            case ICAN:
-                addRoutesFromPacket(pkt, dev);
+// A report replaces everything the sender told us before.  New
+// memberships take a free or expired entry, or else the stalest.
+void Mesh::processGroupReport(uint16_t sender, uint8_t *data, uint8_t len) {
+    for (int i = 0; i < MESH_GROUP_MEMBERS; i++) {
+        if (_members[i].host == sender) {
+            _members[i].group = 0;
+        }
+    }
+    for (int n = 0; n + 3 <= len; n += 3) {
+        uint16_t group = (data[n] << 8) | data[n + 1];
+        if (!isGroup(group)) {
+            continue;
+        }
+        struct groupmember *slot = &_members[0];
+        for (int i = 0; i < MESH_GROUP_MEMBERS; i++) {
+            struct groupmember *m = &_members[i];
+            if (m->group == 0 || millis() - m->lastseen > MESH_GROUP_TIMEOUT) {
+                slot = m;
                 break;
-            default:
-                if (_broadcastCallback) {
-                    _broadcastCallback(pkt->sender, pkt->type, pkt->data, pkt->datalen);
-                }
+            }
+            if ((int32_t)(m->lastseen - slot->lastseen) < 0) {
+                slot = m;
+            }
         }
-    } else {
-        if (pkt->receiver != _id) {
-            pkt->ttl--;
-            if (pkt->ttl > 0) {
-                struct host *hop = getLeastCostRoute(pkt->receiver);
-                if (hop != NULL) {
-                    // Need to recalculate checksum after reducing TTL
-                    calcCS(pkt);
+        slot->group = group;
+        slot->host = sender;
+        slot->hw = data[n + 2] & 1;
+        slot->lastseen = millis();
+    }
+}
 
-                    hop->device->unicastPacket(hop->hwaddr, (uint8_t *)pkt);
-                }
+// Established connections get first refusal so a repeated SYN can't
+// open a second connection on a listening stream.
+void Mesh::processStream(struct packet *pkt) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (MeshStream *s = _streams; s; s = s->_next) {
+            if ((s->_state == MeshStream::Listen) != (pass == 1)) {
+                continue;
             }
-        } else {
-            switch (pkt->type) {
-                default:
-                    if (_unicastCallback) {
-                        _unicastCallback(pkt->sender, pkt->type, pkt->data, pkt->datalen);
-                    }
+            if (s->handlePacket(pkt->sender, pkt->data, pkt->datalen)) {
+                return;
             }
         }
     }
-    if (_ledpin != 255) { digitalWrite(_ledpin, LOW); }
 }
 
-void Mesh::receivePackets() {
-    for (struct device *d = _devlist; d; d = d->next) {
-        if (d->dev->available()) {
-            struct packet pkt;
-            d->dev->readPacket((uint8_t *)&pkt);
-            if (checkCS(&pkt)) {
-                processPacket(&pkt, d->dev);
+void Mesh::pollStreams() {
+    for (MeshStream *s = _streams; s; s = s->_next) {
+        s->poll();
+    }
+}
+
+// len is 0 from devices that can't tell how much they received, which
+// always give us a whole frame.  A frame cut short counts as bad.
+void Mesh::receiveFrame(struct device *d, struct packet *pkt, uint8_t len) {
+    MESH_COUNT(d->stats.rx);
+    boolean whole = len == 0 || (len >= FrameHeader && len >= frameLength(pkt));
+    if (whole && checkCS(pkt)) {
+        processPacket(pkt, d);
+    } else {
+        MESH_COUNT(d->stats.badCRC);
+    }
+}
+
+// Take a frame from each device in turn, starting after the last one
+// read from, so a busy device can't starve the others.  Without a
+// budget that is one pass; with one it goes on until every device is
+// empty or the time is up.
+void Mesh::receivePackets(struct device *skip) {
+    boolean got;
+    do {
+        got = false;
+        for (uint8_t i = 0; i < _devcount; i++) {
+            struct device *d = &_devpool[_rxNext];
+            _rxNext = (_rxNext + 1) % _devcount;
+            if (d != skip && d->dev->available()) {
+                struct packet pkt;
+                uint8_t len = d->dev->readFrame((uint8_t *)&pkt);
+                receiveFrame(d, &pkt, len);
+                got = true;
+                if (overBudget()) {
+                    return;
+                }
             }
         }
+    } while (got && _budget > 0);
+}
+
+// Run the mesh for up to budget us, or one pass of everything if it is
+// 0.  However short the budget, each call makes some progress: at least
+// one frame is read and the management timers are checked.  Route
+// expiry and routing updates that run out of time carry on next call.
+// Returns true if there is more to do straight away, so
+//
+//   while (mymesh.process(500));
+//
+// runs until idle in 500us slices.
+boolean Mesh::process(uint32_t budget) {
+    processStart(budget);
+    receivePackets();
+    processWork();
+    serviceQueues();
+    processEnd();
+    return workPending();
+}
+
+// Anything process() could get on with now rather than waiting for a
+// timer, the radio or the control token bucket.  Frames for a device
+// that is full, and fragments waiting for them to go, wait on the radio.
+boolean Mesh::workPending() {
+    for (struct device *d = _devlist; d; d = d->next) {
+        uint8_t p;
+        if (d->dev->available() || (!d->full && nextFrame(d, p) != NULL)) {
+            return true;
+        }
+    }
+    uint32_t now = millis();
+    for (int c = 0; c < 2; c++) {
+        if (_oldest[c] && now - _oldest[c]->lastseen > _timeout[c]) {
+            return true;
+        }
+    }
+    for (int i = 0; i < MESH_FLOOD_QUEUE; i++) {
+        if (_floodQueue[i].busy && (int32_t)(now - _floodQueue[i].due) >= 0) {
+            return true;
+        }
+    }
+    for (int i = 0; i < MESH_AGGR_SLOTS; i++) {
+        if (_aggr[i].busy && now - _aggr[i].started >= _aggrDelay) {
+            return true;
+        }
     }
+    if (_fragOut.busy && !_fragOut.waiting) {
+        return true;
+    }
+    if (_saving) {
+        return true;
+    }
+    return _icanBusy && controlRoom() > MESH_ICAN_FRAMES;
 }
 
 void Mesh::sendManagementData() {
-    if (millis() - _lastMGMTSend > 5000) {
+    if (millis() - _ctrlStart >= MESH_STATS_INTERVAL) {
+        _ctrlStart = millis();
+        _ctrlBytesLast = _ctrlBytes;
+        _ctrlBytes = 0;
+    }
+
+    if (_id == Direct || _id == Broadcast) {
+        return;
+    }
+
+    if (millis() - _lastMGMTSend > MESH_IAM_INTERVAL - _iamJitter) {
         _lastMGMTSend = millis();
-        if (_id != Direct && _id != Broadcast) {
-            sendIAM();
-            sendICAN();
-        }
+        _iamJitter = jitter(MESH_IAM_INTERVAL);
+        sendIAM();
+    }
+
+    // Nobody to tell until we have heard from somebody
+    if (_routeCount > 0 &&
+        ((_groupsChanged && millis() - _lastGroupReport > MESH_TRIGGER_HOLDDOWN + _triggerJitter) ||
+        (_groupCount > 0 && millis() - _lastGroupReport > MESH_GROUP_INTERVAL - _groupJitter))) {
+        sendGroupReport();
+    }
+
+    if (_icanBusy) {
+        continueICAN();
+    } else if (millis() - _lastFull > MESH_FULL_INTERVAL - _fullJitter ||
+        (_fullPending && millis() - _lastFull > MESH_FULL_HOLDDOWN + _triggerJitter)) {
+        _lastFull = millis();
+        _lastTriggered = millis();
+        _fullJitter = jitter(MESH_FULL_INTERVAL);
+        _triggerJitter = jitter(MESH_TRIGGER_HOLDDOWN);
+        _fullPending = false;
+        sendICAN(true);
+    } else if ((_changes > 0 || _withdrawCount > 0) && millis() - _lastTriggered > MESH_TRIGGER_HOLDDOWN + _triggerJitter) {
+        _lastTriggered = millis();
+        _triggerJitter = jitter(MESH_TRIGGER_HOLDDOWN);
+        sendICAN(false);
+    }
+
+    if (_saving) {
+        continueSave(true);
+    } else if (_store != NULL && _savedGen != _routeGen && millis() - _lastSave > MESH_SNAPSHOT_INTERVAL) {
+        startSave();
+        continueSave(true);
     }
 }
 
@@ -220,9 +1890,39 @@ void Mesh::addDevice(L2 &dev) {
             return;
         }
     }
-    struct device *newdev = (struct device *)malloc(sizeof(struct device));
+    if (_devcount >= MESH_MAX_DEVICES) {
+        return;
+    }
+    struct device *newdev = &_devpool[_devcount];
     newdev->dev = &dev;
     newdev->next = NULL;
+    for (int p = PriorityControl; p <= PriorityNormal; p++) {
+        struct txqueue *q = &newdev->queue[p];
+        if (p == PriorityControl) {
+            q->ring = _txControl[_devcount];
+            q->mask = MESH_TXQ_CONTROL - 1;
+        } else {
+            q->ring = _txData[_devcount][p - 1];
+            q->mask = MESH_TXQ_DEPTH - 1;
+        }
+        q->head = 0;
+        q->tail = 0;
+    }
+    newdev->full = false;
+    for (int i = 0; i < _groupCount; i++) {
+        if (!dev.joinGroup(_groups[i]) && _groupHW[i]) {
+            _groupHW[i] = false;
+            _groupsChanged = true;
+        }
+    }
+    newdev->tokens = 1000UL * MESH_CTRL_BURST;
+    newdev->lastRefill = millis();
+    newdev->retune = false;
+    newdev->channelGen = 0;
+#ifdef MESH_STATS
+    memset(&newdev->stats, 0, sizeof(newdev->stats));
+#endif
+    _devcount++;
     if (_devlist == NULL) {
         _devlist = newdev;
     } else {
@@ -232,13 +1932,86 @@ void Mesh::addDevice(L2 &dev) {
         }
         d->next = newdev;
     }
+    tuneDevices();
+}
+
+// Index into _channels of a node's home channel.  It follows from the
+// ID, so neighbours need no room to remember it.  Spread evenly whether
+// IDs are handed out in order or at random.
+uint8_t Mesh::homeChannel(uint16_t id) {
+    if (_channelCount < 2) {
+        return 0;
+    }
+    return ((uint16_t)(id * 40503U) >> 8) % _channelCount;
 }
 
-boolean Mesh::sendPacket(int destination, uint8_t type, uint8_t *data, int len) {
+void Mesh::setChannels(const uint8_t *channels, uint8_t count) {
+    _channelCount = min(count, MESH_MAX_CHANNELS);
+    memcpy(_channels, channels, _channelCount);
+    tuneDevices();
+}
+
+void Mesh::tuneDevices() {
+    if (_channelCount == 0) {
+        return;
+    }
+    uint8_t home = _channels[homeChannel(_id)];
+    for (struct device *d = _devlist; d; d = d->next) {
+        d->retune = d->dev->setChannel(home) && _channelCount > 1;
+        d->channelGen = _routeGen - 1;
+    }
+}
+
+// The channels a broadcast has to go out on to reach every neighbour.
+// IAM beacons go out on all of them, as that's how neighbours are found.
+uint8_t Mesh::broadcastChannels(struct device *d, struct packet *pkt) {
+    if (!d->retune) {
+        return 1;
+    }
+    if (pkt->type == IAM) {
+        return (1 << _channelCount) - 1;
+    }
+    if (d->channelGen != _routeGen) {
+        d->channelGen = _routeGen;
+        d->neighbourChannels = 0;
+        for (struct host *h = _oldest[0]; h; h = h->newer) {
+            if (h->device == d->dev) {
+                d->neighbourChannels |= 1 << homeChannel(h->id);
+            }
+        }
+    }
+    // Nobody to hear it yet, but it may as well go somewhere
+    return d->neighbourChannels ? d->neighbourChannels : 1 << homeChannel(_id);
+}
+
+// The types from IAM up belong to the mesh itself, which sends them
+// with sendMessage() and sendFlood()
+boolean Mesh::sendPacket(int destination, uint8_t type, uint8_t *data, int len, uint8_t priority) {
+    if (type >= IAM) {
+        return false;
+    }
+    return sendMessage(destination, type, data, len, priority);
+}
+
+boolean Mesh::sendMessage(int destination, uint8_t type, uint8_t *data, int len, uint8_t priority) {
+    if (isGroup(destination)) {
+        return len <= FloodMTU && sendFlood(destination, type, data, len, MESH_FLOOD_TTL);
+    }
+    if (_aggrDelay > 0) {
+        if (priority == PriorityNormal && type < IAM && len + AggrHeader <= MTU) {
+            return aggregate(destination, type, data, len);
+        }
+        // Anything already waiting for the host goes first
+        flushAggregates(destination, false);
+    }
     struct host *h = getLeastCostRoute(destination);
     if (h == NULL) {
+        MESH_COUNT(_stats.sendNoRoute);
         return false;
     }
+    if (len > MTU) {
+        return sendFragments(destination, type, data, len, priority);
+    }
     struct packet pkt;
     pkt.sender = _id;
     pkt.receiver = destination;
@@ -246,23 +2019,25 @@ boolean Mesh::sendPacket(int destination, uint8_t type, uint8_t *data, int len)
     pkt.ttl = 255;
     pkt.datalen = len;
     if (len > 0) {
-        memcpy(pkt.data, data, min(len, MTU));
+        memcpy(pkt.data, data, len);
     }
     calcCS(&pkt);
-    h->device->unicastPacket(h->hwaddr, (uint8_t *)&pkt);
-    return true;
+    return queuePacket(findDevice(h->device), h, &pkt, priority) == L2::Queued;
 }
 
 boolean Mesh::knowHost(uint16_t id) {
     if (id == Direct || id == Broadcast) {
         return false;
     }
-    for (struct host *h = _hostlist; h; h = h->next) {
-        if (h->id == id) {
-            return true;
-        }
+    return findSlot(id) >= 0;
+}
+
+uint16_t Mesh::getNextHop(uint16_t id) {
+    struct host *h = getLeastCostRoute(id);
+    if (h == NULL) {
+        return Broadcast;
     }
-    return false;
+    return h->id;
 }
 
 
@@ -284,12 +2059,33 @@ size_t Mesh::printTo(Print &p) const {
             }
             l += p.print(buf[i], HEX);
         }
+#ifdef MESH_STATS
+        l += p.print(" rx ");
+        l += p.print(d->stats.rx);
+        l += p.print(" tx ");
+        l += p.print(d->stats.tx);
+        l += p.print(" fwd ");
+        l += p.print(d->stats.forwarded);
+        l += p.print(" drop crc/ttl/route/full/dev ");
+        l += p.print(d->stats.badCRC);
+        l += p.print("/");
+        l += p.print(d->stats.ttlExpired);
+        l += p.print("/");
+        l += p.print(d->stats.noRoute);
+        l += p.print("/");
+        l += p.print(d->stats.queueFull);
+        l += p.print("/");
+        l += p.print(d->stats.txDropped);
+#endif
         l += p.println();
     }
     l += p.println("Directly connected hosts:");
 
-    for (struct host *h = _hostlist; h; h = h->next) {
-        if (h->nexthop == Direct) {
+    for (int slot = 0; slot < MESH_ROUTE_SLOTS; slot++) {
+        for (struct host *h = _routes[slot]; h; h = h->next) {
+            if (h->nexthop != Direct) {
+                continue;
+            }
             l += p.print("    ");
             l += p.print(h->id);
             l += p.print(" on ");
@@ -323,8 +2119,11 @@ size_t Mesh::printTo(Print &p) const {
 
     l += p.println("Known remote hosts:");
 
-    for (struct host *h = _hostlist; h; h = h->next) {
-        if (h->nexthop != Direct) {
+    for (int i = 0; i < MESH_ROUTE_SLOTS; i++) {
+        for (struct host *h = _routes[i]; h; h = h->next) {
+            if (h->nexthop == Direct) {
+                continue;
+            }
             l += p.print("    ");
             l += p.print(h->id);
             l += p.print(" via ");
@@ -337,19 +2136,277 @@ size_t Mesh::printTo(Print &p) const {
     return l;
 }
 
-void Mesh::calcCS(struct packet *pkt) {
-    uint8_t cs = 0;
-    pkt->csum = 0;
-    for (int i = 0; i < 32; i++) {
-        cs += pkt->bytes[i];
+// CRC-16/CCITT (poly 0x1021, initial 0xFFFF), one table lookup a byte.
+static const uint16_t crcTable[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0,
+};
+
+static uint16_t crc16(uint16_t crc, const uint8_t *data, uint8_t len) {
+    while (len--) {
+        crc = (crc << 8) ^ crcTable[(crc >> 8) ^ *data++];
     }
-    pkt->csum = (256 - cs);
+    return crc;
+}
+
+// The CRC covers the header apart from the TTL, and only the data bytes
+// actually in use.  Leaving the TTL out means forwarding a packet never
+// has to touch the CRC.
+uint16_t Mesh::packetCRC(struct packet *pkt) {
+    uint16_t crc = crc16(0xFFFF, pkt->bytes, 5); // sender, receiver, type
+    crc = crc16(crc, &pkt->datalen, 1);
+    return crc16(crc, pkt->data, pkt->datalen);
+}
+
+void Mesh::calcCS(struct packet *pkt) {
+    pkt->crc = packetCRC(pkt);
 }
 
 boolean Mesh::checkCS(struct packet *pkt) {
-    uint8_t cs = 0;
-    for (int i = 0; i < 32; i++) {
-        cs += pkt->bytes[i];
+    if (pkt->datalen > MTU) {
+        return false;
+    }
+    return pkt->crc == packetCRC(pkt);
+}
+
+// Neighbours are kept with their device and hardware address, everything
+// else by its best route.  Costs are rounded up to whole link units.  A
+// slot with nothing to keep just has an ID of Broadcast, as erased EEPROM
+// does.  Returns the bytes of the slot in use.
+uint8_t Mesh::snapshotRecord(struct host *hst, uint8_t *rec) {
+    rec[0] = Broadcast >> 8;
+    rec[1] = Broadcast & 0xFF;
+    if (getHost(hst->id, hst->nexthop) != hst || (hst->flags & HOST_PROVISIONAL)) {
+        return 2;
+    }
+    if (hst->nexthop != Direct && bestRoute(hst->id) != hst) {
+        return 2;
+    }
+    uint8_t units = (hst->cost + MESH_LINK_UNIT - 1) / MESH_LINK_UNIT;
+    rec[0] = hst->id >> 8;
+    rec[1] = hst->id & 0xFF;
+    rec[2] = hst->nexthop >> 8;
+    rec[3] = hst->nexthop & 0xFF;
+    rec[4] = units;
+    if (hst->nexthop != Direct) {
+        return 5;
+    }
+    rec[5] = findDevice(hst->device) - _devpool;
+    memcpy(rec + 6, hst->hwaddr, MESH_HWADDR_LEN);
+    return SnapshotRecord;
+}
+
+// Host slots that fit in the store after the two headers
+uint16_t Mesh::snapshotSlots() {
+    uint16_t size = _store->size();
+    if (size < SnapshotHeader * 2) {
+        return 0;
+    }
+    return min((size - SnapshotHeader * 2) / SnapshotRecord, MESH_MAX_HOSTS);
+}
+
+uint8_t Mesh::loadRecord(uint16_t slot, uint8_t *rec) {
+    uint16_t addr = SnapshotHeader * 2 + slot * SnapshotRecord;
+    uint8_t len = 2;
+    for (uint8_t i = 0; i < len; i++) {
+        rec[i] = _store->read(addr + i);
+        if (i == 1 && ((rec[0] << 8) | rec[1]) != Broadcast) {
+            len = 5;
+        } else if (i == 3 && rec[2] == 0 && rec[3] == 0) {
+            len = SnapshotRecord;
+        }
+    }
+    return len;
+}
+
+// Read header copy n, returning false if it isn't one of ours.  Neither
+// copy is to be believed until the records match its CRC.
+boolean Mesh::loadHeader(uint8_t n, uint16_t &seq, uint16_t &crc) {
+    uint8_t hdr[SnapshotHeader];
+    for (uint8_t i = 0; i < SnapshotHeader; i++) {
+        hdr[i] = _store->read(n * SnapshotHeader + i);
+    }
+    if (hdr[0] != 'M' || hdr[1] != SnapshotVersion || ((hdr[2] << 8) | hdr[3]) != _id) {
+        return false;
+    }
+    seq = (hdr[4] << 8) | hdr[5];
+    crc = (hdr[6] << 8) | hdr[7];
+    return true;
+}
+
+// EEPROM wears out, so only bytes that differ are written
+void Mesh::storeBytes(uint16_t addr, const uint8_t *data, uint8_t len) {
+    for (uint8_t i = 0; i < len; i++) {
+        if (_store->read(addr + i) != data[i]) {
+            _store->write(addr + i, data[i]);
+        }
+    }
+}
+
+// A host keeps the slot of its entry in the host pool for as long as it
+// is in the table, so a save only writes the slots of routes that have
+// changed.  A new snapshot gets the sequence number after the newest
+// header already in the store, and its header goes in the other copy,
+// so each copy takes half the writes.
+void Mesh::startSave() {
+    _lastSave = millis();
+    _savedGen = _routeGen;
+    _saving = true;
+    _saveNext = 0;
+    _saveCRC = 0xFFFF;
+    _saveSeq = 0;
+    _saveLastCRC = 0;
+    _saveFound = false;
+    for (uint8_t n = 0; n < 2; n++) {
+        uint16_t seq, crc;
+        if (loadHeader(n, seq, crc) && (!_saveFound || (int16_t)(seq - _saveSeq) > 0)) {
+            _saveSeq = seq;
+            _saveLastCRC = crc;
+            _saveFound = true;
+        }
+    }
+}
+
+// Write slots until done or, if budgeted, until process() runs out of
+// time.  The header is written last, and only if the records changed: a
+// snapshot cut short by a reset fails the CRC in both copies and is
+// ignored.
+void Mesh::continueSave(boolean budgeted) {
+    uint16_t slots = snapshotSlots();
+    while (_saveNext < slots) {
+        uint8_t rec[SnapshotRecord];
+        uint8_t len = snapshotRecord(&_hostpool[_saveNext], rec);
+        storeBytes(SnapshotHeader * 2 + _saveNext * SnapshotRecord, rec, len);
+        _saveCRC = crc16(_saveCRC, rec, len);
+        _saveNext++;
+        if (budgeted && overBudget()) {
+            return;
+        }
+    }
+    if (slots > 0 && (!_saveFound || _saveCRC != _saveLastCRC)) {
+        _saveSeq++;
+        uint8_t hdr[SnapshotHeader] = {
+            'M', SnapshotVersion,
+            (uint8_t)(_id >> 8), (uint8_t)(_id & 0xFF),
+            (uint8_t)(_saveSeq >> 8), (uint8_t)(_saveSeq & 0xFF),
+            (uint8_t)(_saveCRC >> 8), (uint8_t)(_saveCRC & 0xFF)
+        };
+        storeBytes((_saveSeq & 1) * SnapshotHeader, hdr, SnapshotHeader);
+    }
+    _saving = false;
+    _store->commit();
+}
+
+boolean Mesh::saveRoutes() {
+    if (_store == NULL || _id == Direct || _id == Broadcast) {
+        return false;
+    }
+    startSave();
+    continueSave(false);
+    return true;
+}
+
+// Restored routes cost a link unit more than they did, so that anything
+// heard for real is preferred, and expire MESH_PROVISIONAL_TIME from now
+// unless they are heard again first.  They aren't marked as changed, so
+// they stay out of our updates until then.
+uint16_t Mesh::restoreRoutes() {
+    if (_store == NULL || _routeCount > 0 || _id == Direct || _id == Broadcast) {
+        return 0;
+    }
+    uint16_t slots = snapshotSlots();
+    if (slots == 0) {
+        return 0;
+    }
+
+    // Nothing is believed until a header's CRC matches the records
+    uint8_t rec[SnapshotRecord];
+    uint16_t crc = 0xFFFF;
+    for (uint16_t i = 0; i < slots; i++) {
+        crc = crc16(crc, rec, loadRecord(i, rec));
+    }
+    boolean valid = false;
+    for (uint8_t n = 0; n < 2 && !valid; n++) {
+        uint16_t seq, hdrCRC;
+        valid = loadHeader(n, seq, hdrCRC) && hdrCRC == crc;
+    }
+    if (!valid) {
+        return 0;
+    }
+
+    // Neighbours first, so remote routes can find their next hop
+    uint16_t restored = 0;
+    uint32_t now = millis();
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint16_t i = 0; i < slots; i++) {
+            loadRecord(i, rec);
+            uint16_t id = (rec[0] << 8) | rec[1];
+            uint16_t nexthop = (rec[2] << 8) | rec[3];
+            if (id == Broadcast || (nexthop == Direct) != (pass == 0)) {
+                continue;
+            }
+            L2 *dev;
+            if (nexthop == Direct) {
+                if (rec[5] >= _devcount) {
+                    continue;
+                }
+                dev = _devpool[rec[5]].dev;
+            } else {
+                struct host *via = getHost(nexthop, Direct);
+                if (via == NULL) {
+                    continue;
+                }
+                dev = via->device;
+            }
+            uint16_t cost = (rec[4] + 1) * MESH_LINK_UNIT;
+            if (cost > MESH_MAX_COST) {
+                continue;
+            }
+            addRoute(id, nexthop, cost, dev, MESH_HWADDR_LEN, rec + 6);
+            struct host *h = getHost(id, nexthop);
+            if (h == NULL) {
+                continue;
+            }
+            if (h->flags & HOST_CHANGED) {
+                _changes--;
+            }
+            h->flags = HOST_PROVISIONAL;
+            uint32_t timeout = _timeout[routeClass(h)];
+            if (timeout > MESH_PROVISIONAL_TIME) {
+                h->lastseen = now - (timeout - MESH_PROVISIONAL_TIME);
+            }
+            restored++;
+        }
     }
-    return cs == 0;
+    return restored;
 }
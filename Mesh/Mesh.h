@@ -3,22 +3,385 @@
 
 #include <Arduino.h>
 #include <L2.h>
+#include <MeshStore.h>
 
 /* The mesh class defines a layer three mesh system */
 
-struct device {
-    L2 *dev;
-    struct device *next;
-};
+class MeshStream;
+
+// All storage is allocated statically inside the Mesh object.  These
+// can be overridden from the compiler flags to suit the available RAM.
+
+// Maximum number of route entries (direct and remote) held at once.
+#ifndef MESH_MAX_HOSTS
+#define MESH_MAX_HOSTS 64
+#endif
+
+// Number of destination slots in the route table.  Must be a power of
+// two and larger than MESH_MAX_HOSTS so probe sequences stay short.
+#ifndef MESH_ROUTE_SLOTS
+#define MESH_ROUTE_SLOTS 128
+#endif
+
+#if (MESH_ROUTE_SLOTS & (MESH_ROUTE_SLOTS - 1)) != 0
+#error MESH_ROUTE_SLOTS must be a power of two
+#endif
+
+#if MESH_ROUTE_SLOTS <= MESH_MAX_HOSTS
+#error MESH_ROUTE_SLOTS must be larger than MESH_MAX_HOSTS
+#endif
+
+// Maximum number of L2 devices that can be attached.
+#ifndef MESH_MAX_DEVICES
+#define MESH_MAX_DEVICES 4
+#endif
+
+// Number of entries in the forwarding cache.  Must be a power of two.
+#ifndef MESH_FIB_SLOTS
+#define MESH_FIB_SLOTS 16
+#endif
+
+#if (MESH_FIB_SLOTS & (MESH_FIB_SLOTS - 1)) != 0
+#error MESH_FIB_SLOTS must be a power of two
+#endif
+
+// Equal cost multipath.  Traffic for a destination is shared between up
+// to MESH_MAX_PATHS neighbours whose routes to it cost the same, each
+// flow (sender and destination) keeping to one of them.  1 sends it all
+// one way.
+#ifndef MESH_MAX_PATHS
+#define MESH_MAX_PATHS 4
+#endif
+
+// Routes costing more than this are taken as unreachable.  Without a
+// limit a loop of three or more nodes keeps a dead route alive forever,
+// each one counting up to the cap and refreshing the others.
+#ifndef MESH_MAX_COST
+#define MESH_MAX_COST 250
+#endif
+
+// Link costs follow the expected number of transmissions (ETX) to each
+// neighbour, taken from the device's unicast retry counts.  A perfect
+// link costs MESH_LINK_UNIT.  Every MESH_ETX_INTERVAL ms the latest
+// counts are folded into an average with a weight of 1/MESH_ETX_WEIGHT.
+// A neighbour's cost only moves once the average has drifted more than
+// 1/MESH_ETX_HYSTERESIS away from it, so routes don't flap.
+#ifndef MESH_LINK_UNIT
+#define MESH_LINK_UNIT 4
+#endif
+
+#ifndef MESH_ETX_INTERVAL
+#define MESH_ETX_INTERVAL 1000
+#endif
+
+#ifndef MESH_ETX_WEIGHT
+#define MESH_ETX_WEIGHT 4
+#endif
+
+#ifndef MESH_ETX_HYSTERESIS
+#define MESH_ETX_HYSTERESIS 4
+#endif
+
+// Longest hardware address that can be stored for a neighbour.
+#ifndef MESH_HWADDR_LEN
+#define MESH_HWADDR_LEN 5
+#endif
+
+// Routing update timing (ms).  IAM beacons go out every
+// MESH_IAM_INTERVAL.  Changed routes are announced no more than once per
+// MESH_TRIGGER_HOLDDOWN, and the whole table is re-sent every
+// MESH_FULL_INTERVAL (or sooner, but never more often than
+// MESH_FULL_HOLDDOWN, when a new neighbour turns up).
+#ifndef MESH_IAM_INTERVAL
+#define MESH_IAM_INTERVAL 5000
+#endif
+
+#ifndef MESH_TRIGGER_HOLDDOWN
+#define MESH_TRIGGER_HOLDDOWN 250
+#endif
+
+#ifndef MESH_FULL_INTERVAL
+#define MESH_FULL_INTERVAL 10000
+#endif
+
+#ifndef MESH_FULL_HOLDDOWN
+#define MESH_FULL_HOLDDOWN 2000
+#endif
+
+// Up to 1/MESH_JITTER of each interval is varied at random so that
+// neighbours which happen to start in step don't stay that way, with
+// every update colliding with theirs.
+#ifndef MESH_JITTER
+#define MESH_JITTER 4
+#endif
+
+// Number of lost destinations remembered until the next update
+// announces them as unreachable.
+#ifndef MESH_WITHDRAW_SLOTS
+#define MESH_WITHDRAW_SLOTS 8
+#endif
+
+// A destination whose cheapest route is lost is held down for
+// MESH_HOLDDOWN_TIME ms, during which only routes to it costing no more
+// than the lost one are used.  A dearer one may well lead back through
+// us, and taking it would start the mesh counting to MESH_MAX_COST.  Up
+// to MESH_HOLDDOWN_SLOTS destinations are held at once.
+#ifndef MESH_HOLDDOWN_TIME
+#define MESH_HOLDDOWN_TIME 2000
+#endif
+
+#ifndef MESH_HOLDDOWN_SLOTS
+#define MESH_HOLDDOWN_SLOTS 8
+#endif
+
+// Number of ICAN frames (one per next hop) built up at once.
+#ifndef MESH_ICAN_FRAMES
+#define MESH_ICAN_FRAMES 3
+#endif
+
+// Period (ms) over which control traffic is totalled.
+#ifndef MESH_STATS_INTERVAL
+#define MESH_STATS_INTERVAL 60000
+#endif
+
+// How long (ms) a route lives without being refreshed, by route class.
+#ifndef MESH_DIRECT_TIMEOUT
+#define MESH_DIRECT_TIMEOUT 30000
+#endif
+
+#ifndef MESH_REMOTE_TIMEOUT
+#define MESH_REMOTE_TIMEOUT 30000
+#endif
+
+// Most routes expired by one housekeeping pass.
+#ifndef MESH_EXPIRE_BATCH
+#define MESH_EXPIRE_BATCH 8
+#endif
+
+// Reassembly of messages too big for one packet.  Up to MESH_FRAG_SLOTS
+// messages of at most MESH_FRAG_MAXLEN bytes can be in flight at once,
+// no more than MESH_FRAG_PER_SENDER of them from any one sender.  A
+// message not completed within MESH_FRAG_TIMEOUT ms is abandoned.
+#ifndef MESH_FRAG_SLOTS
+#define MESH_FRAG_SLOTS 2
+#endif
+
+#ifndef MESH_FRAG_MAXLEN
+#define MESH_FRAG_MAXLEN 512
+#endif
+
+#ifndef MESH_FRAG_PER_SENDER
+#define MESH_FRAG_PER_SENDER 1
+#endif
+
+#ifndef MESH_FRAG_TIMEOUT
+#define MESH_FRAG_TIMEOUT 2000
+#endif
+
+// Transmit queues, one set per device, served in strict priority order:
+// management frames, urgent application packets, forwarded packets and
+// then everything else.  Management frames are held to a token bucket of
+// MESH_CTRL_RATE frames per second with bursts of up to MESH_CTRL_BURST,
+// so a full routing dump can't shut out data.  Each entry takes about
+// 40 bytes.  Depths must be powers of two.
+#ifndef MESH_TXQ_CONTROL
+#define MESH_TXQ_CONTROL 8
+#endif
+
+#ifndef MESH_TXQ_DEPTH
+#define MESH_TXQ_DEPTH 4
+#endif
+
+#if MESH_TXQ_CONTROL <= MESH_ICAN_FRAMES + 1
+#error MESH_TXQ_CONTROL is too small to send a routing update
+#endif
+
+#ifndef MESH_CTRL_RATE
+#define MESH_CTRL_RATE 50
+#endif
+
+#ifndef MESH_CTRL_BURST
+#define MESH_CTRL_BURST 8
+#endif
+
+// Mesh wide broadcasts (floods).  Each node remembers the floods it has
+// seen in two Bloom filters of MESH_FLOOD_FILTER_BITS, swapping to the
+// other (and clearing it) after MESH_FLOOD_FILTER_ENTRIES.  Up to
+// MESH_FLOOD_QUEUE relays wait a random 0 to MESH_FLOOD_JITTER ms so
+// that neighbours don't all rebroadcast at once.  A waiting relay is
+// cancelled if copies heard from up to MESH_FLOOD_HEARD other relays
+// have already covered all of our neighbours.
+#ifndef MESH_FLOOD_TTL
+#define MESH_FLOOD_TTL 32
+#endif
+
+#ifndef MESH_FLOOD_FILTER_BITS
+#define MESH_FLOOD_FILTER_BITS 1024
+#endif
+
+#ifndef MESH_FLOOD_FILTER_ENTRIES
+#define MESH_FLOOD_FILTER_ENTRIES 32
+#endif
+
+#ifndef MESH_FLOOD_QUEUE
+#define MESH_FLOOD_QUEUE 4
+#endif
+
+#ifndef MESH_FLOOD_JITTER
+#define MESH_FLOOD_JITTER 8
+#endif
+
+#ifndef MESH_FLOOD_HEARD
+#define MESH_FLOOD_HEARD 4
+#endif
+
+// Neighbours of our neighbours, learned from their ICANs, so a relay
+// can tell when everyone around it has already heard a flood.
+#ifndef MESH_TWOHOP_SLOTS
+#define MESH_TWOHOP_SLOTS 64
+#endif
+
+// Multicast groups.  A node can join up to MESH_MAX_GROUPS, and floods
+// its memberships to everyone every MESH_GROUP_INTERVAL ms (and soon
+// after they change).  The last MESH_GROUP_MEMBERS memberships heard
+// are kept, each forgotten after MESH_GROUP_TIMEOUT ms unless repeated.
+#ifndef MESH_MAX_GROUPS
+#define MESH_MAX_GROUPS 6
+#endif
+
+#if MESH_MAX_GROUPS > 6
+#error MESH_MAX_GROUPS memberships do not fit in one report
+#endif
+
+#ifndef MESH_GROUP_MEMBERS
+#define MESH_GROUP_MEMBERS 32
+#endif
+
+#ifndef MESH_GROUP_INTERVAL
+#define MESH_GROUP_INTERVAL 30000
+#endif
+
+#ifndef MESH_GROUP_TIMEOUT
+#define MESH_GROUP_TIMEOUT (3 * MESH_GROUP_INTERVAL)
+#endif
+
+// Channels the mesh can be spread over with setChannels().  Each node
+// listens on a home channel picked from its ID, and is sent to there.
+// Broadcasts go out on the home channel of every neighbour, and IAM
+// beacons on all of them so that neighbours can find each other.
+#ifndef MESH_MAX_CHANNELS
+#define MESH_MAX_CHANNELS 8
+#endif
+
+#if MESH_MAX_CHANNELS > 8
+#error MESH_MAX_CHANNELS must fit in a byte of flags
+#endif
+
+// Routing snapshots, kept in a MeshStore given to setStore().  The table
+// is saved every MESH_SNAPSHOT_INTERVAL ms if it has changed, spread
+// over as many process() calls as their budgets need.  The whole table
+// takes a store of 16 + MESH_MAX_HOSTS * (6 + MESH_HWADDR_LEN) bytes; a
+// smaller one keeps what fits.  Routes
+// brought back by restoreRoutes() are used straight away but not passed
+// on to anyone, and are dropped after MESH_PROVISIONAL_TIME ms unless
+// they are heard again.
+#ifndef MESH_SNAPSHOT_INTERVAL
+#define MESH_SNAPSHOT_INTERVAL 300000
+#endif
+
+#ifndef MESH_PROVISIONAL_TIME
+#define MESH_PROVISIONAL_TIME (MESH_FULL_INTERVAL + MESH_IAM_INTERVAL)
+#endif
+
+// Aggregation of small messages, off until setAggregation() is called.
+// Up to MESH_AGGR_SLOTS destinations can each have a part filled frame
+// waiting for more.  setAggregation() sets how long it may wait.
+#ifndef MESH_AGGR_SLOTS
+#define MESH_AGGR_SLOTS 4
+#endif
+
+// Define MESH_STATS to keep the counters read by getStats() and
+// getDeviceStats().  Without it the counting compiles away.  process()
+// times go in MESH_STATS_BUCKETS buckets: under 16us, under 32us and so
+// on, with the last taking everything longer.
+#ifdef MESH_STATS
+#define MESH_COUNT(x) ((x)++)
+#else
+#define MESH_COUNT(x)
+#endif
+
+#ifndef MESH_STATS_BUCKETS
+#define MESH_STATS_BUCKETS 12
+#endif
+
+#define HOST_CHANGED 0x01 // Needs announcing in the next triggered update
+#define HOST_PROVISIONAL 0x02 // Restored from a snapshot and not heard since
 
 struct host {
     uint16_t id;
-    uint8_t *hwaddr;
+    uint8_t hwaddr[MESH_HWADDR_LEN];
+    uint8_t etx; // Direct only: transmissions per delivery, in 16ths
     L2 *device;
     uint16_t nexthop;
     uint8_t cost;
+    uint8_t flags;
+    uint32_t lastseen;
+    struct host *next; // Next candidate route to the same id
+    struct host *older; // Expiry list neighbours
+    struct host *newer;
+};
+
+// A forwarding cache entry maps a destination straight to the direct
+// neighbours that packets for it can be handed to.  Entries are only
+// valid while gen matches the route table generation.
+struct fibentry {
+    uint16_t dest;
+    uint8_t paths;
+    uint32_t gen;
+    struct host *hops[MESH_MAX_PATHS];
+};
+
+struct twohop {
+    uint16_t via;   // Our neighbour
+    uint16_t id;    // One of its neighbours
     uint32_t lastseen;
-    struct host *next;
+};
+
+struct holddown {
+    uint16_t id;
+    uint8_t cost;   // Of the route lost
+    uint32_t since;
+};
+
+// A message being put back together from its fragments
+struct fragslot {
+    uint16_t sender;
+    uint8_t msgid;
+    uint8_t type;
+    uint8_t count;
+    uint8_t received;
+    boolean broadcast;
+    boolean busy;
+    uint16_t len;
+    uint32_t started;
+    uint8_t have[32]; // One bit per fragment index
+    uint8_t data[MESH_FRAG_MAXLEN];
+};
+
+// A message going out in fragments, as many at a time as the queue
+// has room for, the rest from process()
+struct fragsend {
+    uint16_t destination;
+    uint8_t type;
+    uint8_t msgid;
+    uint8_t count;
+    uint8_t next; // Index of the first fragment not yet queued
+    uint8_t priority;
+    boolean busy;
+    boolean waiting; // Stopped for want of room in the queue
+    uint16_t len;
+    uint32_t started;
+    uint8_t data[MESH_FRAG_MAXLEN];
 };
 
 struct packet {
@@ -29,87 +392,470 @@ struct packet {
             uint8_t type;
             uint8_t ttl;
             uint8_t datalen;
-            uint8_t data[24];
-            uint8_t csum;
+            uint16_t crc;
+            uint8_t data[23];
         } __attribute__((packed));
         uint8_t bytes[32];
     };
 } __attribute__((packed));
 
+struct txentry {
+    struct packet pkt;
+    uint8_t hwaddr[MESH_HWADDR_LEN];
+    boolean broadcast;
+    uint16_t group; // Multicast group a broadcast can be limited to
+    uint8_t channels; // Indexes of the channels it has yet to go out on, as bits
+    uint32_t queued;
+};
+
+struct txqueue {
+    struct txentry *ring;
+    uint8_t mask;
+    uint8_t head;
+    uint8_t tail;
+};
+
+// Queue statistics, by priority, across all devices
+struct txstats {
+    uint32_t sent;
+    uint32_t drops;
+    uint32_t sojourn;    // Total ms spent queued by the frames sent
+    uint32_t sojournMax;
+    uint8_t depthMax;
+};
+
+// Traffic through one device
+struct devstats {
+    uint32_t rx;
+    uint32_t tx;         // Frames the device accepted
+    uint32_t forwarded;  // Transit frames queued to go out of it
+    uint32_t badCRC;
+    uint32_t ttlExpired;
+    uint32_t noRoute;    // Transit frames with nowhere to go
+    uint32_t queueFull;
+    uint32_t txDropped;  // Refused by the device outright
+};
+
+struct meshstats {
+    uint16_t routes;
+    uint32_t routesAdded;
+    uint32_t routesRemoved;
+    uint32_t routeChanges;
+    uint32_t evictions;
+    uint32_t sendNoRoute;  // Local packets with nowhere to go
+    uint32_t processCalls;
+    uint32_t processMax;   // us
+    uint32_t processTime[MESH_STATS_BUCKETS];
+};
+
+struct device {
+    L2 *dev;
+    struct device *next;
+    struct txqueue queue[4];
+    uint32_t tokens; // Management frame credit, in 1000ths of a frame
+    uint32_t lastRefill;
+    boolean retune; // Sends to each neighbour on its own channel
+    boolean full; // It refused the last frame it was offered
+    uint8_t neighbourChannels; // Home channels of its neighbours, as bits
+    uint32_t channelGen; // _routeGen when neighbourChannels was worked out
+#ifdef MESH_STATS
+    struct devstats stats;
+#endif
+};
+
+// A flood waiting for its turn to be relayed
+struct floodrelay {
+    boolean busy;
+    uint32_t due;
+    uint8_t heard;
+    uint16_t from[MESH_FLOOD_HEARD];
+    struct packet pkt;
+};
+
+// A host that has told us it is in a group
+struct groupmember {
+    uint16_t group; // 0 when the entry is free
+    uint16_t host;
+    boolean hw;     // Its radio filters for the group
+    uint32_t lastseen;
+};
+
+// A frame of small messages for one destination, filling up
+struct aggrslot {
+    boolean busy;
+    uint8_t count;
+    uint32_t started;
+    struct packet pkt;
+};
+
 class Mesh : public Printable {
     public: // Constants
         static const uint16_t Broadcast = 0xFFFF;
         static const uint16_t Direct = 0x0000;
-        static const uint8_t  MTU = 24;
+        // IDs from GroupBase up to Broadcast are multicast groups
+        static const uint16_t GroupBase = 0xFF00;
+        static const uint8_t  MTU = 23;
+        // Bytes ahead of the data in every frame
+        static const uint8_t  FrameHeader = 9;
 
         // Packet times 0xF0 to 0xFF are reserved for
         // system use.  The user can use packet types
-        // below 0xF0.
+        // below 0xF0, and sendPacket() and floodPacket()
+        // refuse the rest.
         static const uint8_t IAM  = 0xF0; // I am this ID
         static const uint8_t ICAN = 0xF1; // I can route to these IDs
+        static const uint8_t FRAG = 0xF2; // Part of a larger message
+        static const uint8_t STREAM = 0xF3; // MeshStream segment
+        static const uint8_t FLOOD = 0xF4; // Mesh wide broadcast
+        static const uint8_t AGGR = 0xF5; // Several small messages
+        static const uint8_t GROUPS = 0xF6; // Group memberships, in a flood
+
+        // Transmit priorities, highest first
+        static const uint8_t PriorityControl = 0; // Routing traffic only
+        static const uint8_t PriorityUrgent = 1;
+        static const uint8_t PriorityForward = 2; // Transit traffic
+        static const uint8_t PriorityNormal = 3;
+
+        // Fragments carry the user type, message ID, fragment index
+        // and fragment count ahead of the data
+        static const uint8_t FragMTU = MTU - 4;
+
+        // Aggregated messages each carry their type and length
+        static const uint8_t AggrHeader = 2;
+
+        // Floods carry the user type, sequence number and the node that
+        // last relayed them ahead of the data
+        static const uint8_t FloodMTU = MTU - 5;
+
+        // Route cost that means "can't get there from here"
+        static const uint8_t Unreachable = 0xFF;
+
+        // Routing snapshots start with two copies of a header of 'M',
+        // the version, our ID, a sequence number and the CRC of the
+        // records, used in turn.  A record slot for each entry in the
+        // host pool follows, holding an ID, next hop and cost in link
+        // units, and for neighbours the device index and hardware
+        // address.  An empty slot has an ID of Broadcast.
+        static const uint8_t SnapshotVersion = 2;
+        static const uint8_t SnapshotHeader = 8;
+        static const uint8_t SnapshotRecord = 6 + MESH_HWADDR_LEN;
 
     private:
+        friend class MeshStream;
 
         uint8_t _ledpin;
         struct device *_devlist;
-        struct host *_hostlist;
+        // Open addressed (linear probing) table of destinations.  Each
+        // occupied slot points to the chain of candidate routes for
+        // one host id.
+        struct host *_routes[MESH_ROUTE_SLOTS];
+        uint16_t _routeCount;
+
+        // Fixed pools that all hosts and devices are allocated from
+        struct host _hostpool[MESH_MAX_HOSTS];
+        struct host *_freehosts;
+        struct device _devpool[MESH_MAX_DEVICES];
+        uint8_t _devcount;
+
+        // Storage for the transmit queues of each device
+        struct txentry _txControl[MESH_MAX_DEVICES][MESH_TXQ_CONTROL];
+        struct txentry _txData[MESH_MAX_DEVICES][3][MESH_TXQ_DEPTH];
+        struct txstats _txStats[4];
+        uint32_t _evictions;
+        struct host *_victim; // Next to be evicted, while _victimGen is current
+        uint32_t _victimGen;
+
+        // Forwarding cache, invalidated whenever _routeGen changes
+        struct fibentry _fib[MESH_FIB_SLOTS];
+        uint32_t _routeGen;
+        boolean _pathWeighting; // Favour the better links among equal paths
         uint16_t _id;
         void (*_broadcastCallback)(uint16_t, uint8_t, uint8_t *, uint8_t);
         void (*_unicastCallback)(uint16_t, uint8_t, uint8_t *, uint8_t);
+        void (*_broadcastMessageCallback)(uint16_t, uint8_t, uint8_t *, uint16_t);
+        void (*_unicastMessageCallback)(uint16_t, uint8_t, uint8_t *, uint16_t);
+
+        struct fragslot _frags[MESH_FRAG_SLOTS];
+        struct fragsend _fragOut;
+        uint8_t _fragId;
+        uint32_t _fragDrops;
+
+        struct aggrslot _aggr[MESH_AGGR_SLOTS];
+        uint32_t _aggrDelay; // 0 when aggregation is off
+        uint32_t _aggrFrames;
+        uint32_t _aggrMessages;
+
+        // Streams that segments are handed to, and polled from process()
+        MeshStream *_streams;
+
+        // Flooding
+        uint16_t _floodSeq;
+        uint8_t _floodFilter[2][MESH_FLOOD_FILTER_BITS / 8];
+        uint8_t _floodGen;
+        uint8_t _floodEntries;
+        struct floodrelay _floodQueue[MESH_FLOOD_QUEUE];
+        struct twohop _twohop[MESH_TWOHOP_SLOTS];
+        boolean _relayPruning;
+        uint32_t _floodSent;
+        uint32_t _floodDelivered;
+        uint32_t _floodDuplicates;
+        uint32_t _floodPruned;
+        uint32_t _floodDrops;
+
+        // Channels the mesh is spread over
+        uint8_t _channels[MESH_MAX_CHANNELS];
+        uint8_t _channelCount;
+
+        // Multicast groups we are in, and everybody else's
+        uint16_t _groups[MESH_MAX_GROUPS];
+        boolean _groupHW[MESH_MAX_GROUPS]; // Every device filters for it
+        uint8_t _groupCount;
+        boolean _groupsChanged;
+        uint32_t _lastGroupReport;
+        struct groupmember _members[MESH_GROUP_MEMBERS];
+        void (*_groupCallback)(uint16_t, uint16_t, uint8_t, uint8_t *, uint8_t);
+
         uint32_t _lastMGMTSend;
 
+        // Routing snapshots
+        MeshStore *_store;
+        uint32_t _lastSave;
+        uint32_t _savedGen;
+        boolean _saving;
+        uint16_t _saveNext; // Next slot to write
+        uint16_t _saveCRC;
+        uint16_t _saveSeq;
+        boolean _saveFound; // The store already holds a snapshot of ours
+        uint16_t _saveLastCRC; // The newest one's
+
+        // Routes of each class (direct, remote) ordered by lastseen,
+        // oldest first.  Refreshing a route moves it to the tail.
+        struct host *_oldest[2];
+        struct host *_newest[2];
+        uint32_t _timeout[2];
+
+        // Triggered update state
+        uint32_t _lastTriggered;
+        uint32_t _iamJitter;
+        uint32_t _fullJitter;
+        uint32_t _triggerJitter;
+        uint32_t _groupJitter;
+        uint32_t _lastFull;
+        boolean _fullPending;
+        boolean _icanBusy;  // An update is part way out
+        boolean _icanFull;
+        uint16_t _icanNext; // Route slot it carries on from
+        uint16_t _changes;
+        uint16_t _withdrawn[MESH_WITHDRAW_SLOTS];
+        uint8_t _withdrawCount;
+        struct holddown _holddown[MESH_HOLDDOWN_SLOTS];
+        uint8_t _holdCount;
+
+        uint32_t _lastETX;
+
+#ifdef MESH_STATS
+        struct meshstats _stats;
+        void timeProcess(uint32_t us);
+#endif
+
+        // Control traffic accounting
+        uint32_t _ctrlBytes;
+        uint32_t _ctrlBytesLast;
+        uint32_t _ctrlStart;
+
         void sendIAM();
-        void sendICAN();
+        void sendICAN(boolean full);
+        void continueICAN();
+        uint8_t controlRoom();
+        void addICANEntry(struct packet *frames, uint8_t &used, uint16_t via, uint16_t id, uint8_t cost);
+        void sendControl(struct packet *pkt);
+        int queuePacket(struct device *d, struct host *hop, struct packet *pkt, uint8_t priority, uint16_t group = Broadcast);
+        void routeChanged(struct host *hst);
+        void routeLost(uint16_t id);
+        void holdDown(struct host *hst);
+        uint8_t holdLimit(uint16_t id);
+        void expireHolddowns();
+        uint8_t linkCost(uint16_t neighbour);
+        void updateLinkCosts();
+        void setLinkCost(struct host *hst, uint8_t cost);
+        static uint32_t jitter(uint32_t interval) { return random(interval / MESH_JITTER + 1); }
+        struct host *bestRoute(uint16_t dest);
+
+        void deliver(boolean broadcast, uint16_t sender, uint8_t type, uint8_t *data, uint16_t len);
+        void processFragment(struct packet *pkt);
+        struct fragslot *getFragSlot(uint16_t sender, uint8_t msgid, boolean broadcast);
+        boolean sendMessage(int destination, uint8_t type, uint8_t *data, int len, uint8_t priority = PriorityNormal);
+        boolean sendFragments(uint16_t destination, uint8_t type, uint8_t *data, int len, uint8_t priority);
+        void queueFragments();
+        boolean aggregate(uint16_t destination, uint8_t type, uint8_t *data, uint8_t len);
+        void sendAggregate(struct aggrslot *a);
+        void flushAggregates(uint16_t destination, boolean due);
+        void processAggregate(struct packet *pkt);
+        void processStream(struct packet *pkt);
+        void processFlood(struct packet *pkt);
+        boolean floodSeen(uint16_t sender, uint16_t seq, boolean remember);
+        boolean floodUseful(struct floodrelay *r);
+        void relayFloods();
+        boolean sendFlood(uint16_t receiver, uint8_t type, uint8_t *data, uint8_t len, uint8_t hops);
+        uint8_t homeChannel(uint16_t id);
+        void tuneDevices();
+        uint8_t broadcastChannels(struct device *d, struct packet *pkt);
+        boolean groupRelay(struct floodrelay *r, boolean *hw);
+        boolean memberHW(uint16_t group, uint16_t host);
+        void sendGroupReport();
+        void processGroupReport(uint16_t sender, uint8_t *data, uint8_t len);
+        void noteTwoHop(uint16_t via, uint16_t id, boolean reachable);
+        boolean hasTwoHop(uint16_t via, uint16_t id);
+        void pollStreams();
         void deleteHost(struct host *hst);
         void expireHosts();
+        void expiryAppend(struct host *hst);
+        void expiryUnlink(struct host *hst);
+        static uint8_t routeClass(struct host *hst) { return hst->nexthop == Direct ? 0 : 1; }
         struct host *getHost(uint16_t id, uint16_t nexthop);
+        struct host *getRoutes(uint16_t id) const;
+        int findSlot(uint16_t id) const;
+        static uint16_t hashId(uint16_t id);
+        uint16_t hashSlot(uint16_t id) const;
+        void insertSlot(struct host *hst);
+        void removeSlot(int slot);
+        struct host *allocHost(uint16_t nexthop, uint8_t cost, boolean alternate);
+        struct host *evictionVictim(uint16_t nexthop);
+        boolean isAlternate(struct host *hst);
+        uint8_t snapshotRecord(struct host *hst, uint8_t *rec);
+        uint16_t snapshotSlots();
+        uint8_t loadRecord(uint16_t slot, uint8_t *rec);
+        boolean loadHeader(uint8_t n, uint16_t &seq, uint16_t &crc);
+        void storeBytes(uint16_t addr, const uint8_t *data, uint8_t len);
+        void startSave();
+        void continueSave(boolean budgeted);
 
         void housekeeping() {
             expireHosts();
+            expireHolddowns();
+            updateLinkCosts();
         }
 
         void addHostFromPacket(struct packet *pkt, L2 *dev) {
-            addRoute(pkt->sender, Direct, 1, dev, pkt->datalen, pkt->data);
+            addRoute(pkt->sender, Direct, linkCost(pkt->sender), dev, pkt->datalen, pkt->data);
         }
 
         void addRoute(uint16_t id, uint16_t nexthop, uint8_t cost, L2 *dev, uint8_t hwlen, uint8_t *hwaddr);
         void addRoutesFromPacket(struct packet *pkt, L2 *dev);
 
 
-        struct host *getLeastCostRoute(uint16_t dest);
-        void processPacket(struct packet *pkt, L2 *dev);
-        void receivePackets();
+        struct host *getLeastCostRoute(uint16_t dest, uint16_t source);
+        struct host *getLeastCostRoute(uint16_t dest) { return getLeastCostRoute(dest, _id); }
+        struct fibentry *lookupFIB(uint16_t dest);
+        uint8_t resolveRoutes(uint16_t dest, struct host **hops);
+        void processPacket(struct packet *pkt, struct device *d);
+        void serviceQueue(struct device *d);
         void sendManagementData();
+        static uint16_t packetCRC(struct packet *p);
         void calcCS(struct packet *p);
-        uint8_t checkCS(struct packet *p);
+        boolean checkCS(struct packet *p);
+
+    protected:
+        // The parts of process() that don't talk to the devices, and
+        // the per frame work either side of the calls that do, for
+        // StaticMesh to call its radio directly.  While _inProcess is
+        // set queued frames wait for it to send them on the way out.
+        boolean _inProcess;
+
+        // The current process() call: when it started (us), how long
+        // it may run for (0 for one pass) and which device it reads next
+        uint32_t _processStart;
+        uint32_t _budget;
+        uint8_t _rxNext;
+
+        struct device *findDevice(L2 *dev);
+        // Every device but skip, through L2
+        void receivePackets(struct device *skip = NULL);
+        void serviceQueues(struct device *skip = NULL);
+        void receiveFrame(struct device *d, struct packet *pkt, uint8_t len);
+        struct txentry *nextFrame(struct device *d, uint8_t &priority);
+        void frameDone(struct device *d, uint8_t priority, int status);
+        // Only the header and data need to go on the air
+        static uint8_t frameLength(struct packet *p) { return FrameHeader + p->datalen; }
+        // The channel the frame goes out on next, and whether it still
+        // has more to go to once it has
+        uint8_t frameChannel(struct txentry *e);
+        boolean moreChannels(struct device *d, struct txentry *e, int status);
+
+        boolean overBudget() { return _budget > 0 && micros() - _processStart >= _budget; }
+        boolean workPending();
 
+        void processStart(uint32_t budget) {
+            _processStart = micros();
+            _budget = budget;
+            housekeeping();
+        }
+
+        void processWork() {
+            flushAggregates(Broadcast, true);
+            queueFragments();
+            relayFloods();
+            pollStreams();
+            sendManagementData();
+        }
+
+        // Nothing done outside process() is cut short
+        void processEnd() {
+#ifdef MESH_STATS
+            timeProcess(micros() - _processStart);
+#endif
+            _budget = 0;
+        }
 
     public:
 
 
-        Mesh() : _ledpin(255), _hostlist(NULL), _devlist(NULL), _id(65535) {}
+        Mesh();
 
         void addDevice(L2 &dev);
         void removeDevice(L2 &dev) { } // todo
-        boolean sendPacket(int destination, uint8_t type, uint8_t *data, int len);
+        /*! Send to a host or group.  False for the reserved types */
+        boolean sendPacket(int destination, uint8_t type, uint8_t *data, int len, uint8_t priority = PriorityNormal);
         boolean knowHost(uint16_t id);
+        /*! The neighbour traffic for id goes to next, or Broadcast if there's no route */
+        uint16_t getNextHop(uint16_t id);
+        /*! Number of neighbours sharing the traffic for id */
+        uint8_t getPathCount(uint16_t id);
+        /*! Share flows among equal paths by the quality of their first
+         *  link, rather than evenly */
+        void setPathWeighting(boolean w) { _pathWeighting = w; }
+        /*! Transmissions per delivery to a neighbour, in 16ths, or 0 if it isn't one */
+        uint8_t getLinkETX(uint16_t id);
+        /*! Number of destinations in the routing table */
+        uint16_t getHostCount() { return _routeCount; }
+        /*! Bytes of IAM/ICAN traffic sent over the last MESH_STATS_INTERVAL */
+        uint32_t getControlBytes() { return _ctrlBytesLast; }
+        uint32_t getEvictions() { return _evictions; }
+        /*! Set how long (ms) direct and remote routes survive without a refresh */
+        void setRouteTimeout(uint32_t direct, uint32_t remote) {
+            _timeout[0] = direct;
+            _timeout[1] = remote;
+        }
         size_t printTo(Print &p) const;
 
         void setLEDPin(uint8_t p) { _ledpin = p; pinMode(_ledpin, OUTPUT); }
 
         void setID(uint16_t id) {
-            if (id == Direct || id == Broadcast) {
+            if (id == Direct || id == Broadcast || isGroup(id)) {
                 return;
             }
             _id = id;
+            tuneDevices();
+            // Time beacons from our own start so nodes that power up
+            // together don't stay in step
+            _lastMGMTSend = millis();
+            _lastFull = millis();
+            _fullPending = true;
+            _floodSeq = random(65536);
             sendIAM();
         }
 
-        void process() {
-            housekeeping();
-            receivePackets();
-            sendManagementData();
-        }
+        boolean process(uint32_t budget = 0);
             
         void addUnicastCallback(void (*func)(uint16_t, uint8_t, uint8_t *, uint8_t)) {
             _unicastCallback = func;
@@ -119,7 +865,177 @@ class Mesh : public Printable {
             _broadcastCallback = func;
         }
 
+        // These variants can receive messages longer than 255 bytes.
+        // The data points into the reassembly buffer and is only valid
+        // for the duration of the call.
+        void addUnicastCallback(void (*func)(uint16_t, uint8_t, uint8_t *, uint16_t)) {
+            _unicastMessageCallback = func;
+        }
 
+        void addBroadcastCallback(void (*func)(uint16_t, uint8_t, uint8_t *, uint16_t)) {
+            _broadcastMessageCallback = func;
+        }
+
+        /*! Snapshot of the mesh wide counters.  False (and all zero) without MESH_STATS */
+        boolean getStats(struct meshstats *stats);
+        /*! Snapshot of one device's counters.  False (and all zero) without MESH_STATS */
+        boolean getDeviceStats(L2 &dev, struct devstats *stats);
+        void resetStats();
+
+        /*! Frames waiting at a priority, across all devices */
+        uint16_t getQueueDepth(uint8_t priority);
+        /*! Most frames ever waiting at a priority on one device */
+        uint8_t getQueueDepthMax(uint8_t priority) { return priority < 4 ? _txStats[priority].depthMax : 0; }
+        /*! Frames thrown away at a priority because its queue was full */
+        uint32_t getQueueDrops(uint8_t priority) { return priority < 4 ? _txStats[priority].drops : 0; }
+        /*! Average ms that frames sent at a priority spent queued */
+        uint32_t getQueueSojourn(uint8_t priority);
+        /*! Longest ms any frame sent at a priority spent queued */
+        uint32_t getQueueSojournMax(uint8_t priority) { return priority < 4 ? _txStats[priority].sojournMax : 0; }
+
+        /*! Fragments thrown away for want of a reassembly slot or buffer space */
+        uint32_t getFragmentDrops() { return _fragDrops; }
+
+        /*! Spread the mesh over count radio channels (up to
+         *  MESH_MAX_CHANNELS).  Every node must be given the same list.
+         *  Devices that can't change channel stay where they are */
+        void setChannels(const uint8_t *channels, uint8_t count);
+        /*! The channel we listen on, or 0 without setChannels() */
+        uint8_t getChannel() { return _channelCount > 0 ? _channels[homeChannel(_id)] : 0; }
+
+        static boolean isGroup(uint16_t id) { return id >= GroupBase && id != Broadcast; }
+        /*! Receive packets sent to group.  Its frames are filtered by the
+         *  radio while it has room, and by the mesh after that.  Packets
+         *  sent to a group with sendPacket() only go towards its members */
+        boolean joinGroup(uint16_t group);
+        void leaveGroup(uint16_t group);
+        boolean inGroup(uint16_t group);
+        /*! Members of group we know of, not counting ourselves */
+        uint8_t getGroupMembers(uint16_t group);
+        /*! Called with the group, sender, type and data of group packets.
+         *  Without it they go to the broadcast callback */
+        void addGroupCallback(void (*func)(uint16_t, uint16_t, uint8_t, uint8_t *, uint8_t)) {
+            _groupCallback = func;
+        }
+
+        /*! Pack small messages to the same host into shared frames, each
+         *  waiting up to delay ms for company.  0 turns it off. */
+        void setAggregation(uint32_t delay);
+        /*! Send any part filled frames now */
+        void flush() { flushAggregates(Broadcast, false); }
+        /*! Frames sent holding more than one message */
+        uint32_t getAggregatedFrames() { return _aggrFrames; }
+        /*! Messages carried in those frames */
+        uint32_t getAggregatedMessages() { return _aggrMessages; }
+
+        /*! Keep routing snapshots in store, so that restoreRoutes() can
+         *  bring the table back after a reboot */
+        void setStore(MeshStore &store) { _store = &store; }
+        /*! Write the routing table to the store now.  False without one */
+        boolean saveRoutes();
+        /*! Load the last snapshot into an empty table.  Call it after
+         *  setID() and addDevice(), with the devices in the same order as
+         *  when it was saved.  Returns the number of routes restored */
+        uint16_t restoreRoutes();
+
+        /*! Broadcast to the whole mesh, up to hops away.  At most FloodMTU
+         *  bytes, and not one of the reserved types. */
+        boolean floodPacket(uint8_t type, uint8_t *data, uint8_t len, uint8_t hops = MESH_FLOOD_TTL);
+        /*! Only relay floods when a neighbour may not have heard them already */
+        void setRelayPruning(boolean p) { _relayPruning = p; }
+        /*! Flood frames we sent (our own and relayed) */
+        uint32_t getFloodSent() { return _floodSent; }
+        /*! Distinct floods handed to the broadcast callback */
+        uint32_t getFloodDelivered() { return _floodDelivered; }
+        uint32_t getFloodDuplicates() { return _floodDuplicates; }
+        /*! Floods not relayed because every neighbour had them already */
+        uint32_t getFloodPruned() { return _floodPruned; }
+        /*! Relays lost for want of a queue slot */
+        uint32_t getFloodDrops() { return _floodDrops; }
+
+
+};
+
+/* A Mesh on a single radio whose type is known at compile time:
+ *
+ *   nRF24L01 rf(spi, 3, 18, 0);
+ *   StaticMesh<nRF24L01> mymesh(rf);
+ *
+ * process() calls the radio directly rather than through the L2 vtable,
+ * so the calls made for every frame received, forwarded or sent from
+ * inside process() can be inlined.  Packets sent from outside process()
+ * still go through L2, as does everything on any other device added with
+ * addDevice().  Table sizes are set by the MESH_ macros as for Mesh, and
+ * a StaticMesh can be used anywhere a Mesh can.
+ *
+ * Mesh::process() isn't virtual, so this process() only hides it.  Call
+ * it on the StaticMesh itself (or from a template that knows the type):
+ * through a Mesh & or Mesh * it is Mesh::process() that runs.  That still
+ * works, but goes through L2 like any other Mesh.
+ */
+template <class Radio>
+class StaticMesh : public Mesh {
+    private:
+        Radio *_radio;
+        struct device *_device;
+
+    public:
+        StaticMesh(Radio &radio) : _radio(&radio) {
+            addDevice(radio);
+            _device = findDevice(&radio);
+        }
+
+        /*! Hides Mesh::process(), rather than overriding it */
+        boolean process(uint32_t budget = 0) {
+            processStart(budget);
+            _inProcess = true;
+
+            while (_radio->Radio::available()) {
+                struct packet pkt;
+                uint8_t len = _radio->Radio::readFrame((uint8_t *)&pkt);
+                receiveFrame(_device, &pkt, len);
+                sendFrames();
+                if (_budget == 0 || overBudget()) {
+                    break;
+                }
+            }
+            receivePackets(_device);
+
+            processWork();
+            sendFrames();
+            serviceQueues(_device);
+
+            _inProcess = false;
+            processEnd();
+            return workPending();
+        }
+
+    private:
+        void sendFrames() {
+            uint8_t p;
+            struct txentry *e;
+            while ((e = nextFrame(_device, p)) != NULL) {
+                int status;
+                if (_device->retune) {
+                    _radio->Radio::setTxChannel(frameChannel(e));
+                }
+                if (e->broadcast && e->group != Broadcast) {
+                    status = _radio->Radio::multicastFrame(e->group, (uint8_t *)&e->pkt, frameLength(&e->pkt));
+                } else if (e->broadcast) {
+                    status = _radio->Radio::broadcastFrame((uint8_t *)&e->pkt, frameLength(&e->pkt));
+                } else {
+                    status = _radio->Radio::unicastFrame(e->hwaddr, (uint8_t *)&e->pkt, frameLength(&e->pkt));
+                }
+                _device->full = status == L2::Full;
+                if (_device->full) {
+                    break;
+                }
+                if (moreChannels(_device, e, status)) {
+                    continue;
+                }
+                frameDone(_device, p, status);
+            }
+        }
 };
 
 #endif
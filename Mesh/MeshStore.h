@@ -0,0 +1,21 @@
+#ifndef _MESHSTORE_H
+#define _MESHSTORE_H
+
+/* Non-volatile storage for Mesh::saveRoutes(), such as EEPROM.
+ *
+ * Addresses run from 0 to size() - 1, so a store sharing its EEPROM with
+ * other settings adds its own offset.  Mesh reads every byte back before
+ * writing it and only writes the ones that differ.
+ */
+
+class MeshStore {
+    public:
+        /*! Number of bytes that can be stored */
+        virtual uint16_t size() = 0;
+        virtual uint8_t read(uint16_t addr) = 0;
+        virtual void write(uint16_t addr, uint8_t val) = 0;
+        /*! Called once a snapshot is complete, for stores that buffer writes */
+        virtual void commit() { }
+};
+
+#endif
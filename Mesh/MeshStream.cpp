@@ -0,0 +1,407 @@
+#include <MeshStream.h>
+
+MeshStream::MeshStream(Mesh &mesh) {
+    _mesh = &mesh;
+    _next = NULL;
+    _attached = false;
+    _state = Closed;
+    _peer = Mesh::Direct;
+    _port = 0;
+    _retransmits = 0;
+    reset();
+}
+
+void MeshStream::attach() {
+    if (_attached) {
+        return;
+    }
+    _attached = true;
+    _next = _mesh->_streams;
+    _mesh->_streams = this;
+}
+
+void MeshStream::reset() {
+    memset(_tx, 0, sizeof(_tx));
+    memset(_rx, 0, sizeof(_rx));
+    _sndUna = 0;
+    _sndNxt = 0;
+    _sndWnd = MESH_STREAM_WINDOW;
+    _rcvNxt = 0;
+    _readSeq = 0;
+    _readPos = 0;
+    _srtt = 0;
+    _rttvar = 0;
+    _rto = MESH_STREAM_INIT_RTO;
+    _peerClosed = false;
+    _finQueued = false;
+    _synTries = 0;
+    _lastSend = millis();
+}
+
+boolean MeshStream::connect(uint16_t host, uint8_t port) {
+    attach();
+    reset();
+    _peer = host;
+    _port = port;
+    _state = SynSent;
+    _synSent = millis();
+    _synTries = 1;
+    return sendSegment(SYN, 0, NULL, 0);
+}
+
+void MeshStream::listen(uint8_t port) {
+    attach();
+    reset();
+    _peer = Mesh::Direct;
+    _port = port;
+    _state = Listen;
+}
+
+void MeshStream::stop() {
+    switch (_state) {
+        case Established:
+            if (txSeg(_sndNxt)->len > 0 && inFlight() < MESH_STREAM_WINDOW) {
+                commit();
+            }
+            _finQueued = true;
+            _state = Closing;
+            poll();
+            break;
+        case Listen:
+        case SynSent:
+            _state = Closed;
+            break;
+    }
+}
+
+boolean MeshStream::connected() {
+    return available() > 0 || (_state == Established && !_peerClosed);
+}
+
+boolean MeshStream::sendSegment(uint8_t flags, uint8_t seq, uint8_t *data, uint8_t len) {
+    uint8_t buf[Mesh::MTU];
+    buf[0] = _port;
+    buf[1] = flags;
+    buf[2] = seq;
+    buf[3] = _rcvNxt;
+    buf[4] = sackBits();
+    buf[5] = MESH_STREAM_WINDOW - (uint8_t)(_rcvNxt - _readSeq);
+    if (len > 0) {
+        memcpy(buf + Header, data, len);
+    }
+    _lastSend = millis();
+    return _mesh->sendMessage(_peer, Mesh::STREAM, buf, len + Header);
+}
+
+// Bit n is set if the segment n+1 places after the first missing one
+// has already arrived.
+uint8_t MeshStream::sackBits() {
+    uint8_t bits = 0;
+    for (int i = 0; i < 8; i++) {
+        uint8_t seq = _rcvNxt + 1 + i;
+        if ((uint8_t)(seq - _readSeq) < MESH_STREAM_WINDOW && rxSeg(seq)->done) {
+            bits |= (1 << i);
+        }
+    }
+    return bits;
+}
+
+void MeshStream::transmit(uint8_t seq) {
+    struct streamseg *seg = txSeg(seq);
+    // A send refused here (no route, full queue) counts as a try too, so
+    // a peer that can no longer be reached still times out
+    seg->tries++;
+    seg->sent = millis();
+    sendSegment(seg->flags | ACK, seq, seg->data, seg->len);
+}
+
+void MeshStream::commit() {
+    struct streamseg *seg = txSeg(_sndNxt);
+    seg->flags = DATA;
+    seg->tries = 0;
+    seg->done = false;
+    _sndNxt++;
+}
+
+void MeshStream::sampleRTT(uint32_t rtt) {
+    if (rtt == 0) {
+        rtt = 1;
+    }
+    if (rtt > MESH_STREAM_MAX_RTO) {
+        rtt = MESH_STREAM_MAX_RTO;
+    }
+    if (_srtt == 0) {
+        _srtt = rtt;
+        _rttvar = rtt / 2;
+    } else {
+        uint16_t err = _srtt > rtt ? _srtt - rtt : rtt - _srtt;
+        _rttvar = (3 * _rttvar + err) / 4;
+        _srtt = (7 * _srtt + rtt) / 8;
+    }
+    _rto = _srtt + max(4 * _rttvar, MESH_STREAM_MIN_RTO);
+    if (_rto > MESH_STREAM_MAX_RTO) {
+        _rto = MESH_STREAM_MAX_RTO;
+    }
+}
+
+void MeshStream::processAck(uint8_t ack, uint8_t sack, uint8_t wnd) {
+    if ((uint8_t)(ack - _sndUna) > inFlight()) {
+        return; // Old or bogus
+    }
+
+    // Karn's rule: only time segments that were sent exactly once
+    while (_sndUna != ack) {
+        struct streamseg *seg = txSeg(_sndUna);
+        if (seg->tries == 1 && !seg->done) {
+            sampleRTT(millis() - seg->sent);
+        }
+        seg->len = 0;
+        seg->tries = 0;
+        seg->done = false;
+        _sndUna++;
+    }
+    _sndWnd = wnd;
+
+    for (int i = 0; i < 8; i++) {
+        uint8_t seq = ack + 1 + i;
+        if ((sack & (1 << i)) && (uint8_t)(seq - _sndUna) < inFlight()) {
+            struct streamseg *seg = txSeg(seq);
+            if (seg->tries == 1 && !seg->done) {
+                sampleRTT(millis() - seg->sent);
+            }
+            seg->done = true;
+        }
+    }
+
+    // Later segments arriving means the first outstanding one was lost
+    if (sack && inFlight() > 0) {
+        struct streamseg *seg = txSeg(_sndUna);
+        if (!seg->done && seg->tries > 0 && millis() - seg->sent > _srtt) {
+            transmit(_sndUna);
+            _retransmits++;
+        }
+    }
+
+    if (_state == Closing && inFlight() == 0 && !_finQueued) {
+        _state = Closed;
+    }
+}
+
+void MeshStream::receiveSegment(uint8_t flags, uint8_t seq, uint8_t *data, uint8_t len) {
+    uint8_t off = seq - _readSeq;
+    if (off < MESH_STREAM_WINDOW && off >= (uint8_t)(_rcvNxt - _readSeq)) {
+        struct streamseg *seg = rxSeg(seq);
+        if (!seg->done) {
+            seg->flags = flags;
+            seg->len = min(len, SegMTU);
+            memcpy(seg->data, data, seg->len);
+            seg->done = true;
+        }
+        while ((uint8_t)(_rcvNxt - _readSeq) < MESH_STREAM_WINDOW && rxSeg(_rcvNxt)->done) {
+            _rcvNxt++;
+        }
+    }
+    // Always acknowledge, even duplicates - our last ack may have been lost
+    sendAck();
+}
+
+boolean MeshStream::handlePacket(uint16_t sender, uint8_t *data, uint8_t len) {
+    if (len < Header || data[0] != _port) {
+        return false;
+    }
+    uint8_t flags = data[1];
+    uint8_t seq = data[2];
+
+    if (_state == Listen) {
+        if ((flags & (SYN | ACK)) != SYN) {
+            return false;
+        }
+        reset();
+        _peer = sender;
+        _state = Established;
+        sendSegment(SYN | ACK, 0, NULL, 0);
+        return true;
+    }
+
+    if (sender != _peer) {
+        return false;
+    }
+
+    switch (_state) {
+        case Closed:
+            // The peer's FIN crossed with our final ack
+            if (flags & FIN) {
+                _rcvNxt = seq + 1;
+                sendAck();
+            }
+            return true;
+
+        case SynSent:
+            if (!(flags & ACK)) {
+                return true;
+            }
+            _state = Established;
+            if (flags & SYN) {
+                sendAck();
+                return true;
+            }
+            break;
+    }
+
+    if (flags & SYN) {
+        // Duplicate handshake - our reply must have been lost
+        sendSegment((flags & ACK) ? ACK : (SYN | ACK), _sndNxt, NULL, 0);
+        return true;
+    }
+
+    if (flags & ACK) {
+        processAck(data[3], data[4], data[5]);
+    }
+    if (flags & (DATA | FIN)) {
+        receiveSegment(flags, seq, data + Header, len - Header);
+    }
+    return true;
+}
+
+void MeshStream::poll() {
+    uint32_t now = millis();
+
+    if (_state == SynSent) {
+        if (now - _synSent > _rto) {
+            if (_synTries++ >= MESH_STREAM_MAX_TRIES) {
+                _state = Closed;
+                return;
+            }
+            _synSent = now;
+            _rto = min(_rto * 2, MESH_STREAM_MAX_RTO);
+            sendSegment(SYN, 0, NULL, 0);
+        }
+        return;
+    }
+
+    if (_state != Established && _state != Closing) {
+        return;
+    }
+
+    if (txSeg(_sndNxt)->len > 0 && inFlight() < MESH_STREAM_WINDOW && now - _fillStart >= MESH_STREAM_FLUSH_DELAY) {
+        commit();
+    }
+
+    if (_finQueued && inFlight() < MESH_STREAM_WINDOW) {
+        struct streamseg *seg = txSeg(_sndNxt);
+        seg->len = 0;
+        seg->flags = FIN;
+        seg->tries = 0;
+        seg->done = false;
+        _sndNxt++;
+        _finQueued = false;
+    }
+
+    boolean backoff = false;
+    for (uint8_t seq = _sndUna; seq != _sndNxt; seq++) {
+        struct streamseg *seg = txSeg(seq);
+        if (seg->done) {
+            continue;
+        }
+        if (seg->tries == 0) {
+            if ((uint8_t)(seq - _sndUna) < _sndWnd) {
+                transmit(seq);
+            } else if (seq == _sndUna && now - _lastSend > _rto) {
+                // Peer's window is shut - probe in case we missed it reopening
+                transmit(seq);
+            }
+        } else if (now - seg->sent > _rto) {
+            if (seg->tries >= MESH_STREAM_MAX_TRIES) {
+                _state = Closed;
+                return;
+            }
+            transmit(seq);
+            _retransmits++;
+            backoff = true;
+        }
+    }
+    if (backoff) {
+        _rto = min(_rto * 2, MESH_STREAM_MAX_RTO);
+    }
+}
+
+size_t MeshStream::write(const uint8_t *buffer, size_t size) {
+    if (_state != Established) {
+        return 0;
+    }
+    size_t n = 0;
+    while (n < size && inFlight() < MESH_STREAM_WINDOW) {
+        struct streamseg *seg = txSeg(_sndNxt);
+        if (seg->len == 0) {
+            _fillStart = millis();
+        }
+        uint8_t take = min(size - n, (size_t)(SegMTU - seg->len));
+        memcpy(seg->data + seg->len, buffer + n, take);
+        seg->len += take;
+        n += take;
+        if (seg->len == SegMTU) {
+            commit();
+        }
+    }
+    if (n > 0) {
+        poll();
+    }
+    return n;
+}
+
+void MeshStream::flush() {
+    if (txSeg(_sndNxt)->len > 0 && inFlight() < MESH_STREAM_WINDOW) {
+        commit();
+    }
+    poll();
+}
+
+// Drop fully read segments, noting the peer's FIN when we reach it.
+void MeshStream::advanceRead() {
+    boolean wasFull = (uint8_t)(_rcvNxt - _readSeq) == MESH_STREAM_WINDOW;
+    boolean freed = false;
+    while (_readSeq != _rcvNxt && _readPos >= rxSeg(_readSeq)->len) {
+        struct streamseg *seg = rxSeg(_readSeq);
+        if (seg->flags & FIN) {
+            _peerClosed = true;
+        }
+        seg->len = 0;
+        seg->done = false;
+        _readPos = 0;
+        _readSeq++;
+        freed = true;
+    }
+    if (freed && wasFull && _state != Closed) {
+        sendAck(); // Tell the sender the window has opened again
+    }
+    if (_peerClosed && _state == Established) {
+        stop();
+    }
+}
+
+int MeshStream::available() {
+    advanceRead();
+    int n = 0;
+    for (uint8_t seq = _readSeq; seq != _rcvNxt; seq++) {
+        n += rxSeg(seq)->len;
+    }
+    return n - _readPos;
+}
+
+int MeshStream::read() {
+    advanceRead();
+    if (_readSeq == _rcvNxt) {
+        return -1;
+    }
+    int c = rxSeg(_readSeq)->data[_readPos++];
+    advanceRead();
+    return c;
+}
+
+int MeshStream::peek() {
+    advanceRead();
+    if (_readSeq == _rcvNxt) {
+        return -1;
+    }
+    return rxSeg(_readSeq)->data[_readPos];
+}
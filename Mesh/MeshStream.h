@@ -0,0 +1,146 @@
+#ifndef _MESHSTREAM_H
+#define _MESHSTREAM_H
+
+#include <Arduino.h>
+#include <Mesh.h>
+
+/* A reliable, ordered byte stream between two mesh hosts.
+ *
+ * Data is carried in numbered segments over Mesh::sendMessage.  Up to
+ * MESH_STREAM_WINDOW segments may be unacknowledged at once.  Every
+ * acknowledgement carries a bitmap of the segments received beyond the
+ * first missing one so only the holes get resent.  The retransmit
+ * timer follows the measured round trip time.
+ */
+
+// Segments in flight / buffered for reading.  Power of two, at most 8.
+#ifndef MESH_STREAM_WINDOW
+#define MESH_STREAM_WINDOW 8
+#endif
+
+// Retransmit timer limits (ms)
+#ifndef MESH_STREAM_INIT_RTO
+#define MESH_STREAM_INIT_RTO 500
+#endif
+
+#ifndef MESH_STREAM_MIN_RTO
+#define MESH_STREAM_MIN_RTO 20
+#endif
+
+#ifndef MESH_STREAM_MAX_RTO
+#define MESH_STREAM_MAX_RTO 4000
+#endif
+
+// Attempts at sending one segment before the connection is dropped
+#ifndef MESH_STREAM_MAX_TRIES
+#define MESH_STREAM_MAX_TRIES 10
+#endif
+
+// How long (ms) a part filled segment waits for more data before going
+#ifndef MESH_STREAM_FLUSH_DELAY
+#define MESH_STREAM_FLUSH_DELAY 10
+#endif
+
+struct streamseg {
+    uint8_t len;
+    uint8_t flags;
+    uint8_t tries;
+    boolean done; // Acknowledged (sending) or holding data (receiving)
+    uint32_t sent;
+    uint8_t data[Mesh::MTU - 6];
+};
+
+class MeshStream : public Stream {
+    public:
+        // Segment header: port, flags, seq, ack, sack bitmap, window
+        static const uint8_t Header = 6;
+        static const uint8_t SegMTU = Mesh::MTU - Header;
+
+        static const uint8_t SYN = 0x01;
+        static const uint8_t ACK = 0x02;
+        static const uint8_t FIN = 0x04;
+        static const uint8_t DATA = 0x08;
+
+        static const uint8_t Closed = 0;
+        static const uint8_t Listen = 1;
+        static const uint8_t SynSent = 2;
+        static const uint8_t Established = 3;
+        static const uint8_t Closing = 4;
+
+    private:
+        friend class Mesh;
+
+        Mesh *_mesh;
+        MeshStream *_next;
+        boolean _attached;
+
+        uint8_t _state;
+        uint16_t _peer;
+        uint8_t _port;
+        boolean _peerClosed;
+        boolean _finQueued;
+
+        // Sending side.  Segments _sndUna to _sndNxt have been
+        // committed; the one at _sndNxt is being filled by write().
+        struct streamseg _tx[MESH_STREAM_WINDOW];
+        uint8_t _sndUna;
+        uint8_t _sndNxt;
+        uint8_t _sndWnd;
+        uint32_t _fillStart;
+        uint32_t _synSent;
+        uint8_t _synTries;
+        uint32_t _lastSend;
+
+        // Receiving side.  Segments _readSeq to _rcvNxt are complete
+        // and waiting to be read; later ones may be held out of order.
+        struct streamseg _rx[MESH_STREAM_WINDOW];
+        uint8_t _rcvNxt;
+        uint8_t _readSeq;
+        uint8_t _readPos;
+
+        // Round trip estimation
+        uint16_t _srtt;
+        uint16_t _rttvar;
+        uint16_t _rto;
+
+        uint32_t _retransmits;
+
+        void attach();
+        void reset();
+        boolean handlePacket(uint16_t sender, uint8_t *data, uint8_t len);
+        void poll();
+        boolean sendSegment(uint8_t flags, uint8_t seq, uint8_t *data, uint8_t len);
+        void sendAck() { sendSegment(ACK, _sndNxt, NULL, 0); }
+        void transmit(uint8_t seq);
+        void commit();
+        void processAck(uint8_t ack, uint8_t sack, uint8_t wnd);
+        void receiveSegment(uint8_t flags, uint8_t seq, uint8_t *data, uint8_t len);
+        void sampleRTT(uint32_t rtt);
+        void advanceRead();
+        uint8_t sackBits();
+        uint8_t inFlight() { return _sndNxt - _sndUna; }
+        struct streamseg *txSeg(uint8_t seq) { return &_tx[seq & (MESH_STREAM_WINDOW - 1)]; }
+        struct streamseg *rxSeg(uint8_t seq) { return &_rx[seq & (MESH_STREAM_WINDOW - 1)]; }
+
+    public:
+        MeshStream(Mesh &mesh);
+
+        boolean connect(uint16_t host, uint8_t port);
+        void listen(uint8_t port);
+        void stop();
+        boolean connected();
+        uint8_t getState() { return _state; }
+        uint16_t remoteHost() { return _peer; }
+        uint32_t getRetransmits() { return _retransmits; }
+        uint16_t getRTT() { return _srtt; }
+
+        size_t write(uint8_t c) { return write(&c, 1); }
+        size_t write(const uint8_t *buffer, size_t size);
+        using Print::write;
+        int available();
+        int read();
+        int peek();
+        void flush();
+};
+
+#endif
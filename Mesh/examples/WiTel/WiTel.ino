@@ -83,6 +83,17 @@ nRF24L01 rf(spi, 3, 18, 0);
 // Create the mesh environment
 Mesh mymesh;
 
+// The routing table is kept in EEPROM after our ID, so that the node
+// can get straight back to work after a reset
+class EEPROMStore : public MeshStore {
+    public:
+        uint16_t size() { return 512; }
+        uint8_t read(uint16_t addr) { return EEPROM.read(addr + 2); }
+        void write(uint16_t addr, uint8_t val) { EEPROM.write(addr + 2, val); }
+};
+
+EEPROMStore routeStore;
+
 uint16_t myID = 0xFFFF; // Not assigned yet
 
 // States for our state machine
@@ -182,13 +193,18 @@ void setup() {
     Serial.begin(115200);
     spi.begin();
     rf.begin(ADDRESS, 0);
+    rf.enableDynamicPayload();
 
     mymesh.addDevice(rf);
     mymesh.addUnicastCallback(processPacket);
+    // Typed characters trickle in a few at a time, so share frames
+    mymesh.setAggregation(5);
     pinMode(PIN_LED1, OUTPUT);
     myID = (EEPROM.read(0) << 8) | EEPROM.read(1);
     mymesh.setLEDPin(PIN_LED1);
     mymesh.setID(myID);
+    mymesh.setStore(routeStore);
+    mymesh.restoreRoutes();
 }
 
 void loop() {
@@ -0,0 +1,511 @@
+#include <VirtualRadio.h>
+
+// All times are micros() and may wrap, so compare by difference
+#define BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+VirtualRadio::VirtualRadio(VirtualMedium &medium) {
+    _medium = &medium;
+    _channel = 0;
+    _txChannel = 0;
+    _up = true;
+    _rxHead = 0;
+    _rxTail = 0;
+    _txHead = 0;
+    _txTail = 0;
+    _txListed = false;
+    _txStart = 0;
+    _txEnd = 0;
+    _lastRx = NULL;
+    _heard = false;
+    _lastRxStart = 0;
+    _lastRxEnd = 0;
+    _sent = 0;
+    _received = 0;
+    _rxOverruns = 0;
+    _txFull = 0;
+    _index = _medium->attach(this);
+
+    // A fixed prefix then the index, so every radio is unique
+    _address[0] = 0xE7;
+    _address[1] = (_index >> 24) & 0xFF;
+    _address[2] = (_index >> 16) & 0xFF;
+    _address[3] = (_index >> 8) & 0xFF;
+    _address[4] = _index & 0xFF;
+}
+
+VirtualRadio::~VirtualRadio() {
+    if (_medium != NULL) {
+        _medium->detach(this);
+    }
+}
+
+int VirtualRadio::queuePacket(uint8_t *addr, uint8_t *data, uint8_t len, boolean broadcast, uint16_t group) {
+    if (!_up) {
+        return L2::Dropped;
+    }
+    uint8_t next = (_txHead + 1) % VRADIO_TX_SLOTS;
+    if (next == _txTail) {
+        _txFull++;
+        _medium->_txFull++;
+        return L2::Full;
+    }
+    _tx[_txHead].len = _medium->_dynamic && !broadcast ? constrain(len, 1, VRADIO_FRAME) : VRADIO_FRAME;
+    memcpy(_tx[_txHead].data, data, _tx[_txHead].len);
+    if (!broadcast) {
+        memcpy(_tx[_txHead].addr, addr, VRADIO_ADDR_LEN);
+    }
+    _tx[_txHead].channel = _txChannel;
+    _tx[_txHead].broadcast = broadcast;
+    _tx[_txHead].group = group;
+    _tx[_txHead].queued = micros();
+    _txHead = next;
+    _medium->schedule(this);
+    return L2::Queued;
+}
+
+int VirtualRadio::unicastPacket(uint8_t *addr, uint8_t *data) {
+    return queuePacket(addr, data, VRADIO_FRAME, false);
+}
+
+int VirtualRadio::broadcastPacket(uint8_t *data) {
+    return queuePacket(NULL, data, VRADIO_FRAME, true);
+}
+
+int VirtualRadio::unicastFrame(uint8_t *addr, uint8_t *data, uint8_t len) {
+    return queuePacket(addr, data, len, false);
+}
+
+int VirtualRadio::broadcastFrame(uint8_t *data, uint8_t len) {
+    return queuePacket(NULL, data, len, true);
+}
+
+int VirtualRadio::multicastFrame(uint16_t group, uint8_t *data, uint8_t len) {
+    return queuePacket(NULL, data, len, true, group);
+}
+
+boolean VirtualRadio::listening(uint16_t group) {
+    for (size_t i = 0; i < _groups.size(); i++) {
+        if (_groups[i] == group) {
+            return true;
+        }
+    }
+    return false;
+}
+
+boolean VirtualRadio::joinGroup(uint16_t group) {
+    if (listening(group)) {
+        return true;
+    }
+    if (_groups.size() >= VRADIO_GROUPS) {
+        return false;
+    }
+    _groups.push_back(group);
+    return true;
+}
+
+void VirtualRadio::leaveGroup(uint16_t group) {
+    for (size_t i = 0; i < _groups.size(); i++) {
+        if (_groups[i] == group) {
+            _groups.erase(_groups.begin() + i);
+            return;
+        }
+    }
+}
+
+int VirtualRadio::available() {
+    return (_rxHead + VRADIO_RX_SLOTS - _rxTail) % VRADIO_RX_SLOTS;
+}
+
+// Anything past the end of a short frame reads as zero
+void VirtualRadio::readPacket(uint8_t *buffer) {
+    uint8_t len = readFrame(buffer);
+    if (len > 0) {
+        memset(buffer + len, 0, VRADIO_FRAME - len);
+    }
+}
+
+uint8_t VirtualRadio::readFrame(uint8_t *buffer) {
+    if (_rxHead == _rxTail) {
+        return 0;
+    }
+    uint8_t len = _rxLen[_rxTail];
+    memcpy(buffer, _rx[_rxTail], len);
+    _rxTail = (_rxTail + 1) % VRADIO_RX_SLOTS;
+    return len;
+}
+
+int VirtualRadio::getHardwareAddress(uint8_t *buffer) {
+    memcpy(buffer, _address, VRADIO_ADDR_LEN);
+    return VRADIO_ADDR_LEN;
+}
+
+boolean VirtualRadio::readLinkStats(uint8_t *addr, struct linkstats *stats) {
+    memset(stats, 0, sizeof(struct linkstats));
+    for (size_t i = 0; i < _linkStats.size(); i++) {
+        if (!memcmp(_linkStats[i].addr, addr, VRADIO_ADDR_LEN)) {
+            *stats = _linkStats[i].stats;
+            memset(&_linkStats[i].stats, 0, sizeof(struct linkstats));
+            break;
+        }
+    }
+    return true;
+}
+
+VirtualMedium::VirtualMedium() {
+    _airtime = VRADIO_AIRTIME;
+    _dynamic = false;
+    _latency = 0;
+    _collisions = true;
+    _retries = VRADIO_RETRIES;
+    _retryDelay = VRADIO_RETRY_DELAY;
+    _seed = 1;
+    _lastUpdate = micros();
+    resetCounters();
+}
+
+VirtualMedium::~VirtualMedium() {
+    while (!_inFlight.empty()) {
+        delete _inFlight.top();
+        _inFlight.pop();
+    }
+    for (size_t i = 0; i < _radios.size(); i++) {
+        if (_radios[i] != NULL) {
+            _radios[i]->_medium = NULL;
+        }
+    }
+}
+
+void VirtualMedium::resetCounters() {
+    _transmitted = 0;
+    _airUsed = 0;
+    _bytesSent = 0;
+    _delivered = 0;
+    _lost = 0;
+    _collided = 0;
+    _filtered = 0;
+    _overruns = 0;
+    _txFull = 0;
+}
+
+uint32_t VirtualMedium::attach(VirtualRadio *radio) {
+    _radios.push_back(radio);
+    _links.push_back(std::vector<struct vlink>());
+    return _radios.size() - 1;
+}
+
+// Indexes stay put so frames already in flight to a dead radio are
+// simply discarded when they land.
+void VirtualMedium::detach(VirtualRadio *radio) {
+    if (radio->_medium != this) {
+        return;
+    }
+    unlinkAll(*radio);
+    _radios[radio->_index] = NULL;
+    for (size_t i = 0; i < _txReady.size(); i++) {
+        if (_txReady[i] == radio->_index) {
+            _txReady.erase(_txReady.begin() + i);
+            break;
+        }
+    }
+}
+
+void VirtualMedium::linkOneWay(VirtualRadio &from, VirtualRadio &to, float loss) {
+    struct vlink l;
+    l.to = to._index;
+    l.loss = constrain(loss, 0.0, 1.0) * 65535.0;
+    std::vector<struct vlink> &links = _links[from._index];
+    for (size_t i = 0; i < links.size(); i++) {
+        if (links[i].to == l.to) {
+            links[i] = l;
+            return;
+        }
+    }
+    links.push_back(l);
+}
+
+void VirtualMedium::link(VirtualRadio &a, VirtualRadio &b, float loss) {
+    linkOneWay(a, b, loss);
+    linkOneWay(b, a, loss);
+}
+
+void VirtualMedium::unlink(VirtualRadio &a, VirtualRadio &b) {
+    std::vector<struct vlink> &la = _links[a._index];
+    for (size_t i = 0; i < la.size(); i++) {
+        if (la[i].to == b._index) {
+            la.erase(la.begin() + i);
+            break;
+        }
+    }
+    std::vector<struct vlink> &lb = _links[b._index];
+    for (size_t i = 0; i < lb.size(); i++) {
+        if (lb[i].to == a._index) {
+            lb.erase(lb.begin() + i);
+            break;
+        }
+    }
+}
+
+void VirtualMedium::unlinkAll(VirtualRadio &radio) {
+    while (!_links[radio._index].empty()) {
+        VirtualRadio *other = _radios[_links[radio._index].back().to];
+        if (other == NULL) {
+            _links[radio._index].pop_back();
+        } else {
+            unlink(radio, *other);
+        }
+    }
+    // One way links from others to us
+    for (size_t i = 0; i < _links.size(); i++) {
+        std::vector<struct vlink> &l = _links[i];
+        for (size_t j = 0; j < l.size(); j++) {
+            if (l[j].to == radio._index) {
+                l.erase(l.begin() + j);
+                break;
+            }
+        }
+    }
+}
+
+boolean VirtualMedium::linked(VirtualRadio &from, VirtualRadio &to) {
+    std::vector<struct vlink> &l = _links[from._index];
+    for (size_t i = 0; i < l.size(); i++) {
+        if (l[i].to == to._index) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void VirtualMedium::schedule(VirtualRadio *radio) {
+    if (!radio->_txListed) {
+        radio->_txListed = true;
+        _txReady.push_back(radio->_index);
+    }
+}
+
+// xorshift32, seeded per medium so runs are repeatable
+uint32_t VirtualMedium::nextRandom() {
+    _seed ^= _seed << 13;
+    _seed ^= _seed >> 17;
+    _seed ^= _seed << 5;
+    return _seed;
+}
+
+// Whether a frame from one radio to another is lost on the way.  Both
+// must already be on the same channel.
+boolean VirtualMedium::lost(VirtualRadio *from, VirtualRadio *to) {
+    if (to == NULL || !to->_up) {
+        return true;
+    }
+    std::vector<struct vlink> &links = _links[from->_index];
+    for (size_t i = 0; i < links.size(); i++) {
+        if (links[i].to == to->_index) {
+            return links[i].loss > 0 && (nextRandom() & 0xFFFF) < links[i].loss;
+        }
+    }
+    return true;
+}
+
+// Put the frame at the head of the radio's TX FIFO on the air.
+void VirtualMedium::transmit(VirtualRadio *radio, uint32_t start) {
+    uint8_t slot = radio->_txTail;
+    uint8_t len = radio->_tx[slot].len;
+    uint8_t channel = radio->_tx[slot].channel;
+    uint32_t air = frameTime(len);
+    radio->_txTail = (radio->_txTail + 1) % VRADIO_TX_SLOTS;
+    radio->_txStart = start;
+    radio->_txEnd = start + air;
+    radio->_sent++;
+    _transmitted++;
+    _airUsed += air;
+    _bytesSent += len;
+
+    // Work out up front how many attempts a unicast takes, and which
+    // one (if any) gets to the destination.
+    VirtualRadio *dest = NULL;
+    uint8_t attempts = 1;
+    uint32_t arrives = start;
+    boolean arrived = false;
+    if (!radio->_tx[slot].broadcast) {
+        uint8_t *addr = radio->_tx[slot].addr;
+        uint32_t index = ((uint32_t)addr[1] << 24) | ((uint32_t)addr[2] << 16) | (addr[3] << 8) | addr[4];
+        // Nobody hears it, or acknowledges it, unless listening on the
+        // channel it went out on
+        if (addr[0] == 0xE7 && index < _radios.size() && _radios[index] != NULL &&
+            _radios[index]->_channel == channel) {
+            dest = _radios[index];
+        }
+        boolean acked = false;
+        for (attempts = 1; ; attempts++) {
+            if (!lost(radio, dest)) {
+                if (!arrived) {
+                    arrived = true;
+                    arrives = radio->_txEnd - air;
+                }
+                acked = !lost(dest, radio);
+            }
+            if (acked || attempts > _retries) {
+                break;
+            }
+            radio->_txEnd += _retryDelay + air;
+        }
+        _transmitted += attempts - 1;
+        _airUsed += (attempts - 1) * air;
+        _bytesSent += (attempts - 1) * len;
+
+        struct vlinkstats *ls = NULL;
+        for (size_t i = 0; i < radio->_linkStats.size(); i++) {
+            if (!memcmp(radio->_linkStats[i].addr, addr, VRADIO_ADDR_LEN)) {
+                ls = &radio->_linkStats[i];
+                break;
+            }
+        }
+        if (ls == NULL) {
+            radio->_linkStats.push_back(vlinkstats());
+            ls = &radio->_linkStats.back();
+            memcpy(ls->addr, addr, VRADIO_ADDR_LEN);
+            memset(&ls->stats, 0, sizeof(struct linkstats));
+        }
+        ls->stats.frames++;
+        ls->stats.attempts += attempts;
+        if (acked) {
+            ls->stats.delivered++;
+        }
+    }
+
+    // Half duplex - anything we were in the middle of hearing is gone
+    if (_collisions && radio->_lastRx != NULL &&
+        BEFORE(start, radio->_lastRxEnd) && BEFORE(radio->_lastRxStart, radio->_txEnd)) {
+        if (!radio->_lastRx->corrupt) {
+            radio->_lastRx->corrupt = true;
+            _collided++;
+        }
+    }
+
+    std::vector<struct vlink> &links = _links[radio->_index];
+    for (size_t i = 0; i < links.size(); i++) {
+        VirtualRadio *to = _radios[links[i].to];
+        if (to == NULL || !to->_up || to->_channel != channel) {
+            continue;
+        }
+        if (to == dest) {
+            if (arrived) {
+                hear(to, radio->_tx[slot].data, len, arrives);
+            } else {
+                _lost++;
+            }
+            continue;
+        }
+        if (links[i].loss > 0 && (nextRandom() & 0xFFFF) < links[i].loss) {
+            _lost++;
+            continue;
+        }
+        // Frames for somebody else still take up the receiver's airtime
+        boolean wanted = radio->_tx[slot].broadcast;
+        if (wanted && radio->_tx[slot].group != 0xFFFF && !to->listening(radio->_tx[slot].group)) {
+            wanted = false;
+            _filtered++;
+        }
+        hear(to, wanted ? radio->_tx[slot].data : NULL, len, start);
+    }
+}
+
+void VirtualMedium::hear(VirtualRadio *radio, uint8_t *data, uint8_t len, uint32_t start) {
+    uint32_t end = start + frameTime(len);
+    boolean corrupt = false;
+
+    if (_collisions) {
+        if (BEFORE(start, radio->_txEnd) && BEFORE(radio->_txStart, end)) {
+            corrupt = true; // We were talking
+        }
+        if (radio->_heard && BEFORE(start, radio->_lastRxEnd) && BEFORE(radio->_lastRxStart, end)) {
+            if (radio->_lastRx != NULL && !radio->_lastRx->corrupt) {
+                radio->_lastRx->corrupt = true;
+                _collided++;
+            }
+            corrupt = true;
+        }
+    }
+
+    struct reception *r = NULL;
+    if (data != NULL) {
+        r = new struct reception;
+        r->to = radio->_index;
+        memcpy(r->data, data, len);
+        r->len = len;
+        r->channel = radio->_channel; // Lost if it retunes before the end
+        r->start = start;
+        r->end = end;
+        r->due = end + _latency;
+        r->corrupt = corrupt;
+        _inFlight.push(r);
+        if (corrupt) {
+            _collided++;
+        }
+    }
+
+    // Only the frame ending last can be hit by the next one
+    if (!radio->_heard || !BEFORE(end, radio->_lastRxEnd)) {
+        radio->_heard = true;
+        radio->_lastRx = r;
+        radio->_lastRxStart = start;
+        radio->_lastRxEnd = end;
+    }
+}
+
+void VirtualMedium::update() {
+    uint32_t now = micros();
+
+    // Transmissions first: a frame starting since the last update may
+    // collide with one that is due to be delivered in this one.
+    for (size_t i = 0; i < _txReady.size(); ) {
+        VirtualRadio *radio = _radios[_txReady[i]];
+        while (radio->_txTail != radio->_txHead) {
+            uint32_t start = radio->_tx[radio->_txTail].queued;
+            if (BEFORE(start, _lastUpdate)) {
+                start = _lastUpdate;
+            }
+            if (BEFORE(start, radio->_txEnd)) {
+                start = radio->_txEnd;
+            }
+            if (BEFORE(now, start)) {
+                break;
+            }
+            transmit(radio, start);
+        }
+        if (radio->_txTail == radio->_txHead) {
+            radio->_txListed = false;
+            _txReady[i] = _txReady.back();
+            _txReady.pop_back();
+        } else {
+            i++;
+        }
+    }
+
+    while (!_inFlight.empty() && !BEFORE(now, _inFlight.top()->due)) {
+        struct reception *r = _inFlight.top();
+        _inFlight.pop();
+        VirtualRadio *radio = _radios[r->to];
+        if (radio != NULL) {
+            if (radio->_lastRx == r) {
+                radio->_lastRx = NULL;
+            }
+            if (!r->corrupt && radio->_up && radio->_channel == r->channel) {
+                uint8_t next = (radio->_rxHead + 1) % VRADIO_RX_SLOTS;
+                if (next == radio->_rxTail) {
+                    radio->_rxOverruns++;
+                    _overruns++;
+                } else {
+                    memcpy(radio->_rx[radio->_rxHead], r->data, r->len);
+                    radio->_rxLen[radio->_rxHead] = r->len;
+                    radio->_rxHead = next;
+                    radio->_received++;
+                    _delivered++;
+                }
+            }
+        }
+        delete r;
+    }
+
+    _lastUpdate = now;
+}
@@ -0,0 +1,259 @@
+#ifndef _VIRTUALRADIO_H
+#define _VIRTUALRADIO_H
+
+#include <Arduino.h>
+#include <L2.h>
+
+#include <vector>
+#include <queue>
+
+/* A simulated radio for running Mesh off-target.
+ *
+ * Every VirtualRadio hangs off a VirtualMedium which decides who can
+ * hear whom.  A frame is on the air for the medium's airtime and lands
+ * in the receiver's RX FIFO the latency after it ends.  Two frames that
+ * overlap at a receiver destroy each other, as does a receiver that is
+ * transmitting itself.  Radios only hear frames sent on the channel they
+ * listen on, though setTxChannel() lets a radio send on any.
+ * Unicasts are retried until acknowledged like the nRF24L01's auto
+ * retransmit; only the first attempt is heard by anybody else.  With
+ * dynamic payloads on, a frame shorter than 32 bytes spends
+ * VRADIO_BYTE_TIME less on the air for each byte it leaves out.  A
+ * radio can listen for up to VRADIO_GROUPS multicast groups, and
+ * multicasts to any other group are thrown away without being read.
+ *
+ * Nothing moves until VirtualMedium::update() is called, normally once
+ * per step of the simulated clock.
+ */
+
+// FIFO depths, matching the nRF24L01 driver defaults
+#ifndef VRADIO_RX_DEPTH
+#define VRADIO_RX_DEPTH 8
+#endif
+
+#ifndef VRADIO_TX_DEPTH
+#define VRADIO_TX_DEPTH 8
+#endif
+
+// The rings keep one slot empty to tell full from empty, so they get one
+// more than the depth
+#define VRADIO_RX_SLOTS (VRADIO_RX_DEPTH + 1)
+#define VRADIO_TX_SLOTS (VRADIO_TX_DEPTH + 1)
+
+// Time on air for one 32 byte frame (us) - roughly an nRF24L01+ at 1Mbps
+#ifndef VRADIO_AIRTIME
+#define VRADIO_AIRTIME 350
+#endif
+
+// Time on air for each payload byte (us) at 1Mbps
+#ifndef VRADIO_BYTE_TIME
+#define VRADIO_BYTE_TIME 8
+#endif
+
+// Auto retransmit, matching the nRF24L01 driver's SETUP_RETR of 0xFF:
+// up to 15 retries, 4000us apart
+#ifndef VRADIO_RETRIES
+#define VRADIO_RETRIES 15
+#endif
+
+#ifndef VRADIO_RETRY_DELAY
+#define VRADIO_RETRY_DELAY 4000
+#endif
+
+// Multicast groups each radio can filter for, as the nRF24L01's pipes
+#ifndef VRADIO_GROUPS
+#define VRADIO_GROUPS 4
+#endif
+
+#define VRADIO_FRAME 32
+#define VRADIO_ADDR_LEN 5
+
+class VirtualMedium;
+
+struct vlinkstats {
+    uint8_t addr[VRADIO_ADDR_LEN];
+    struct linkstats stats;
+};
+
+class VirtualRadio : public L2 {
+    private:
+        friend class VirtualMedium;
+
+        VirtualMedium *_medium;
+        uint32_t _index;
+        uint8_t _address[VRADIO_ADDR_LEN];
+        uint8_t _channel;
+        uint8_t _txChannel;
+        boolean _up;
+
+        uint8_t _rx[VRADIO_RX_SLOTS][VRADIO_FRAME];
+        uint8_t _rxLen[VRADIO_RX_SLOTS];
+        uint8_t _rxHead;
+        uint8_t _rxTail;
+
+        std::vector<uint16_t> _groups;
+
+        struct {
+            uint8_t data[VRADIO_FRAME];
+            uint8_t addr[VRADIO_ADDR_LEN];
+            uint8_t len;
+            uint8_t channel;
+            boolean broadcast;
+            uint16_t group; // 0xFFFF for a plain broadcast
+            uint32_t queued;
+        } _tx[VRADIO_TX_SLOTS];
+        uint8_t _txHead;
+        uint8_t _txTail;
+        boolean _txListed;
+
+        // When our last transmission was on the air
+        uint32_t _txStart;
+        uint32_t _txEnd;
+
+        // The last frame heard, so a later overlapping one can spoil it
+        struct reception *_lastRx;
+        boolean _heard;
+        uint32_t _lastRxStart;
+        uint32_t _lastRxEnd;
+
+        uint32_t _sent;
+        uint32_t _received;
+        uint32_t _rxOverruns;
+        uint32_t _txFull;
+
+        std::vector<struct vlinkstats> _linkStats;
+
+        int queuePacket(uint8_t *addr, uint8_t *data, uint8_t len, boolean broadcast, uint16_t group = 0xFFFF);
+        boolean listening(uint16_t group);
+
+    public:
+        VirtualRadio(VirtualMedium &medium);
+        ~VirtualRadio();
+
+        int unicastPacket(uint8_t *addr, uint8_t *data);
+        int broadcastPacket(uint8_t *data);
+        int available();
+        void readPacket(uint8_t *buffer);
+        int unicastFrame(uint8_t *addr, uint8_t *data, uint8_t len);
+        int broadcastFrame(uint8_t *data, uint8_t len);
+        uint8_t readFrame(uint8_t *buffer);
+        boolean joinGroup(uint16_t group);
+        void leaveGroup(uint16_t group);
+        int multicastFrame(uint16_t group, uint8_t *data, uint8_t len);
+        int getHardwareAddress(uint8_t *buffer);
+        boolean readLinkStats(uint8_t *addr, struct linkstats *stats);
+
+        boolean setChannel(uint8_t channel) { _channel = channel; _txChannel = channel; return true; }
+        void setTxChannel(uint8_t channel) { _txChannel = channel; }
+        uint8_t getChannel() { return _channel; }
+        void setUp(boolean up) { _up = up; }
+        boolean isUp() { return _up; }
+        uint32_t getIndex() { return _index; }
+
+        uint32_t getSent() { return _sent; }
+        uint32_t getReceived() { return _received; }
+        uint32_t getRXOverruns() { return _rxOverruns; }
+        uint32_t getTXFull() { return _txFull; }
+};
+
+struct reception {
+    uint32_t to;
+    uint8_t data[VRADIO_FRAME];
+    uint8_t len;
+    uint8_t channel;
+    uint32_t start;
+    uint32_t end;
+    uint32_t due;
+    boolean corrupt;
+};
+
+struct vlink {
+    uint32_t to;
+    uint16_t loss; // Parts per 65536 of frames that never arrive
+};
+
+class VirtualMedium {
+    private:
+        friend class VirtualRadio;
+
+        struct laterFirst {
+            bool operator()(const struct reception *a, const struct reception *b) const {
+                return (int32_t)(a->due - b->due) > 0;
+            }
+        };
+
+        std::vector<VirtualRadio *> _radios;
+        std::vector< std::vector<struct vlink> > _links;
+        std::vector<uint32_t> _txReady;
+        std::priority_queue<struct reception *, std::vector<struct reception *>, laterFirst> _inFlight;
+
+        uint32_t _airtime;
+        boolean _dynamic;
+        uint32_t _latency;
+        boolean _collisions;
+        uint8_t _retries;
+        uint32_t _retryDelay;
+        uint32_t _seed;
+        uint32_t _lastUpdate;
+
+        uint32_t _transmitted;
+        uint32_t _airUsed;
+        uint32_t _bytesSent;
+        uint32_t _delivered;
+        uint32_t _lost;
+        uint32_t _collided;
+        uint32_t _filtered;
+        uint32_t _overruns;
+        uint32_t _txFull;
+
+        uint32_t attach(VirtualRadio *radio);
+        void detach(VirtualRadio *radio);
+        void schedule(VirtualRadio *radio);
+        void transmit(VirtualRadio *radio, uint32_t start);
+        void hear(VirtualRadio *radio, uint8_t *data, uint8_t len, uint32_t start);
+        uint32_t frameTime(uint8_t len) { return _dynamic ? _airtime - (VRADIO_FRAME - len) * VRADIO_BYTE_TIME : _airtime; }
+        boolean lost(VirtualRadio *from, VirtualRadio *to);
+        uint32_t nextRandom();
+
+    public:
+        VirtualMedium();
+        ~VirtualMedium();
+
+        // Topology.  Loss is the fraction (0.0 to 1.0) of frames dropped.
+        void link(VirtualRadio &a, VirtualRadio &b, float loss = 0.0);
+        void linkOneWay(VirtualRadio &from, VirtualRadio &to, float loss = 0.0);
+        void unlink(VirtualRadio &a, VirtualRadio &b);
+        void unlinkAll(VirtualRadio &radio);
+        boolean linked(VirtualRadio &from, VirtualRadio &to);
+        size_t getNeighbourCount(VirtualRadio &radio) { return _links[radio._index].size(); }
+
+        void setAirtime(uint32_t us) { _airtime = us; }
+        // Unicasts only carry the bytes the sender asked for, as with the
+        // nRF24L01's dynamic payload length
+        void setDynamicPayload(boolean d) { _dynamic = d; }
+        void setLatency(uint32_t us) { _latency = us; }
+        void setCollisions(boolean c) { _collisions = c; }
+        void setRetries(uint8_t retries, uint32_t delay) { _retries = retries; _retryDelay = delay; }
+        void setSeed(uint32_t seed) { _seed = seed ? seed : 1; }
+
+        // Start queued transmissions and deliver everything due by now
+        void update();
+
+        size_t getRadioCount() { return _radios.size(); }
+        VirtualRadio *getRadio(uint32_t index) { return index < _radios.size() ? _radios[index] : NULL; }
+
+        uint32_t getTransmitted() { return _transmitted; }
+        // Total time (us) frames have spent on the air, retries included
+        uint32_t getAirUsed() { return _airUsed; }
+        uint32_t getBytesSent() { return _bytesSent; }
+        uint32_t getDelivered() { return _delivered; }
+        uint32_t getLost() { return _lost; }
+        uint32_t getCollided() { return _collided; }
+        // Multicasts heard by radios that weren't listening for the group
+        uint32_t getFiltered() { return _filtered; }
+        uint32_t getOverruns() { return _overruns; }
+        uint32_t getTXFull() { return _txFull; }
+        void resetCounters();
+};
+
+#endif
@@ -0,0 +1,258 @@
+/* ChannelBench - how much traffic a mesh carries when it is spread over
+ * more than one radio channel with Mesh::setChannels().
+ *
+ * Builds a grid or random geometric network, lets the routes settle,
+ * then has every node send rate messages a second on average to hosts
+ * the given number of hops away.  Reports one CSV row:
+ *
+ *   delivered_s        messages per second that got to their destination
+ *   node_s             ... per node
+ *   delivery_pct       share of the messages sent that got there
+ *   collided_pct       frames heard but lost to a collision
+ *   air_ms_node_s      time each node spends transmitting per second
+ *
+ * Run it with 1 channel for the baseline and compare:
+ *
+ *   g++ -O2 -IHost -IL2 -IMesh -IVirtualRadio \
+ *       VirtualRadio/examples/ChannelBench/ChannelBench.cpp Host/Arduino.cpp \
+ *       Mesh/Mesh.cpp Mesh/MeshStream.cpp VirtualRadio/VirtualRadio.cpp \
+ *       -o ChannelBench
+ *
+ *   ./ChannelBench header > channels.csv
+ *   for c in 1 2 4 8; do ./ChannelBench grid 64 $c 20 >> channels.csv; done
+ *
+ * Usage: ChannelBench <grid|random> <nodes> <channels> [rate] [hops] [seed] [step_us]
+ */
+
+#include <Arduino.h>
+#include <Mesh.h>
+#include <VirtualRadio.h>
+
+#include <vector>
+
+// Nodes power up at random over this long (ms)
+#define BOOT_WINDOW 5000
+
+// Time for the routes to settle before traffic starts (ms)
+#define SETTLE_TIME 30000
+
+// How long traffic is counted for (ms)
+#define MEASURE_WINDOW 30000
+
+// Type of the test messages
+#define BENCH_TYPE 0x42
+
+// Channels handed out in order, spaced to keep clear of each other
+static const uint8_t channelPlan[] = { 2, 22, 42, 62, 82, 102, 112, 122 };
+
+static VirtualMedium medium;
+static std::vector<VirtualRadio *> radios;
+static std::vector<Mesh *> nodes;
+static std::vector<uint32_t> bootAt;
+static std::vector< std::vector<int> > adj;
+static std::vector< std::vector<int> > targets;
+
+static uint32_t stepUs = 1000;
+static uint32_t received = 0;
+
+static void addLink(int a, int b) {
+    adj[a].push_back(b);
+    adj[b].push_back(a);
+}
+
+static void buildGrid(int n) {
+    int w = ceil(sqrt((double)n));
+    for (int i = 0; i < n; i++) {
+        if ((i % w) + 1 < w && i + 1 < n) {
+            addLink(i, i + 1);
+        }
+        if (i + w < n) {
+            addLink(i, i + w);
+        }
+    }
+}
+
+static boolean connected(int n) {
+    std::vector<boolean> seen(n, false);
+    std::vector<int> queue;
+    seen[0] = true;
+    queue.push_back(0);
+    for (size_t q = 0; q < queue.size(); q++) {
+        for (size_t k = 0; k < adj[queue[q]].size(); k++) {
+            int v = adj[queue[q]][k];
+            if (!seen[v]) {
+                seen[v] = true;
+                queue.push_back(v);
+            }
+        }
+    }
+    return (int)queue.size() == n;
+}
+
+// Unit square, with the radius grown until the whole thing is connected
+static void buildRandom(int n) {
+    std::vector<double> x(n), y(n);
+    for (int i = 0; i < n; i++) {
+        x[i] = random(1000000) / 1000000.0;
+        y[i] = random(1000000) / 1000000.0;
+    }
+    double r = sqrt(2.0 * log((double)max(n, 2)) / (M_PI * n));
+    while (true) {
+        for (int i = 0; i < n; i++) {
+            adj[i].clear();
+        }
+        for (int i = 0; i < n; i++) {
+            for (int j = i + 1; j < n; j++) {
+                double dx = x[i] - x[j];
+                double dy = y[i] - y[j];
+                if (dx * dx + dy * dy <= r * r) {
+                    addLink(i, j);
+                }
+            }
+        }
+        if (connected(n)) {
+            return;
+        }
+        r *= 1.1;
+    }
+}
+
+// Everyone exactly hops away from src, or the furthest there are
+static void findTargets(int src, int hops) {
+    std::vector<int> dist(adj.size(), -1);
+    std::vector<int> queue;
+    dist[src] = 0;
+    queue.push_back(src);
+    for (size_t q = 0; q < queue.size(); q++) {
+        int u = queue[q];
+        for (size_t k = 0; k < adj[u].size(); k++) {
+            int v = adj[u][k];
+            if (dist[v] < 0) {
+                dist[v] = dist[u] + 1;
+                queue.push_back(v);
+            }
+        }
+    }
+    int want = min(hops, dist[queue.back()]);
+    for (size_t i = 0; i < dist.size(); i++) {
+        if (dist[i] == want) {
+            targets[src].push_back(i);
+        }
+    }
+}
+
+static void gotPacket(uint16_t sender, uint8_t type, uint8_t *data, uint8_t len) {
+    if (type == BENCH_TYPE) {
+        received++;
+    }
+}
+
+static void step() {
+    hostAdvance(stepUs);
+    uint32_t now = millis();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (bootAt[i] != 0 && now >= bootAt[i]) {
+            bootAt[i] = 0;
+            radios[i]->setUp(true);
+            nodes[i]->setID(i + 1);
+        }
+    }
+    medium.update();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        nodes[i]->process();
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && !strcmp(argv[1], "header")) {
+        printf("topology,nodes,links,channels,rate,hops,seed,delivered_s,node_s,delivery_pct,collided_pct,air_ms_node_s\n");
+        return 0;
+    }
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <grid|random> <nodes> <channels> [rate] [hops] [seed] [step_us]\n", argv[0]);
+        fprintf(stderr, "       %s header\n", argv[0]);
+        return 1;
+    }
+
+    const char *topology = argv[1];
+    int n = atoi(argv[2]);
+    int channels = atoi(argv[3]);
+    long rate = argc > 4 ? atol(argv[4]) : 10;
+    int hops = argc > 5 ? atoi(argv[5]) : 1;
+    uint32_t seed = argc > 6 ? strtoul(argv[6], NULL, 0) : 1;
+    stepUs = argc > 7 ? strtoul(argv[7], NULL, 0) : 1000;
+
+    if (n < 2 || n >= Mesh::GroupBase || channels < 1 || channels > (int)sizeof(channelPlan) ||
+        channels > MESH_MAX_CHANNELS || rate < 1 || hops < 1 || stepUs == 0) {
+        fprintf(stderr, "Bad arguments\n");
+        return 1;
+    }
+
+    randomSeed(seed);
+    medium.setSeed(seed);
+    hostSetMicros(1000);
+
+    adj.resize(n);
+    if (!strcmp(topology, "grid")) {
+        buildGrid(n);
+    } else if (!strcmp(topology, "random")) {
+        buildRandom(n);
+    } else {
+        fprintf(stderr, "Unknown topology %s\n", topology);
+        return 1;
+    }
+
+    int links = 0;
+    targets.resize(n);
+    for (int i = 0; i < n; i++) {
+        radios.push_back(new VirtualRadio(medium));
+        radios[i]->setUp(false);
+        nodes.push_back(new Mesh());
+        nodes[i]->addDevice(*radios[i]);
+        nodes[i]->setChannels(channelPlan, channels);
+        nodes[i]->addUnicastCallback(gotPacket);
+        bootAt.push_back(millis() + 1 + random(BOOT_WINDOW));
+        findTargets(i, hops);
+    }
+    for (int i = 0; i < n; i++) {
+        for (size_t k = 0; k < adj[i].size(); k++) {
+            if (adj[i][k] > i) {
+                medium.link(*radios[i], *radios[adj[i][k]]);
+                links++;
+            }
+        }
+    }
+
+    uint32_t start = millis();
+    while (millis() - start < BOOT_WINDOW + SETTLE_TIME) {
+        step();
+    }
+
+    // Each node sends at random times, rate a second on average
+    medium.resetCounters();
+    received = 0;
+    uint32_t sent = 0;
+    uint8_t data[Mesh::MTU];
+    memset(data, 0x55, sizeof(data));
+    long chance = 1000000L / stepUs;
+    start = millis();
+    while (millis() - start < MEASURE_WINDOW) {
+        for (int i = 0; i < n; i++) {
+            if (random(chance) < rate) {
+                int to = targets[i][random(targets[i].size())];
+                sent++;
+                nodes[i]->sendPacket(to + 1, BENCH_TYPE, data, sizeof(data));
+            }
+        }
+        step();
+    }
+
+    double seconds = MEASURE_WINDOW / 1000.0;
+    double collided = medium.getTransmitted() ? 100.0 * medium.getCollided() / (medium.getDelivered() + medium.getCollided()) : 0;
+    printf("%s,%d,%d,%d,%ld,%d,%u,%.1f,%.2f,%.1f,%.1f,%.1f\n",
+        topology, n, links, channels, rate, hops, seed,
+        received / seconds, received / seconds / n,
+        sent ? 100.0 * received / sent : 0, collided,
+        medium.getAirUsed() / 1000.0 / n / seconds);
+    return 0;
+}
@@ -0,0 +1,158 @@
+/* FailoverBench - how traffic gets around a next hop that dies.
+ *
+ * Node 1 reaches node 4 through node 2, and also through node 3:
+ *
+ *   unequal   1 - 2 - 4  and  1 - 3 - 5 - 4  (a dearer way round)
+ *   equal     1 - 2 - 4  and  1 - 3 - 4      (both shared by ECMP)
+ *
+ * Once the routes have settled, whichever neighbour node 1 is using
+ * for node 4 is switched off.  Node 1 then sends node 4 a message every
+ * SEND_INTERVAL ms, either straight away (busy) or only once it has
+ * timed the neighbour out (idle), when no failed sends have told it
+ * anything first.  One CSV row per case:
+ *
+ *   switch_ms          sending starts -> traffic goes the other way
+ *   blackhole_ms       time node 1 had no route to node 4, or one still
+ *                      through the neighbour that died
+ *   sent, delivered    messages sent from then on
+ *
+ * A remote timeout longer than the direct one leaves routes through the
+ * dead neighbour in the table after it has gone.
+ *
+ * Build from the library root:
+ *
+ *   g++ -O2 -IHost -IL2 -IMesh -IVirtualRadio \
+ *       VirtualRadio/examples/FailoverBench/FailoverBench.cpp Host/Arduino.cpp \
+ *       Mesh/Mesh.cpp Mesh/MeshStream.cpp VirtualRadio/VirtualRadio.cpp \
+ *       -o FailoverBench
+ *
+ * Usage: FailoverBench [direct_timeout_ms] [remote_timeout_ms] [seed] [loss]
+ */
+
+#include <Arduino.h>
+#include <Mesh.h>
+#include <VirtualRadio.h>
+
+// Time for the routes to settle (ms)
+#define SETTLE_TIME 30000
+
+// How long after the failure it is watched (ms)
+#define WATCH_TIME 90000
+
+#define SEND_INTERVAL 50
+
+#define BENCH_TYPE 0x42
+
+#define NODES 5
+
+static VirtualMedium *medium;
+static VirtualRadio *radios[NODES];
+static Mesh *nodes[NODES];
+static boolean alive[NODES];
+static uint32_t received;
+
+static void gotPacket(uint16_t sender, uint8_t type, uint8_t *data, uint8_t len) {
+    if (type == BENCH_TYPE) {
+        received++;
+    }
+}
+
+static void step() {
+    hostAdvance(1000);
+    medium->update();
+    for (int i = 0; i < NODES; i++) {
+        if (alive[i]) {
+            nodes[i]->process();
+        }
+    }
+}
+
+static void runCase(const char *name, boolean equal, boolean idle, uint32_t direct, uint32_t remote, uint32_t seed, float loss) {
+    medium = new VirtualMedium();
+    medium->setSeed(seed);
+    randomSeed(seed);
+    for (int i = 0; i < NODES; i++) {
+        radios[i] = new VirtualRadio(*medium);
+        nodes[i] = new Mesh();
+        nodes[i]->addDevice(*radios[i]);
+        nodes[i]->setRouteTimeout(direct, remote);
+        nodes[i]->setID(i + 1);
+        alive[i] = true;
+    }
+    nodes[3]->addUnicastCallback(gotPacket);
+    medium->link(*radios[0], *radios[1], loss);
+    medium->link(*radios[1], *radios[3], loss);
+    medium->link(*radios[0], *radios[2], loss);
+    if (equal) {
+        medium->link(*radios[2], *radios[3], loss);
+    } else {
+        medium->link(*radios[2], *radios[4], loss);
+        medium->link(*radios[4], *radios[3], loss);
+    }
+
+    uint32_t start = millis();
+    while (millis() - start < SETTLE_TIME) {
+        step();
+    }
+
+    uint16_t dead = nodes[0]->getNextHop(4);
+    if (dead != 2 && dead != 3) {
+        fprintf(stderr, "%s: node 1 has no way to node 4 to begin with\n", name);
+        return;
+    }
+    uint16_t other = dead == 2 ? 3 : 2;
+    alive[dead - 1] = false;
+    radios[dead - 1]->setUp(false);
+
+    if (idle) {
+        start = millis();
+        while (millis() - start < direct + MESH_IAM_INTERVAL) {
+            step();
+        }
+    }
+
+    long switched = -1;
+    uint32_t blackhole = 0;
+    uint32_t sent = 0;
+    uint8_t data[8];
+    memset(data, 0x55, sizeof(data));
+    received = 0;
+    start = millis();
+    while (millis() - start < WATCH_TIME) {
+        uint32_t now = millis() - start;
+        if (now % SEND_INTERVAL == 0) {
+            nodes[0]->sendPacket(4, BENCH_TYPE, data, sizeof(data));
+            sent++;
+        }
+        uint16_t hop = nodes[0]->getNextHop(4);
+        if (hop == Mesh::Broadcast || hop == dead) {
+            blackhole++;
+        } else if (hop == other && switched < 0) {
+            switched = now;
+        }
+        step();
+    }
+
+    printf("%s,%u,%u,%u,%.3f,%ld,%u,%u,%u\n", name, direct, remote, seed, loss,
+        switched, blackhole, sent, received);
+}
+
+int main(int argc, char **argv) {
+    uint32_t direct = argc > 1 ? strtoul(argv[1], NULL, 0) : MESH_DIRECT_TIMEOUT;
+    uint32_t remote = argc > 2 ? strtoul(argv[2], NULL, 0) : MESH_REMOTE_TIMEOUT;
+    uint32_t seed = argc > 3 ? strtoul(argv[3], NULL, 0) : 1;
+    float loss = argc > 4 ? atof(argv[4]) : 0.0;
+
+    if (direct == 0 || remote == 0 || loss < 0 || loss >= 1) {
+        fprintf(stderr, "Usage: %s [direct_timeout_ms] [remote_timeout_ms] [seed] [loss]\n", argv[0]);
+        return 1;
+    }
+
+    hostSetMicros(1000);
+    printf("case,direct_ms,remote_ms,seed,loss,switch_ms,blackhole_ms,sent,delivered\n");
+    runCase("unequal-busy", false, false, direct, remote, seed, loss);
+    runCase("equal-busy", true, false, direct, remote, seed, loss);
+    runCase("unequal-idle", false, true, direct, remote, seed, loss);
+    runCase("equal-idle", true, true, direct, remote, seed, loss);
+    return 0;
+}
@@ -0,0 +1,166 @@
+/* ForwardBench - CPU cost of receiving, verifying and forwarding one
+ * frame through a Mesh node.
+ *
+ * A transit node is handed the same captured frame over and over by a
+ * replay device and sends it on to a device that just counts.  Only the
+ * node's process() calls are timed.  The same is done with a corrupt
+ * copy of the frame, which costs the CRC check and nothing else.  Both
+ * are run on a plain Mesh, which reaches the device through the L2
+ * vtable, and on a StaticMesh<ReplayDevice>, which calls it directly.
+ * The RAM each takes, sizeof the object, is given alongside.
+ *
+ * Build from the library root:
+ *
+ *   g++ -O2 -IHost -IL2 -IMesh \
+ *       VirtualRadio/examples/ForwardBench/ForwardBench.cpp Host/Arduino.cpp \
+ *       Mesh/Mesh.cpp Mesh/MeshStream.cpp -o ForwardBench
+ *
+ * Usage: ForwardBench [frames]
+ */
+
+#include <Arduino.h>
+#include <Mesh.h>
+
+#include <time.h>
+
+// Replays one frame forever and keeps the last one sent to it
+class ReplayDevice : public L2 {
+    public:
+        uint8_t address[5];
+        uint8_t frame[32];
+        boolean loaded;
+        uint8_t captured[32];
+        uint32_t sent;
+
+        ReplayDevice(uint8_t id) {
+            memset(address, 0, 5);
+            address[4] = id;
+            loaded = false;
+            sent = 0;
+        }
+
+        int unicastPacket(uint8_t *addr, uint8_t *data) {
+            memcpy(captured, data, 32);
+            sent++;
+            return L2::Queued;
+        }
+        int broadcastPacket(uint8_t *data) {
+            return unicastPacket(NULL, data);
+        }
+        int unicastFrame(uint8_t *addr, uint8_t *data, uint8_t len) {
+            return unicastPacket(addr, data);
+        }
+        int broadcastFrame(uint8_t *data, uint8_t len) {
+            return unicastPacket(NULL, data);
+        }
+        int available() {
+            return loaded ? 1 : 0;
+        }
+        void readPacket(uint8_t *buffer) {
+            memcpy(buffer, frame, 32);
+        }
+        uint8_t readFrame(uint8_t *buffer) {
+            readPacket(buffer);
+            return 32;
+        }
+        int getHardwareAddress(uint8_t *buffer) {
+            memcpy(buffer, address, 5);
+            return 5;
+        }
+        void load(uint8_t *f) {
+            memcpy(frame, f, 32);
+            loaded = true;
+        }
+};
+
+template <class Node>
+static double nsPerFrame(Node &node, ReplayDevice &out, uint32_t frames) {
+    struct timespec a, b;
+    uint32_t before = out.sent;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (uint32_t i = 0; i < frames; i++) {
+        node.process();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    if (out.sent - before > frames) {
+        fprintf(stderr, "Unexpected extra frames sent\n");
+    }
+    return ((b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec)) / frames;
+}
+
+// The transit node learns 3 as a neighbour then forwards 1 -> 3.  The
+// clock never moves so no beacons get in the way.  It takes the node's
+// own type, as through a Mesh & a StaticMesh would run Mesh::process().
+template <class Node>
+static boolean transit(Node &b, ReplayDevice &devB, uint8_t *iamC, uint8_t *frame, uint32_t frames, double &forward, double &reject) {
+    uint8_t data[32];
+    memcpy(data, frame, 32);
+    b.setID(2);
+    devB.load(iamC);
+    b.process();
+
+    devB.load(data);
+    b.process();
+    if (devB.sent == 0 || memcmp(devB.captured, data, 5) || memcmp(devB.captured + 6, data + 6, 26)) {
+        fprintf(stderr, "Transit node didn't forward the frame\n");
+        return false;
+    }
+
+    forward = nsPerFrame(b, devB, frames);
+
+    data[20] ^= 0x01;
+    devB.load(data);
+    uint32_t before = devB.sent;
+    reject = nsPerFrame(b, devB, frames);
+    if (devB.sent != before) {
+        fprintf(stderr, "Corrupt frame was forwarded\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint32_t frames = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+
+    // Capture a data frame from 1 to 3 and 3's IAM, built by the real code
+    ReplayDevice devA(1), devC(3);
+    Mesh a, c;
+    a.addDevice(devA);
+    c.addDevice(devC);
+    c.setID(3);
+    uint8_t iamC[32];
+    memcpy(iamC, devC.captured, 32);
+
+    a.setID(1);
+    devA.load(iamC);
+    a.process();
+    devA.loaded = false;
+    uint8_t payload[Mesh::MTU];
+    for (int i = 0; i < Mesh::MTU; i++) {
+        payload[i] = i;
+    }
+    if (!a.sendPacket(3, 0x01, payload, Mesh::MTU)) {
+        fprintf(stderr, "Couldn't build the data frame\n");
+        return 1;
+    }
+    uint8_t data[32];
+    memcpy(data, devA.captured, 32);
+
+    double forward, reject, staticForward, staticReject;
+    ReplayDevice devB(2);
+    Mesh b;
+    b.addDevice(devB);
+    if (!transit(b, devB, iamC, data, frames, forward, reject)) {
+        return 1;
+    }
+    ReplayDevice devS(2);
+    StaticMesh<ReplayDevice> s(devS);
+    if (!transit(s, devS, iamC, data, frames, staticForward, staticReject)) {
+        return 1;
+    }
+
+    printf("frames,forward_ns,reject_ns,static_forward_ns,static_reject_ns,mesh_bytes,static_mesh_bytes\n");
+    printf("%u,%.1f,%.1f,%.1f,%.1f,%u,%u\n", frames, forward, reject, staticForward, staticReject,
+        (uint32_t)sizeof(Mesh), (uint32_t)sizeof(StaticMesh<ReplayDevice>));
+    return 0;
+}
@@ -0,0 +1,142 @@
+/* IdleTest - process() says when there is nothing it can do yet.
+ *
+ * Two nodes settle, then node 1 sends node 2 more than the mesh queue
+ * and the radio's TX ring can hold between them, or a message long
+ * enough to be fragmented.  With the clock stopped nothing can go on the
+ * air, so
+ *
+ *   while (mymesh.process(500));
+ *
+ * should stop after a call or two rather than spin waiting for the radio.
+ * The clock is then run on and everything that was taken has to arrive.
+ * Each case runs on a Mesh and on a StaticMesh<VirtualRadio>.
+ *
+ * Build from the library root:
+ *
+ *   g++ -O2 -IHost -IL2 -IMesh -IVirtualRadio \
+ *       VirtualRadio/examples/IdleTest/IdleTest.cpp Host/Arduino.cpp \
+ *       Mesh/Mesh.cpp Mesh/MeshStream.cpp VirtualRadio/VirtualRadio.cpp \
+ *       -o IdleTest
+ *
+ * Usage: IdleTest
+ */
+
+#include <Arduino.h>
+#include <Mesh.h>
+#include <VirtualRadio.h>
+
+// Time for the routes to settle, and for a burst to drain (ms)
+#define SETTLE_TIME 30000
+#define DRAIN_TIME 5000
+
+// process() calls allowed before it has to say it is idle
+#define MAX_CALLS 4
+
+#define BURST 40
+#define BENCH_TYPE 0x42
+
+static uint32_t failures;
+static uint32_t received;
+static uint16_t messageLen;
+
+static void gotMessage(uint16_t sender, uint8_t type, uint8_t *data, uint16_t len) {
+    if (type == BENCH_TYPE) {
+        received++;
+        messageLen = len;
+    }
+}
+
+// Node 1 is a, on radio ra
+template <class Node>
+static void runCase(const char *name, VirtualMedium &medium, Node &a, VirtualRadio &ra, boolean fragments) {
+    VirtualRadio rb(medium);
+    Mesh b;
+    b.addDevice(rb);
+    a.setID(1);
+    b.setID(2);
+    b.addUnicastCallback(gotMessage);
+    medium.link(ra, rb);
+
+    uint32_t start = millis();
+    while (millis() - start < SETTLE_TIME) {
+        hostAdvance(1000);
+        medium.update();
+        a.process();
+        b.process();
+    }
+    if (!a.knowHost(2)) {
+        printf("%s: node 1 has no route to node 2\n", name);
+        failures++;
+        return;
+    }
+
+    received = 0;
+    messageLen = 0;
+    uint8_t data[MESH_FRAG_MAXLEN];
+    memset(data, 0x55, sizeof(data));
+    uint32_t sent = 0;
+    if (fragments) {
+        sent = a.sendPacket(2, BENCH_TYPE, data, sizeof(data)) ? 1 : 0;
+    } else {
+        for (int i = 0; i < BURST; i++) {
+            sent += a.sendPacket(2, BENCH_TYPE, data, Mesh::MTU) ? 1 : 0;
+        }
+    }
+    if (sent == 0) {
+        printf("%s: nothing could be sent\n", name);
+        failures++;
+        return;
+    }
+
+    int calls = 0;
+    while (a.process(500) && calls < MAX_CALLS) {
+        calls++;
+    }
+    if (calls == MAX_CALLS) {
+        printf("%s: process() still busy with the radio full\n", name);
+        failures++;
+    }
+
+    start = millis();
+    while (millis() - start < DRAIN_TIME) {
+        hostAdvance(1000);
+        medium.update();
+        while (a.process(500));
+        while (b.process(500));
+    }
+    if (fragments ? messageLen != sizeof(data) : received != sent) {
+        printf("%s: lost traffic once the radio drained\n", name);
+        failures++;
+    }
+    printf("%s,%u,%d,%u\n", name, sent, calls, fragments ? messageLen : received);
+}
+
+static void plainCase(const char *name, boolean fragments) {
+    VirtualMedium medium;
+    VirtualRadio radio(medium);
+    Mesh node;
+    node.addDevice(radio);
+    runCase(name, medium, node, radio, fragments);
+}
+
+static void staticCase(const char *name, boolean fragments) {
+    VirtualMedium medium;
+    VirtualRadio radio(medium);
+    StaticMesh<VirtualRadio> node(radio);
+    runCase(name, medium, node, radio, fragments);
+}
+
+int main(int argc, char **argv) {
+    printf("case,sent,busy_calls,delivered\n");
+    plainCase("burst", false);
+    plainCase("fragments", true);
+    staticCase("static_burst", false);
+    staticCase("static_fragments", true);
+
+    if (failures > 0) {
+        printf("FAIL (%u)\n", failures);
+        return 1;
+    }
+    printf("pass\n");
+    return 0;
+}
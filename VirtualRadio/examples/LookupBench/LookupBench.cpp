@@ -0,0 +1,163 @@
+/* LookupBench - CPU cost of route table lookups as the table grows.
+ *
+ * A hub node is handed the IAM of one new neighbour after another until
+ * its table holds the given number of hosts, then each lookup is timed
+ * over many random IDs:
+ *
+ *   know_ns            knowHost() of a host in the table
+ *   miss_ns            knowHost() of one that isn't
+ *   nexthop_ns         getNextHop(), mostly missing the forwarding cache
+ *   refresh_ns         process() of an IAM from a known neighbour, which
+ *                      includes the CRC check and the route refresh
+ *
+ * With the open addressed table these should stay flat as hosts grows.
+ *
+ * Build from the library root with room for the largest table:
+ *
+ *   g++ -O2 -DMESH_MAX_HOSTS=4096 -DMESH_ROUTE_SLOTS=8192 \
+ *       -IHost -IL2 -IMesh \
+ *       VirtualRadio/examples/LookupBench/LookupBench.cpp Host/Arduino.cpp \
+ *       Mesh/Mesh.cpp Mesh/MeshStream.cpp -o LookupBench
+ *
+ * Usage: LookupBench [lookups]
+ */
+
+#include <Arduino.h>
+#include <Mesh.h>
+
+#include <vector>
+#include <time.h>
+
+// Table sizes measured, as far as MESH_MAX_HOSTS allows
+static const uint16_t sizes[] = { 16, 64, 256, 1024, 4000 };
+
+// Hands process() one frame, once, and swallows everything sent
+class BeaconDevice : public L2 {
+    public:
+        uint8_t frame[32];
+        boolean loaded;
+        uint8_t captured[32];
+
+        BeaconDevice() : loaded(false) { }
+
+        int unicastPacket(uint8_t *addr, uint8_t *data) {
+            memcpy(captured, data, 32);
+            return L2::Queued;
+        }
+        int broadcastPacket(uint8_t *data) {
+            return unicastPacket(NULL, data);
+        }
+        int unicastFrame(uint8_t *addr, uint8_t *data, uint8_t len) {
+            return unicastPacket(addr, data);
+        }
+        int broadcastFrame(uint8_t *data, uint8_t len) {
+            return unicastPacket(NULL, data);
+        }
+        int available() {
+            return loaded ? 1 : 0;
+        }
+        void readPacket(uint8_t *buffer) {
+            memcpy(buffer, frame, 32);
+            loaded = false;
+        }
+        uint8_t readFrame(uint8_t *buffer) {
+            readPacket(buffer);
+            return 32;
+        }
+        int getHardwareAddress(uint8_t *buffer) {
+            memset(buffer, 0, 5);
+            return 5;
+        }
+        void load(uint8_t *f) {
+            memcpy(frame, f, 32);
+            loaded = true;
+        }
+};
+
+static double elapsedNs(struct timespec &a, struct timespec &b) {
+    return (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+}
+
+int main(int argc, char **argv) {
+    uint32_t lookups = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+    if (lookups == 0) {
+        fprintf(stderr, "Usage: %s [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    printf("hosts,know_ns,miss_ns,nexthop_ns,refresh_ns\n");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint16_t hosts = sizes[s];
+        if (hosts > MESH_MAX_HOSTS) {
+            break;
+        }
+        BeaconDevice hubDev;
+        Mesh hub;
+        hub.addDevice(hubDev);
+        hub.setID(1);
+
+        // Each IAM comes from a new node, since the clock never moves
+        // and one would soon run out of control frame credit.  Nothing
+        // expires and no updates go out.
+        std::vector< std::vector<uint8_t> > iams;
+        for (uint16_t i = 0; i < hosts; i++) {
+            BeaconDevice beaconDev;
+            Mesh beacon;
+            beacon.addDevice(beaconDev);
+            beacon.setID(i + 2);
+            iams.push_back(std::vector<uint8_t>(beaconDev.captured, beaconDev.captured + 32));
+            hubDev.load(beaconDev.captured);
+            hub.process();
+        }
+        if (hub.getHostCount() != hosts) {
+            fprintf(stderr, "Hub only learned %u of %u hosts\n", hub.getHostCount(), hosts);
+            return 1;
+        }
+
+        std::vector<uint16_t> known(lookups), unknown(lookups);
+        for (uint32_t i = 0; i < lookups; i++) {
+            known[i] = 2 + random(hosts);
+            unknown[i] = 2 + hosts + random(10000);
+        }
+
+        struct timespec a, b;
+        uint32_t found = 0;
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        for (uint32_t i = 0; i < lookups; i++) {
+            found += hub.knowHost(known[i]);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        double know = elapsedNs(a, b) / lookups;
+
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        for (uint32_t i = 0; i < lookups; i++) {
+            found += hub.knowHost(unknown[i]);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        double miss = elapsedNs(a, b) / lookups;
+
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        for (uint32_t i = 0; i < lookups; i++) {
+            found += hub.getNextHop(known[i]) == known[i];
+        }
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        double nexthop = elapsedNs(a, b) / lookups;
+
+        if (found != 2 * lookups) {
+            fprintf(stderr, "Lookups went wrong (%u of %u)\n", found, 2 * lookups);
+            return 1;
+        }
+
+        uint32_t refreshes = lookups / 10 + 1;
+        clock_gettime(CLOCK_MONOTONIC, &a);
+        for (uint32_t i = 0; i < refreshes; i++) {
+            hubDev.load(&iams[known[i] - 2][0]);
+            hub.process();
+        }
+        clock_gettime(CLOCK_MONOTONIC, &b);
+        double refresh = elapsedNs(a, b) / refreshes;
+
+        printf("%u,%.1f,%.1f,%.1f,%.1f\n", hosts, know, miss, nexthop, refresh);
+    }
+    return 0;
+}
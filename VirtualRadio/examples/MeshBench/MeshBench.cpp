@@ -0,0 +1,510 @@
+/* MeshBench - convergence and control traffic of the real Mesh class
+ * running on a VirtualMedium.
+ *
+ * Builds a line, grid or random geometric network, powers the nodes up
+ * over a few seconds and reports one CSV row:
+ *
+ *   converge_ms        last node booted -> every connected pair routable
+ *   ctrl_frames/bytes  frames on the air per node per minute once settled
+ *   air_ms             time on the air per node per minute
+ *   tx_full            times per node per minute a full TX FIFO refused a
+ *                      frame (Mesh keeps it queued and tries again)
+ *   queue_drops        frames per node per minute lost to a full Mesh queue
+ *   collided_pct       frames heard but lost to a collision
+ *   routes, route_bytes, mesh_bytes
+ *                      average table size per node, and sizeof(Mesh)
+ *   flood_frames       frames sent per flood delivered, with relay pruning
+ *   flood_coverage_pct share of nodes each flood reached
+ *   link_recover_ms    a link on a busy path fails -> routable again
+ *   node_recover_ms    a forwarding node dies -> routable again
+ *   node_withdraw_ms   a forwarding node dies -> nobody has a route to it
+ *   reboot_cold_ms     a node restarts with an empty table -> it can
+ *                      route to everyone again
+ *   reboot_warm_ms     ... restarting from a routing snapshot instead
+ *
+ * Times are -1 if they didn't happen within the limit.  A pair counts as
+ * routable when following getNextHop() from one node gets to the other
+ * over links that exist.  Sources are sampled on large networks.
+ *
+ * Build from the library root with enough table space for the largest run:
+ *
+ *   g++ -O2 -DMESH_MAX_HOSTS=4096 -DMESH_ROUTE_SLOTS=8192 \
+ *       -IHost -IL2 -IMesh -IVirtualRadio \
+ *       VirtualRadio/examples/MeshBench/MeshBench.cpp Host/Arduino.cpp \
+ *       Host/FileStore.cpp Mesh/Mesh.cpp Mesh/MeshStream.cpp \
+ *       VirtualRadio/VirtualRadio.cpp -o MeshBench
+ *
+ *   ./MeshBench header > bench.csv
+ *   for n in 10 50 100 500 1000 2000; do
+ *       for t in line grid random; do ./MeshBench $t $n >> bench.csv; done
+ *   done
+ *
+ * Usage: MeshBench <line|grid|random> <nodes> [seed] [loss] [step_us] [limit_s] [dpl]
+ *
+ * With dpl the radios only send the bytes each unicast uses, as the
+ * nRF24L01 does once enableDynamicPayload() has been called.
+ */
+
+#include <Arduino.h>
+#include <Mesh.h>
+#include <VirtualRadio.h>
+#include <FileStore.h>
+
+#include <vector>
+#include <time.h>
+
+// Nodes power up at random over this long (ms)
+#define BOOT_WINDOW 5000
+
+// How often reachability is checked (ms)
+#define CHECK_INTERVAL 250
+
+// How long traffic is counted for once converged (ms)
+#define MEASURE_WINDOW 60000
+
+// Reachability is checked from this many sources to every node
+#define SOURCES 16
+
+// Time allowed for each flood to cover the network (ms)
+#define FLOOD_WINDOW 2000
+
+// Time a rebooting node is off the air (ms)
+#define REBOOT_TIME 500
+
+// The rebooting node's EEPROM
+static FileStore store(65535);
+
+static VirtualMedium medium;
+static std::vector<VirtualRadio *> radios;
+static std::vector<Mesh *> nodes;
+static std::vector<uint32_t> bootAt;
+static std::vector<boolean> alive;
+static std::vector< std::vector<int> > adj;
+static std::vector<int> sources;
+static std::vector<int> component;
+
+static uint32_t stepUs = 1000;
+static uint32_t limitMs = 600000;
+
+static void addLink(int a, int b) {
+    adj[a].push_back(b);
+    adj[b].push_back(a);
+}
+
+static void removeLink(int a, int b) {
+    for (size_t i = 0; i < adj[a].size(); i++) {
+        if (adj[a][i] == b) {
+            adj[a].erase(adj[a].begin() + i);
+            break;
+        }
+    }
+    for (size_t i = 0; i < adj[b].size(); i++) {
+        if (adj[b][i] == a) {
+            adj[b].erase(adj[b].begin() + i);
+            break;
+        }
+    }
+    medium.unlink(*radios[a], *radios[b]);
+}
+
+// Label the connected pieces of the live network
+static int findComponents() {
+    int n = adj.size();
+    int count = 0;
+    component.assign(n, -1);
+    std::vector<int> queue;
+    for (int i = 0; i < n; i++) {
+        if (!alive[i] || component[i] >= 0) {
+            continue;
+        }
+        component[i] = count;
+        queue.clear();
+        queue.push_back(i);
+        for (size_t q = 0; q < queue.size(); q++) {
+            int u = queue[q];
+            for (size_t k = 0; k < adj[u].size(); k++) {
+                int v = adj[u][k];
+                if (alive[v] && component[v] < 0) {
+                    component[v] = count;
+                    queue.push_back(v);
+                }
+            }
+        }
+        count++;
+    }
+    return count;
+}
+
+static void buildLine(int n) {
+    for (int i = 0; i + 1 < n; i++) {
+        addLink(i, i + 1);
+    }
+}
+
+static void buildGrid(int n) {
+    int w = ceil(sqrt((double)n));
+    for (int i = 0; i < n; i++) {
+        if ((i % w) + 1 < w && i + 1 < n) {
+            addLink(i, i + 1);
+        }
+        if (i + w < n) {
+            addLink(i, i + w);
+        }
+    }
+}
+
+// Unit square, with the radius grown until the whole thing is connected
+static void buildRandom(int n) {
+    std::vector<double> x(n), y(n);
+    for (int i = 0; i < n; i++) {
+        x[i] = random(1000000) / 1000000.0;
+        y[i] = random(1000000) / 1000000.0;
+    }
+    double r = sqrt(2.0 * log((double)max(n, 2)) / (M_PI * n));
+    while (true) {
+        for (int i = 0; i < n; i++) {
+            adj[i].clear();
+        }
+        for (int i = 0; i < n; i++) {
+            for (int j = i + 1; j < n; j++) {
+                double dx = x[i] - x[j];
+                double dy = y[i] - y[j];
+                if (dx * dx + dy * dy <= r * r) {
+                    addLink(i, j);
+                }
+            }
+        }
+        if (findComponents() == 1) {
+            return;
+        }
+        r *= 1.1;
+    }
+}
+
+static boolean routable(int from, int to) {
+    int cur = from;
+    for (size_t hops = 0; hops < nodes.size(); hops++) {
+        uint16_t next = nodes[cur]->getNextHop(to + 1);
+        if (next == Mesh::Broadcast || next == Mesh::Direct || next > nodes.size()) {
+            return false;
+        }
+        int n = next - 1;
+        if (!alive[n] || !medium.linked(*radios[cur], *radios[n])) {
+            return false;
+        }
+        if (n == to) {
+            return true;
+        }
+        cur = n;
+    }
+    return false; // Loop
+}
+
+static boolean allRoutable() {
+    for (size_t s = 0; s < sources.size(); s++) {
+        int from = sources[s];
+        if (!alive[from]) {
+            continue;
+        }
+        for (size_t to = 0; to < nodes.size(); to++) {
+            if ((int)to == from || !alive[to] || component[to] != component[from]) {
+                continue;
+            }
+            if (!routable(from, to)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static boolean anyoneKnows(int id) {
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (alive[i] && nodes[i]->knowHost(id + 1)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void step() {
+    hostAdvance(stepUs);
+    uint32_t now = millis();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (bootAt[i] != 0 && now >= bootAt[i]) {
+            bootAt[i] = 0;
+            alive[i] = true;
+            radios[i]->setUp(true);
+            nodes[i]->setID(i + 1);
+        }
+    }
+    medium.update();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (alive[i]) {
+            nodes[i]->process();
+        }
+    }
+}
+
+static void run(uint32_t ms) {
+    uint32_t start = millis();
+    while (millis() - start < ms) {
+        step();
+    }
+}
+
+// Step until cond() holds, checking every CHECK_INTERVAL.  Returns the
+// time taken or -1.
+static long runUntil(boolean (*cond)()) {
+    uint32_t start = millis();
+    while (millis() - start < limitMs) {
+        if (cond()) {
+            return millis() - start;
+        }
+        run(CHECK_INTERVAL);
+    }
+    return -1;
+}
+
+static int rebooted = -1;
+
+static boolean rebootRoutable() {
+    for (size_t to = 0; to < nodes.size(); to++) {
+        if ((int)to == rebooted || !alive[to] || component[to] != component[rebooted]) {
+            continue;
+        }
+        if (!routable(rebooted, to)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Restart a node with a new Mesh on the same radio, from the snapshot
+// in store if warm.  Returns how long until it can route to everyone.
+static long reboot(int r, boolean warm) {
+    if (warm) {
+        nodes[r]->setStore(store);
+        nodes[r]->saveRoutes();
+    }
+    alive[r] = false;
+    radios[r]->setUp(false);
+    // The old Mesh is simply forgotten, as it would be by a reset
+    nodes[r] = new Mesh();
+    nodes[r]->addDevice(*radios[r]);
+    run(REBOOT_TIME);
+    alive[r] = true;
+    radios[r]->setUp(true);
+    nodes[r]->setID(r + 1);
+    if (warm) {
+        nodes[r]->setStore(store);
+        nodes[r]->restoreRoutes();
+    }
+    rebooted = r;
+    return runUntil(rebootRoutable);
+}
+
+// The first hop after src on the way to dst, or -1
+static int hopAfter(int src, int dst) {
+    uint16_t next = nodes[src]->getNextHop(dst + 1);
+    if (next == Mesh::Broadcast || next == Mesh::Direct || next > nodes.size()) {
+        return -1;
+    }
+    return next - 1;
+}
+
+// The node furthest from src in hops, following the live links
+static int furthest(int src) {
+    std::vector<int> dist(nodes.size(), -1);
+    std::vector<int> queue;
+    dist[src] = 0;
+    queue.push_back(src);
+    int far = src;
+    for (size_t q = 0; q < queue.size(); q++) {
+        int u = queue[q];
+        if (dist[u] > dist[far]) {
+            far = u;
+        }
+        for (size_t k = 0; k < adj[u].size(); k++) {
+            int v = adj[u][k];
+            if (alive[v] && dist[v] < 0) {
+                dist[v] = dist[u] + 1;
+                queue.push_back(v);
+            }
+        }
+    }
+    return far;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && !strcmp(argv[1], "header")) {
+        printf("topology,nodes,links,seed,loss,converge_ms,ctrl_frames_node_min,ctrl_bytes_node_min,"
+               "air_ms_node_min,tx_full_node_min,queue_drops_node_min,collided_pct,routes,route_bytes,mesh_bytes,flood_frames,flood_coverage_pct,link_recover_ms,node_recover_ms,node_withdraw_ms,reboot_cold_ms,reboot_warm_ms,cpu_s\n");
+        return 0;
+    }
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <line|grid|random> <nodes> [seed] [loss] [step_us] [limit_s] [dpl]\n", argv[0]);
+        fprintf(stderr, "       %s header\n", argv[0]);
+        return 1;
+    }
+
+    const char *topology = argv[1];
+    int n = atoi(argv[2]);
+    uint32_t seed = argc > 3 ? strtoul(argv[3], NULL, 0) : 1;
+    float loss = argc > 4 ? atof(argv[4]) : 0.0;
+    stepUs = argc > 5 ? strtoul(argv[5], NULL, 0) : 1000;
+    limitMs = argc > 6 ? strtoul(argv[6], NULL, 0) * 1000 : 600000;
+    medium.setDynamicPayload(argc > 7 && !strcmp(argv[7], "dpl"));
+
+    if (n < 2 || n >= Mesh::Broadcast - 1 || stepUs == 0) {
+        fprintf(stderr, "Bad arguments\n");
+        return 1;
+    }
+
+    clock_t cpuStart = clock();
+    randomSeed(seed);
+    medium.setSeed(seed);
+    hostSetMicros(1000);
+
+    adj.resize(n);
+    alive.assign(n, true);
+    if (!strcmp(topology, "line")) {
+        buildLine(n);
+    } else if (!strcmp(topology, "grid")) {
+        buildGrid(n);
+    } else if (!strcmp(topology, "random")) {
+        buildRandom(n);
+    } else {
+        fprintf(stderr, "Unknown topology %s\n", topology);
+        return 1;
+    }
+
+    alive.assign(n, false);
+    int links = 0;
+    for (int i = 0; i < n; i++) {
+        radios.push_back(new VirtualRadio(medium));
+        radios[i]->setUp(false);
+        nodes.push_back(new Mesh());
+        nodes[i]->addDevice(*radios[i]);
+        bootAt.push_back(millis() + 1 + random(BOOT_WINDOW));
+    }
+    for (int i = 0; i < n; i++) {
+        for (size_t k = 0; k < adj[i].size(); k++) {
+            if (adj[i][k] > i) {
+                medium.link(*radios[i], *radios[adj[i][k]], loss);
+                links++;
+            }
+        }
+    }
+
+    for (int i = 0; i < n && (int)sources.size() < SOURCES; i++) {
+        sources.push_back(n <= SOURCES ? i : (int)random(n));
+    }
+
+    // Power up and converge
+    run(BOOT_WINDOW + 1);
+    findComponents();
+    long converge = runUntil(allRoutable);
+
+    // Steady state overhead
+    medium.resetCounters();
+    uint32_t queueDrops = 0;
+    for (int i = 0; i < n; i++) {
+        for (uint8_t p = Mesh::PriorityControl; p <= Mesh::PriorityNormal; p++) {
+            queueDrops -= nodes[i]->getQueueDrops(p);
+        }
+    }
+    run(MEASURE_WINDOW);
+    for (int i = 0; i < n; i++) {
+        for (uint8_t p = Mesh::PriorityControl; p <= Mesh::PriorityNormal; p++) {
+            queueDrops += nodes[i]->getQueueDrops(p);
+        }
+    }
+    double minutes = MEASURE_WINDOW / 60000.0;
+    double frames = medium.getTransmitted() / (double)n / minutes;
+    double bytes = medium.getBytesSent() / (double)n / minutes;
+    double air = medium.getAirUsed() / 1000.0 / n / minutes;
+    double txFull = medium.getTXFull() / (double)n / minutes;
+    double drops = queueDrops / (double)n / minutes;
+    double collided = medium.getTransmitted() ? 100.0 * medium.getCollided() / (medium.getDelivered() + medium.getCollided()) : 0;
+
+    double routes = 0;
+    for (int i = 0; i < n; i++) {
+        routes += nodes[i]->getHostCount();
+    }
+    routes /= n;
+
+    // One flood from each source, allowed as many hops as it likes
+    uint32_t floodSent = 0;
+    uint32_t floodDelivered = 0;
+    for (int i = 0; i < n; i++) {
+        floodSent -= nodes[i]->getFloodSent();
+        floodDelivered -= nodes[i]->getFloodDelivered();
+    }
+    for (size_t s = 0; s < sources.size(); s++) {
+        uint8_t data[Mesh::FloodMTU];
+        memset(data, s, sizeof(data));
+        nodes[sources[s]]->floodPacket(0x42, data, sizeof(data), 255);
+        run(FLOOD_WINDOW);
+    }
+    for (int i = 0; i < n; i++) {
+        floodSent += nodes[i]->getFloodSent();
+        floodDelivered += nodes[i]->getFloodDelivered();
+    }
+    double floodFrames = floodDelivered ? (double)floodSent / floodDelivered : 0;
+    double floodCoverage = 100.0 * floodDelivered / (sources.size() * (n - 1));
+
+    // Cut the first link on the longest path from the first source
+    long linkRecover = -1;
+    int src = sources[0];
+    int hop = hopAfter(src, furthest(src));
+    if (hop >= 0) {
+        removeLink(src, hop);
+        findComponents();
+        linkRecover = runUntil(allRoutable);
+        addLink(src, hop);
+        medium.link(*radios[src], *radios[hop], loss);
+        findComponents();
+        runUntil(allRoutable);
+    }
+
+    // Kill the node half way along the same path
+    long nodeRecover = -1;
+    long nodeWithdraw = -1;
+    int far = furthest(src);
+    std::vector<int> path;
+    for (int cur = hopAfter(src, far); cur >= 0 && cur != far && path.size() < nodes.size(); cur = hopAfter(cur, far)) {
+        path.push_back(cur);
+    }
+    int victim = path.empty() ? -1 : path[path.size() / 2];
+    if (victim >= 0) {
+        alive[victim] = false;
+        radios[victim]->setUp(false);
+        findComponents();
+        uint32_t start = millis();
+        while (millis() - start < limitMs && (nodeRecover < 0 || nodeWithdraw < 0)) {
+            if (nodeRecover < 0 && allRoutable()) {
+                nodeRecover = millis() - start;
+            }
+            if (nodeWithdraw < 0 && !anyoneKnows(victim)) {
+                nodeWithdraw = millis() - start;
+            }
+            run(CHECK_INTERVAL);
+        }
+    }
+
+    // Restart the first source, then restart it again from a snapshot
+    long rebootCold = reboot(src, false);
+    runUntil(allRoutable);
+    long rebootWarm = reboot(src, true);
+
+    printf("%s,%d,%d,%u,%.3f,%ld,%.1f,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%.0f,%u,%.2f,%.1f,%ld,%ld,%ld,%ld,%ld,%.2f\n",
+        topology, n, links, seed, loss, converge,
+        frames, bytes, air, txFull, drops, collided,
+        routes, routes * sizeof(struct host), (unsigned)sizeof(Mesh),
+        floodFrames, floodCoverage,
+        linkRecover, nodeRecover, nodeWithdraw,
+        rebootCold, rebootWarm,
+        (double)(clock() - cpuStart) / CLOCKS_PER_SEC);
+    return 0;
+}
@@ -0,0 +1,177 @@
+/* StreamBench - goodput and latency of a MeshStream over a lossy
+ * multi-hop path.
+ *
+ * Nodes are strung out in a line, each only hearing its neighbours, and
+ * every link loses the given share of frames.  Once the routes have
+ * settled the first node connects to the last and writes the given
+ * number of bytes as fast as the stream takes them, each 4 byte record
+ * holding the time it was written.  One CSV row per path length, from
+ * one hop up to the given number:
+ *
+ *   time_ms            connect() -> the last byte read at the far end
+ *                      (-1 if it didn't get there within LIMIT_TIME)
+ *   delivered          bytes read at the far end
+ *   goodput_Bps        bytes read per second of time_ms, or of
+ *                      LIMIT_TIME if they didn't all get there
+ *   lat_mean/p95/max   ms from a record being written to it being read
+ *   retransmits        segments the sender sent again
+ *   srtt_ms            the sender's smoothed round trip time at the end
+ *
+ * Collisions are off unless asked for.  The medium settles how many
+ * tries a unicast takes before it knows whether the frame collides, so
+ * a collided unicast is never retried by the radio, and with every frame
+ * starting on a step the same ones can collide round after round.
+ *
+ * Build from the library root:
+ *
+ *   g++ -O2 -IHost -IL2 -IMesh -IVirtualRadio \
+ *       VirtualRadio/examples/StreamBench/StreamBench.cpp Host/Arduino.cpp \
+ *       Mesh/Mesh.cpp Mesh/MeshStream.cpp VirtualRadio/VirtualRadio.cpp \
+ *       -o StreamBench
+ *
+ * Usage: StreamBench [hops] [loss] [seed] [bytes] [step_us] [collisions]
+ */
+
+#include <Arduino.h>
+#include <Mesh.h>
+#include <MeshStream.h>
+#include <VirtualRadio.h>
+
+#include <vector>
+#include <algorithm>
+
+// Time for the routes to settle (ms)
+#define SETTLE_TIME 30000
+
+// Longest a transfer may take (ms)
+#define LIMIT_TIME 120000
+
+#define BENCH_PORT 7
+
+static VirtualMedium *medium;
+static std::vector<VirtualRadio *> radios;
+static std::vector<Mesh *> nodes;
+static uint32_t stepUs;
+static boolean collisions;
+
+static void step() {
+    hostAdvance(stepUs);
+    medium->update();
+    for (size_t i = 0; i < nodes.size(); i++) {
+        nodes[i]->process();
+    }
+}
+
+static void runPath(uint16_t hops, float loss, uint32_t seed, uint32_t bytes) {
+    uint16_t n = hops + 1;
+    medium = new VirtualMedium();
+    medium->setSeed(seed);
+    medium->setCollisions(collisions);
+    randomSeed(seed);
+    radios.clear();
+    nodes.clear();
+    for (uint16_t i = 0; i < n; i++) {
+        radios.push_back(new VirtualRadio(*medium));
+        nodes.push_back(new Mesh());
+        nodes[i]->addDevice(*radios[i]);
+        nodes[i]->setID(i + 1);
+    }
+    for (uint16_t i = 0; i + 1 < n; i++) {
+        medium->link(*radios[i], *radios[i + 1], loss);
+    }
+
+    uint32_t start = millis();
+    while (millis() - start < SETTLE_TIME) {
+        step();
+    }
+    if (nodes[0]->getNextHop(n) != 2) {
+        fprintf(stderr, "%u hops: node 1 has no route to node %u\n", hops, n);
+        return;
+    }
+
+    MeshStream client(*nodes[0]);
+    MeshStream server(*nodes[n - 1]);
+    server.listen(BENCH_PORT);
+    client.connect(n, BENCH_PORT);
+
+    std::vector<uint32_t> latency;
+    uint32_t written = 0;
+    uint32_t delivered = 0;
+    uint8_t out[4], in[4];
+    uint8_t outPos = 4, inPos = 0;
+    long elapsed = -1;
+    start = millis();
+    while (millis() - start < LIMIT_TIME) {
+        if (client.connected()) {
+            while (written < bytes) {
+                if (outPos == 4) {
+                    uint32_t now = millis();
+                    memcpy(out, &now, 4);
+                    outPos = 0;
+                }
+                size_t len = min((uint32_t)(4 - outPos), bytes - written);
+                size_t took = client.write(out + outPos, len);
+                if (took == 0) {
+                    break;
+                }
+                outPos += took;
+                written += took;
+            }
+        }
+        while (server.available()) {
+            in[inPos++] = server.read();
+            delivered++;
+            if (inPos == 4) {
+                uint32_t stamp;
+                memcpy(&stamp, in, 4);
+                latency.push_back(millis() - stamp);
+                inPos = 0;
+            }
+        }
+        if (delivered == bytes) {
+            elapsed = millis() - start;
+            break;
+        }
+        if (client.getState() == MeshStream::Closed) {
+            break;
+        }
+        step();
+    }
+
+    double mean = 0;
+    uint32_t p95 = 0, worst = 0;
+    if (latency.size() > 0) {
+        for (size_t i = 0; i < latency.size(); i++) {
+            mean += latency[i];
+        }
+        mean /= latency.size();
+        std::sort(latency.begin(), latency.end());
+        p95 = latency[latency.size() * 95 / 100];
+        worst = latency.back();
+    }
+    double secs = (elapsed >= 0 ? elapsed : LIMIT_TIME) / 1000.0;
+    printf("%u,%.3f,%u,%u,%ld,%u,%.0f,%.1f,%u,%u,%u,%u\n", hops, loss, seed, bytes,
+        elapsed, delivered, delivered / secs, mean, p95, worst,
+        client.getRetransmits(), client.getRTT());
+}
+
+int main(int argc, char **argv) {
+    uint16_t hops = argc > 1 ? strtoul(argv[1], NULL, 0) : 4;
+    float loss = argc > 2 ? atof(argv[2]) : 0.1;
+    uint32_t seed = argc > 3 ? strtoul(argv[3], NULL, 0) : 1;
+    uint32_t bytes = argc > 4 ? strtoul(argv[4], NULL, 0) : 16384;
+    stepUs = argc > 5 ? strtoul(argv[5], NULL, 0) : 250;
+    collisions = argc > 6 && !strcmp(argv[6], "collisions");
+
+    if (hops < 1 || hops >= Mesh::Broadcast - 2 || loss < 0 || loss >= 1 || bytes == 0 || stepUs == 0) {
+        fprintf(stderr, "Usage: %s [hops] [loss] [seed] [bytes] [step_us] [collisions]\n", argv[0]);
+        return 1;
+    }
+
+    hostSetMicros(1000);
+    printf("hops,loss,seed,bytes,time_ms,delivered,goodput_Bps,lat_mean_ms,lat_p95_ms,lat_max_ms,retransmits,srtt_ms\n");
+    for (uint16_t h = 1; h <= hops; h++) {
+        runPath(h, loss, seed, bytes);
+    }
+    return 0;
+}
@@ -0,0 +1,272 @@
+/* RingTest - the nRF24L01 driver's receive ring against a model chip.
+ *
+ * Frames are handed to an nRF24Chip a few at a time, as they would come
+ * off the air, with the driver's interrupt handler run in between and the
+ * main loop reading at a pace of its own, so the ring fills and empties
+ * and now and then overflows.  Some frames land while the handler is part
+ * way through draining the chip's FIFO.  The handler only runs on a
+ * falling edge of the IRQ pin, as it is attached, and not always straight
+ * away.  What should be in the chip and in the ring is kept alongside,
+ * and every round checks that:
+ *
+ *   - frames come out whole and in order, none lost until the ring is full
+ *   - getRXOverruns() counts the frames the handler had no room for
+ *   - getRXFifoFull() counts the interrupts that found the FIFO full
+ *   - available() and readFrame() never touch the SPI bus
+ *   - no frame is left in the FIFO without an interrupt to come for it
+ *
+ * It runs with fixed width frames and again with dynamic payloads, where
+ * the broadcast pipe stays at the fixed width and a frame of corrupt
+ * length should flush the FIFO and be dropped.
+ *
+ * Build from the library root:
+ *
+ *   g++ -O2 -DARDUINO=100 -IHost -IL2 -InRF24L01 \
+ *       nRF24L01/examples/RingTest/RingTest.cpp Host/Arduino.cpp \
+ *       Host/nRF24Chip.cpp nRF24L01/nRF24L01.cpp -o RingTest
+ *
+ * Usage: RingTest [rounds] [seed]
+ */
+
+#include <Arduino.h>
+#include <nRF24L01.h>
+#include <nRF24Chip.h>
+
+#include <deque>
+
+#define CSN_PIN 1
+#define CE_PIN 2
+#define INT_PIN 3
+
+static nRF24Chip *chip;
+static nRF24L01 *radio;
+static uint32_t failures;
+
+// Frames as they should be: seq in the chip's FIFO and in the ring
+static std::deque<uint16_t> inChip, inRing;
+static uint32_t overruns, fifoFull, frames;
+static uint16_t nextSeq;
+static boolean dynamic;
+
+// Chance in 100 that a frame lands after each SPI transaction the
+// handler makes, once it has read STATUS and FIFO_STATUS
+static uint8_t landing;
+static boolean draining;
+static uint8_t handlerSPI;
+
+// The IRQ pin is low while any flag is set, and the handler runs on its
+// falling edge, so a flag left set when it returns means no more
+// interrupts.  An edge while it runs is held until it returns.
+static boolean irqLow, irqEdge;
+
+static void fail(const char *what, uint32_t round) {
+    if (failures++ < 10) {
+        printf("round %u: %s\n", round, what);
+    }
+}
+
+// Frames alternate between pipe 0 and the broadcast pipe, and only pipe 0
+// takes dynamic payloads
+static uint8_t framePipe(uint16_t seq) {
+    return seq & 1;
+}
+
+static uint8_t frameLength(uint16_t seq) {
+    return dynamic && framePipe(seq) == 0 ? 3 + seq % 30 : DEFAULT_PIPE_WIDTH;
+}
+
+static void makeFrame(uint16_t seq, uint8_t *data) {
+    uint8_t len = frameLength(seq);
+    data[0] = seq >> 8;
+    data[1] = seq;
+    data[2] = len;
+    for (int i = 3; i < len; i++) {
+        data[i] = seq * 7 + i;
+    }
+}
+
+static void watchIRQ() {
+    boolean low = chip->interruptPending();
+    if (low && !irqLow) {
+        irqEdge = true;
+    }
+    irqLow = low;
+}
+
+static void arrive() {
+    uint8_t data[32];
+    makeFrame(nextSeq, data);
+    if (chip->receive(framePipe(nextSeq), data, frameLength(nextSeq))) {
+        inChip.push_back(nextSeq);
+    }
+    nextSeq++;
+    frames++;
+    watchIRQ();
+}
+
+static void pinHook(uint8_t pin, uint8_t val) {
+    uint8_t waiting = chip->rxWaiting();
+    chip->pin(pin, val);
+    watchIRQ();
+    if (!draining || pin != CSN_PIN || val != HIGH) {
+        return;
+    }
+    // A frame read out goes into the ring if there's room for it
+    if (chip->rxWaiting() < waiting) {
+        if (inRing.size() >= NRF24L01_RX_DEPTH) {
+            overruns++;
+        } else {
+            inRing.push_back(inChip.front());
+        }
+        inChip.pop_front();
+    }
+    if (++handlerSPI > 2 && (uint8_t)random(100) < landing) {
+        arrive();
+    }
+}
+
+// The interrupt, if one is due.  pinHook() follows what it does.
+static void interrupt() {
+    if (!irqEdge) {
+        return;
+    }
+    irqEdge = false;
+    if (inChip.size() == NRF24CHIP_FIFO) {
+        fifoFull++;
+    }
+    draining = true;
+    handlerSPI = 0;
+    radio->isrHandler();
+    draining = false;
+}
+
+static void readOne(uint32_t round) {
+    uint8_t buffer[32], want[32];
+    uint32_t spi = radio->getSPITransactions();
+    uint8_t len = radio->readFrame(buffer);
+    if (radio->getSPITransactions() != spi) {
+        fail("readFrame() used the SPI bus", round);
+    }
+    if (inRing.empty()) {
+        if (len != 0) {
+            fail("read a frame from an empty ring", round);
+        }
+        return;
+    }
+    uint16_t seq = inRing.front();
+    inRing.pop_front();
+    makeFrame(seq, want);
+    if (len != frameLength(seq) || memcmp(buffer, want, len) != 0) {
+        fail("frame read out wrong, or out of order", round);
+    }
+}
+
+static void check(uint32_t round) {
+    uint32_t spi = radio->getSPITransactions();
+    if ((uint32_t)radio->available() != inRing.size()) {
+        fail("available() doesn't match the ring", round);
+    }
+    if (radio->getSPITransactions() != spi) {
+        fail("available() used the SPI bus", round);
+    }
+    if (radio->getRXOverruns() != overruns) {
+        fail("overrun count is wrong", round);
+    }
+    if (radio->getRXFifoFull() != fifoFull) {
+        fail("FIFO full count is wrong", round);
+    }
+    if (chip->rxWaiting() != inChip.size()) {
+        fail("the chip's FIFO holds the wrong number of frames", round);
+    }
+    if (!irqEdge && (irqLow || !inChip.empty())) {
+        fail("frames were left in the FIFO with no interrupt to come", round);
+    }
+}
+
+static void setUp(boolean dpl) {
+    chip = new nRF24Chip(CSN_PIN, CE_PIN);
+    radio = new nRF24L01(*chip, CSN_PIN, CE_PIN, INT_PIN);
+    hostSetPinHook(pinHook);
+    radio->begin(1, 2, 3, 4, 5, 10);
+    if (dpl && !radio->enableDynamicPayload()) {
+        printf("enableDynamicPayload() failed\n");
+        failures++;
+    }
+    dynamic = dpl;
+    irqLow = false;
+    irqEdge = false;
+    inChip.clear();
+    inRing.clear();
+    overruns = 0;
+    fifoFull = 0;
+    frames = 0;
+    nextSeq = 0;
+}
+
+static void stress(boolean dpl, uint32_t rounds) {
+    setUp(dpl);
+    for (uint32_t round = 0; round < rounds; round++) {
+        // Bursts sometimes outrun the reader and sometimes the chip
+        landing = random(8) == 0 ? 30 : 0;
+        for (int n = random(5); n > 0; n--) {
+            arrive();
+            if (random(3) == 0) {
+                interrupt();
+            }
+        }
+        if (random(2) == 0) {
+            interrupt();
+        }
+        for (int n = random(random(4) == 0 ? 16 : 5); n > 0; n--) {
+            readOne(round);
+        }
+        check(round);
+    }
+    while (irqEdge || !inRing.empty()) {
+        interrupt();
+        readOne(rounds);
+    }
+    check(rounds);
+    printf("%s: %u frames, %u lost by the chip, %u overruns, %u FIFO full\n",
+        dpl ? "dynamic" : "fixed", frames, chip->getRXDropped(), overruns, fifoFull);
+}
+
+// A width over 32 is corrupt: the whole FIFO goes, and nothing is read
+static void corrupt() {
+    setUp(true);
+    uint8_t data[32];
+    makeFrame(nextSeq++, data);
+    chip->receive(0, data, frameLength(0));
+    chip->receive(0, data, 40);
+    makeFrame(nextSeq, data);
+    chip->receive(0, data, frameLength(nextSeq));
+    radio->isrHandler();
+    uint8_t buffer[32];
+    if (radio->readFrame(buffer) != frameLength(0) || buffer[1] != 0) {
+        fail("the frame ahead of a corrupt one was lost", 0);
+    }
+    if (radio->available() != 0 || chip->rxWaiting() != 0) {
+        fail("a corrupt frame didn't flush the FIFO", 0);
+    }
+}
+
+int main(int argc, char **argv) {
+    uint32_t rounds = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+    uint32_t seed = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+    if (rounds == 0) {
+        fprintf(stderr, "Usage: %s [rounds] [seed]\n", argv[0]);
+        return 1;
+    }
+    randomSeed(seed);
+
+    stress(false, rounds);
+    stress(true, rounds);
+    corrupt();
+
+    if (failures > 0) {
+        printf("FAIL (%u)\n", failures);
+        return 1;
+    }
+    printf("pass\n");
+    return 0;
+}
@@ -0,0 +1,118 @@
+/* SPIBench - SPI transactions the nRF24L01 driver makes per frame.
+ *
+ * The driver runs against an nRF24Chip on a stub SPI bus.  Each case
+ * sends or receives the given number of frames, running the interrupt
+ * handler whenever the chip's IRQ line falls, and gives one CSV row:
+ *
+ *   spi_per_frame      getSPITransactions() per frame, everything the
+ *                      frame took from being queued (or arriving) to the
+ *                      radio listening again (or it being read)
+ *   cs_per_frame       chip select cycles the chip saw per frame
+ *
+ * The two have to agree, or the counter is wrong and the run fails.
+ * The cases are:
+ *
+ *   unicast            every frame to the same neighbour
+ *   unicast_alternate  to two neighbours in turn
+ *   unicast_failed     to one neighbour, each hitting MAX_RT
+ *   broadcast
+ *   receive            one frame arriving, drained and read
+ *
+ * Build from the library root:
+ *
+ *   g++ -O2 -DARDUINO=100 -IHost -IL2 -InRF24L01 \
+ *       nRF24L01/examples/SPIBench/SPIBench.cpp Host/Arduino.cpp \
+ *       Host/nRF24Chip.cpp nRF24L01/nRF24L01.cpp -o SPIBench
+ *
+ * Add -DNRF24L01_SHADOW_REGS=0 to see what it costs without the register shadow.
+ *
+ * Usage: SPIBench [frames]
+ */
+
+#include <Arduino.h>
+#include <nRF24L01.h>
+#include <nRF24Chip.h>
+
+#define CSN_PIN 1
+#define CE_PIN 2
+#define INT_PIN 3
+
+static nRF24Chip *chip;
+static nRF24L01 *radio;
+static boolean mismatch;
+
+static void pinHook(uint8_t pin, uint8_t val) {
+    chip->pin(pin, val);
+}
+
+// The handler is attached to the falling edge of IRQ, and the chip
+// model raises it at once, so it runs until the line goes high again
+static void interrupts() {
+    for (int i = 0; i < 10 && chip->interruptPending(); i++) {
+        radio->isrHandler();
+    }
+}
+
+static void runCase(const char *name, uint32_t frames) {
+    chip = new nRF24Chip(CSN_PIN, CE_PIN);
+    radio = new nRF24L01(*chip, CSN_PIN, CE_PIN, INT_PIN);
+    hostSetPinHook(pinHook);
+    radio->begin(1, 2, 3, 4, 5, 10);
+
+    uint8_t a[5] = { 0xE7, 0, 0, 0, 2 };
+    uint8_t b[5] = { 0xE7, 0, 0, 0, 3 };
+    uint8_t frame[DEFAULT_PIPE_WIDTH];
+    memset(frame, 0x55, sizeof(frame));
+
+    // One frame first, so each case starts from a radio that has
+    // already sent and gone back to listening
+    radio->unicastPacket(b, frame);
+    interrupts();
+
+    uint32_t spi = radio->getSPITransactions();
+    uint32_t cs = chip->getTransactions();
+    for (uint32_t i = 0; i < frames; i++) {
+        if (!strcmp(name, "unicast")) {
+            radio->unicastPacket(a, frame);
+        } else if (!strcmp(name, "unicast_alternate")) {
+            radio->unicastPacket(i & 1 ? b : a, frame);
+        } else if (!strcmp(name, "unicast_failed")) {
+            chip->failNext(1);
+            radio->unicastPacket(a, frame);
+        } else if (!strcmp(name, "broadcast")) {
+            radio->broadcastPacket(frame);
+        } else {
+            chip->receive(1, frame, sizeof(frame));
+        }
+        interrupts();
+        if (!strcmp(name, "receive")) {
+            radio->readPacket(frame);
+        }
+    }
+    spi = radio->getSPITransactions() - spi;
+    cs = chip->getTransactions() - cs;
+    if (spi != cs) {
+        mismatch = true;
+    }
+    printf("%s,%u,%.2f,%.2f\n", name, frames, (double)spi / frames, (double)cs / frames);
+}
+
+int main(int argc, char **argv) {
+    uint32_t frames = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000;
+    if (frames == 0) {
+        fprintf(stderr, "Usage: %s [frames]\n", argv[0]);
+        return 1;
+    }
+
+    printf("case,frames,spi_per_frame,cs_per_frame\n");
+    runCase("unicast", frames);
+    runCase("unicast_alternate", frames);
+    runCase("unicast_failed", frames);
+    runCase("broadcast", frames);
+    runCase("receive", frames);
+    if (mismatch) {
+        fprintf(stderr, "getSPITransactions() doesn't match the chip selects\n");
+        return 1;
+    }
+    return 0;
+}
@@ -32,11 +32,32 @@ nRF24L01::nRF24L01(DGSPI &spi, int csn, int ce, int intr) {
     _ce = ce;
     _intr = intr;
     _status = 0;
+    _shadowValid = 0;
+    _spiTransactions = 0;
+#ifdef NRF24L01_STATS
+    memset(&_stats, 0, sizeof(_stats));
+#endif
+    _rxHead = 0;
+    _rxTail = 0;
+    _txHead = 0;
+    _txTail = 0;
+    _txLoaded = 0;
+    _txActive = false;
+    _txCallback = NULL;
+    _powered = false;
+    _dynamic = false;
+    _pipesUsed = 0;
+    _channel = 0;
+    _txChannel = 0;
+    memset(_links, 0, sizeof(_links));
+    _rxOverruns = 0;
+    _rxFifoFull = 0;
 }
 
 void nRF24L01::begin(uint8_t ad0, uint8_t ad1, uint8_t ad2, uint8_t ad3, uint8_t ad4, uint8_t chan, uint8_t width) {
     _spi->begin();
     _spi->setSpeed(10000000UL);
+    _shadowValid = 0;
     _addr[0] = ad0;
     _addr[1] = ad1;
     _addr[2] = ad2;
@@ -57,8 +78,8 @@ void nRF24L01::begin(uint8_t ad0, uint8_t ad1, uint8_t ad2, uint8_t ad3, uint8_t
     _bc[2] = 0xFF;
     _bc[3] = 0xFF;
     _bc[4] = 0xFF;
-    enablePipe(0, _bc, false);
-    enablePipe(1, _addr, true);
+    enablePipe(0, _addr, true);
+    enablePipe(1, _bc, false);
     selectRX();
     switch (isrHandlerCounter) {
         case 0:
@@ -96,6 +117,8 @@ void nRF24L01::begin(uint8_t ad0, uint8_t ad1, uint8_t ad2, uint8_t ad3, uint8_t
     }
     isrHandlerCounter++;
     uint32_t s = disableInterrupts();
+    _spiTransactions += 2;
+    NRF24L01_COUNT(spiBytes, 2);
     digitalWrite(_csn, LOW);
     _status = _spi->transfer(CMD_TX_FLUSH);
     digitalWrite(_csn, HIGH);
@@ -113,8 +136,32 @@ void nRF24L01::begin(uint8_t ad0, uint8_t ad1, uint8_t ad2, uint8_t ad3, uint8_t
     enablePower();
 }
 
+// Return the RAM copy of a register, or NULL if it isn't shadowed.
+uint8_t *nRF24L01::shadowOf(uint8_t reg, uint8_t len) {
+    reg &= 0x1F;
+    if (!(NRF24L01_SHADOW_REGS & (1UL << reg))) {
+        return NULL;
+    }
+    switch (reg) {
+        case REG_RX_ADDR_P0:
+            return len == 5 ? _shadowAddr[0] : NULL;
+        case REG_RX_ADDR_P1:
+            return len == 5 ? _shadowAddr[1] : NULL;
+        case REG_TX_ADDR:
+            return len == 5 ? _shadowAddr[2] : NULL;
+    }
+    return len == 1 ? &_shadow[reg] : NULL;
+}
+
 void nRF24L01::regRead(uint8_t reg, uint8_t *buffer, uint8_t len) {
+    uint8_t *shadow = shadowOf(reg, len);
+    if (shadow != NULL && (_shadowValid & (1UL << (reg & 0x1F)))) {
+        memcpy(buffer, shadow, len);
+        return;
+    }
     uint32_t s = disableInterrupts();
+    _spiTransactions++;
+    NRF24L01_COUNT(spiBytes, 1 + len);
     digitalWrite(_csn, LOW);
     _status = _spi->transfer(reg & 0x1F);
     for (int i = 0; i < len; i++) {
@@ -122,10 +169,24 @@ void nRF24L01::regRead(uint8_t reg, uint8_t *buffer, uint8_t len) {
     }
     digitalWrite(_csn, HIGH);
     restoreInterrupts(s);
+    if (shadow != NULL) {
+        memcpy(shadow, buffer, len);
+        _shadowValid |= (1UL << (reg & 0x1F));
+    }
 }
 
 void nRF24L01::regWrite(uint8_t reg, uint8_t *buffer, uint8_t len) {
+    uint8_t *shadow = shadowOf(reg, len);
+    if (shadow != NULL) {
+        if ((_shadowValid & (1UL << (reg & 0x1F))) && memcmp(shadow, buffer, len) == 0) {
+            return;
+        }
+        memcpy(shadow, buffer, len);
+        _shadowValid |= (1UL << (reg & 0x1F));
+    }
     uint32_t s = disableInterrupts();
+    _spiTransactions++;
+    NRF24L01_COUNT(spiBytes, 1 + len);
     digitalWrite(_csn, LOW);
     _status = _spi->transfer((reg & 0x1F) | 0x20);
     for (int i = 0; i < len; i++) {
@@ -168,7 +229,8 @@ void nRF24L01::enablePipe(int pipe, uint8_t *addr, boolean aa) {
     uint8_t pw = 0x03;
     regSet(REG_EN_RXADDR, pipe);
     regWrite(REG_SETUP_AW, &pw, 1);
-    regWrite(REG_RX_ADDR_P0 + pipe, addr, 5);
+    // Pipes 2 to 5 only have the first byte of their own
+    regWrite(REG_RX_ADDR_P0 + pipe, addr, pipe < 2 ? 5 : 1);
     regWrite(REG_RX_PW_P0 + pipe, &_pipeWidth, 1);
     if (aa) {
         regSet(REG_EN_AA, pipe);
@@ -180,137 +242,418 @@ void nRF24L01::enablePipe(int pipe, uint8_t *addr, boolean aa) {
 
 void nRF24L01::enablePower() {
     regSet(REG_CONFIG, 1);
+    _powered = true;
 }
 
 void nRF24L01::disablePower() {
+    _powered = false;
     regClr(REG_CONFIG, 1);
 }
 
 void nRF24L01::isrHandler() {
     uint8_t isrstat = 0;
     uint8_t fifostat = 0;
+    NRF24L01_COUNT(interrupts, 1);
     regRead(REG_STATUS, &isrstat, 1);
     regRead(REG_FIFO_STATUS, &fifostat, 1);
 
-
-    // TX done
-    if (isrstat & (1<<5)) {
-        selectRX();
-        enablePipe(0, _bc, false);
-        enablePipe(1, _addr, true);
+    // Clear the TX interrupts straight away - the radio won't send
+    // anything else until MAX_RT is cleared.  RX_DR is cleared by drainRX()
+    uint8_t txstat = isrstat & 0x30;
+    if (txstat) {
+        regWrite(REG_STATUS, &txstat, 1);
     }
 
     // Did we receive data?
     if (isrstat & (1<<6)) {
-        // We're not actually going to do anything here.
+        if (fifostat & (1<<1)) {
+            _rxFifoFull++;
+        }
+        drainRX();
+    }
+
+    // TX done
+    if (isrstat & (1<<5)) {
+        completeTX(true);
     }
 
     if (isrstat & (1<<4)) {
         // Too many retries
-        selectRX();
-        enablePipe(0, _bc, false);
-        enablePipe(1, _addr, true);
-        uint32_t s = disableInterrupts();
+        completeTX(false);
+    }
+}
+
+// Finish the frame at the head of the transmit queue and start the
+// next one.  Called with interrupts disabled.
+void nRF24L01::completeTX(boolean delivered) {
+    if (!_txActive) {
+        return;
+    }
+    _txActive = false;
+    struct txframe *f = &_txQueue[_txTail & (NRF24L01_TX_DEPTH - 1)];
+    if (delivered) {
+        NRF24L01_COUNT(txDelivered, 1);
+    } else {
+        NRF24L01_COUNT(txFailed, 1);
+    }
+    if (!f->broadcast) {
+        countTX(f, delivered);
+    }
+    if (!delivered) {
+        // The failed payload is still at the front of the FIFO along
+        // with anything queued behind it.  Throw it all away and reload
+        // the survivors from RAM.
+        _spiTransactions++;
+        NRF24L01_COUNT(spiBytes, 1);
         digitalWrite(_csn, LOW);
         _status = _spi->transfer(CMD_TX_FLUSH);
         digitalWrite(_csn, HIGH);
-        restoreInterrupts(s);
+        _txLoaded = _txTail + 1;
+    }
+    _txTail++;
+    if (_txCallback) {
+        _txCallback(f->data, delivered);
     }
+    pumpTX();
+}
 
-    // Clear interrupts
-    isrstat = 0x70;
-    regWrite(REG_STATUS, &isrstat, 1);
+// Add a finished unicast to its neighbour's counts.  ARC_CNT in
+// OBSERVE_TX is the number of retries the frame took (all of them if
+// it hit MAX_RT).  Called with interrupts disabled.
+void nRF24L01::countTX(struct txframe *f, boolean delivered) {
+    uint8_t observe = 0;
+    regRead(REG_OBSERVE_TX, &observe, 1);
+
+    struct nrflink *l = NULL;
+    struct nrflink *oldest = &_links[0];
+    for (int i = 0; i < NRF24L01_LINK_SLOTS; i++) {
+        if (memcmp(_links[i].addr, f->addr, 5) == 0) {
+            l = &_links[i];
+            break;
+        }
+        if (_links[i].lastused < oldest->lastused) {
+            oldest = &_links[i];
+        }
+    }
+    if (l == NULL) {
+        l = oldest;
+        memcpy(l->addr, f->addr, 5);
+        memset(&l->stats, 0, sizeof(l->stats));
+    }
+    l->lastused = millis();
+
+    // Halve everything rather than wrap if nobody is reading them
+    if (l->stats.attempts > 0xFFFF - 16) {
+        l->stats.frames >>= 1;
+        l->stats.delivered >>= 1;
+        l->stats.attempts >>= 1;
+    }
+    l->stats.frames++;
+    if (delivered) {
+        l->stats.delivered++;
+    }
+    l->stats.attempts += (observe & 0x0F) + 1;
+}
+
+boolean nRF24L01::readLinkStats(uint8_t *addr, struct linkstats *stats) {
+    memset(stats, 0, sizeof(struct linkstats));
+    uint32_t s = disableInterrupts();
+    for (int i = 0; i < NRF24L01_LINK_SLOTS; i++) {
+        if (memcmp(_links[i].addr, addr, 5) == 0) {
+            memcpy(stats, &_links[i].stats, sizeof(struct linkstats));
+            memset(&_links[i].stats, 0, sizeof(struct linkstats));
+            break;
+        }
+    }
+    restoreInterrupts(s);
+    return true;
 }
 
-void nRF24L01::broadcastPacket(uint8_t *packet) {
-    uint8_t stat = 0;
-    regRead(REG_FIFO_STATUS, &stat, 1);
+// Keep the hardware TX FIFO topped up from the transmit queue.  All the
+// payloads in the FIFO go to the same address, so a frame for a
+// different address has to wait until the FIFO has emptied.  Called
+// with interrupts disabled.
+void nRF24L01::pumpTX() {
+    while (_txLoaded != _txHead && (uint8_t)(_txLoaded - _txTail) < 3) {
+        struct txframe *f = &_txQueue[_txLoaded & (NRF24L01_TX_DEPTH - 1)];
+        if (_txLoaded != _txTail) {
+            struct txframe *prev = &_txQueue[(_txLoaded - 1) & (NRF24L01_TX_DEPTH - 1)];
+            if (f->broadcast != prev->broadcast || f->channel != prev->channel ||
+                memcmp(f->addr, prev->addr, 5) != 0) {
+                break;
+            }
+        } else {
+            // Retune in standby.  The acknowledgement comes back on the
+            // same channel.
+            selectTX();
+            regWrite(REG_RF_CH, &f->channel, 1);
+            if (f->broadcast) {
+                regWrite(REG_TX_ADDR, f->addr, 5);
+                uint8_t zero = 0x00;
+                regWrite(REG_EN_AA, &zero, 1);
+            } else {
+                regWrite(REG_TX_ADDR, f->addr, 5);
+                enablePipe(0, f->addr, true);
+            }
+        }
+
+        selectTX();
+        _spiTransactions++;
+        NRF24L01_COUNT(spiBytes, 1 + f->len);
+        digitalWrite(_csn, LOW);
+        _status = _spi->transfer(CMD_TX);
+        for (int i = 0; i < f->len; i++) {
+            _spi->transfer(f->data[i]);
+        }
+        digitalWrite(_csn, HIGH);
+        _txLoaded++;
+    }
 
-    uint32_t timeout = millis();
-    while (_mode == 1 && millis() - timeout < 1000); // Wait for it to not be transmitting
-    if (_mode == 1) {
+    if (!_txActive && _txTail != _txLoaded) {
+        // Send exactly one payload so every TX_DS / MAX_RT maps to
+        // the frame at the head of the queue.
+        _txActive = true;
+        _txStarted = millis();
+        digitalWrite(_ce, HIGH);
+        delayMicroseconds(20);
+        digitalWrite(_ce, LOW);
+    }
+
+    if (_txTail == _txHead && _mode == 1) {
+        regWrite(REG_RF_CH, &_channel, 1);
         selectRX();
+        enablePipe(0, _addr, true);
+        enablePipe(1, _bc, false);
     }
+}
 
-    regWrite(REG_TX_ADDR, _bc, 5);
-    enablePipe(0, _addr, false);
-    enablePipe(1, _addr, false);
-    uint8_t zero = 0x00;
-    regWrite(REG_EN_AA, &zero, 1);
+int nRF24L01::queuePacket(uint8_t *addr, uint8_t *packet, uint8_t len, boolean broadcast) {
+    if (!_powered) {
+        return L2::Dropped;
+    }
 
-    selectTX();
     uint32_t s = disableInterrupts();
-    digitalWrite(_csn, LOW);
-    _status = _spi->transfer(CMD_TX);
-    for (int i = 0; i < _pipeWidth; i++) {
-        _spi->transfer(packet[i]);
+
+    // We only lose an interrupt if something has gone badly wrong with
+    // the radio, but if we do the queue must not stall forever.
+    if (_txActive && millis() - _txStarted > NRF24L01_TX_TIMEOUT) {
+        NRF24L01_COUNT(txTimeouts, 1);
+        completeTX(false);
     }
-    digitalWrite(_csn, HIGH);
+
+    if ((uint8_t)(_txHead - _txTail) >= NRF24L01_TX_DEPTH) {
+        restoreInterrupts(s);
+        return L2::Full;
+    }
+
+    struct txframe *f = &_txQueue[_txHead & (NRF24L01_TX_DEPTH - 1)];
+    f->broadcast = broadcast;
+    f->channel = _txChannel;
+    memcpy(f->addr, addr, 5);
+    // Without dynamic payloads every frame is padded out to the pipe
+    // width, and only unicasts have them
+    f->len = _dynamic && !broadcast ? constrain(len, 1, DEFAULT_PIPE_WIDTH) : _pipeWidth;
+    memcpy(f->data, packet, f->len);
+    _txHead++;
+    pumpTX();
     restoreInterrupts(s);
+    return L2::Queued;
+}
 
-    digitalWrite(_ce, HIGH);
-    delayMicroseconds(20);
-    digitalWrite(_ce, LOW);
+int nRF24L01::broadcastPacket(uint8_t *packet) {
+    return queuePacket(_bc, packet, _pipeWidth, true);
 }
 
-void nRF24L01::unicastPacket(uint8_t *addr, uint8_t *packet) {
-    uint8_t stat = 0;
-    regRead(REG_FIFO_STATUS, &stat, 1);
+int nRF24L01::unicastPacket(uint8_t *addr, uint8_t *packet) {
+    return queuePacket(addr, packet, _pipeWidth, false);
+}
 
-    uint32_t timeout = millis();
-    while (_mode == 1 && millis() - timeout < 1000); // Wait for it to not be transmitting
-    if (_mode == 1) {
-        selectRX();
-    }
+int nRF24L01::broadcastFrame(uint8_t *packet, uint8_t len) {
+    return queuePacket(_bc, packet, len, true);
+}
 
-    regWrite(REG_TX_ADDR, addr, 5);
-    enablePipe(0, addr, true);
-    enablePipe(1, _addr, true);
+// The first byte can't be 0xFF or it would be the broadcast address
+void nRF24L01::groupAddress(uint16_t group, uint8_t *addr) {
+    memcpy(addr, _bc, 5);
+    addr[0] = group % 255;
+}
 
-    selectTX();
-    uint32_t s = disableInterrupts();
-    digitalWrite(_csn, LOW);
-    _status = _spi->transfer(CMD_TX);
-    for (int i = 0; i < _pipeWidth; i++) {
-        _spi->transfer(packet[i]);
+int nRF24L01::multicastFrame(uint16_t group, uint8_t *packet, uint8_t len) {
+    uint8_t addr[5];
+    groupAddress(group, addr);
+    return queuePacket(addr, packet, len, true);
+}
+
+boolean nRF24L01::joinGroup(uint16_t group) {
+    int spare = -1;
+    for (int i = 0; i < NRF24L01_GROUP_PIPES; i++) {
+        if (!(_pipesUsed & (1 << i))) {
+            if (spare < 0) {
+                spare = i;
+            }
+        } else if (_pipeGroup[i] % 255 == group % 255) {
+            // Same address, so it's already getting through
+            return _pipeGroup[i] == group;
+        }
     }
-    digitalWrite(_csn, HIGH);
+    if (spare < 0) {
+        return false;
+    }
+    uint8_t addr[5];
+    groupAddress(group, addr);
+    uint32_t s = disableInterrupts();
+    _pipeGroup[spare] = group;
+    _pipesUsed |= 1 << spare;
+    enablePipe(spare + 2, addr, false);
     restoreInterrupts(s);
+    return true;
+}
 
-    digitalWrite(_ce, HIGH);
-    delayMicroseconds(20);
-    digitalWrite(_ce, LOW);
+void nRF24L01::leaveGroup(uint16_t group) {
+    for (int i = 0; i < NRF24L01_GROUP_PIPES; i++) {
+        if ((_pipesUsed & (1 << i)) && _pipeGroup[i] == group) {
+            uint32_t s = disableInterrupts();
+            _pipesUsed &= ~(1 << i);
+            regClr(REG_EN_RXADDR, i + 2);
+            restoreInterrupts(s);
+            return;
+        }
+    }
 }
 
-int nRF24L01::available() {
-    uint8_t fifostat = 0;
-    regRead(REG_FIFO_STATUS, &fifostat, 1);
-    if (fifostat & (1<<0)) {
+int nRF24L01::unicastFrame(uint8_t *addr, uint8_t *packet, uint8_t len) {
+    return queuePacket(addr, packet, len, false);
+}
+
+// Anything past the end of a short frame reads as zero
+void nRF24L01::readPacket(uint8_t *buffer) {
+    uint8_t len = readFrame(buffer);
+    if (len > 0 && len < _pipeWidth) {
+        memset(buffer + len, 0, _pipeWidth - len);
+    }
+}
+
+uint8_t nRF24L01::readFrame(uint8_t *buffer) {
+    uint8_t tail = _rxTail;
+    if (tail == _rxHead) {
         return 0;
     }
-    return 1;
+    uint8_t len = _rxLen[tail & (NRF24L01_RX_DEPTH - 1)];
+    memcpy(buffer, _rxRing[tail & (NRF24L01_RX_DEPTH - 1)], len);
+    _rxTail = tail + 1;
+    return len;
 }
 
-void nRF24L01::readPacket(uint8_t *buffer) {
+// Read the frame at the front of the RX FIFO, returning its length.  A
+// dynamic payload claiming more than 32 bytes is corrupt and, as the
+// datasheet asks, the FIFO is flushed and 0 returned.  The STATUS from
+// drainRX()'s last FIFO_STATUS read says which pipe the frame came in on.
+uint8_t nRF24L01::readFIFO(uint8_t *buffer) {
     uint32_t s = disableInterrupts();
+    uint8_t len = _pipeWidth;
     digitalWrite(_ce, LOW);
+    if (_dynamic && ((_status >> 1) & 0x07) == 0) {
+        _spiTransactions++;
+        NRF24L01_COUNT(spiBytes, 2);
+        digitalWrite(_csn, LOW);
+        _status = _spi->transfer(CMD_RX_PL_WID);
+        len = _spi->transfer(0xFF);
+        digitalWrite(_csn, HIGH);
+        if (len == 0 || len > DEFAULT_PIPE_WIDTH) {
+            _spiTransactions++;
+            NRF24L01_COUNT(spiBytes, 1);
+            digitalWrite(_csn, LOW);
+            _status = _spi->transfer(CMD_RX_FLUSH);
+            digitalWrite(_csn, HIGH);
+            digitalWrite(_ce, _mode == 0 ? HIGH : LOW);
+            restoreInterrupts(s);
+            return 0;
+        }
+    }
+    _spiTransactions++;
+    NRF24L01_COUNT(spiBytes, 1 + len);
+    NRF24L01_COUNT(rxFrames, 1);
     digitalWrite(_csn, LOW);
     _status = _spi->transfer(CMD_RX);
 
-    for (int i = 0; i < _pipeWidth; i++) {
+    for (int i = 0; i < len; i++) {
         buffer[i] = _spi->transfer(0xFF);
     }
     digitalWrite(_csn, HIGH);
-    digitalWrite(_ce, HIGH);
+    digitalWrite(_ce, _mode == 0 ? HIGH : LOW);
+    restoreInterrupts(s);
+    return len;
+}
+
+// Move everything in the radio's 3 deep RX FIFO into the ring.  Called
+// from the interrupt handler.  RX_DR is cleared first so a frame that
+// lands while we are draining raises a fresh interrupt.
+void nRF24L01::drainRX() {
+    uint8_t fifostat = 1<<6;
+    regWrite(REG_STATUS, &fifostat, 1);
+    regRead(REG_FIFO_STATUS, &fifostat, 1);
+    while (!(fifostat & (1<<0))) {
+        uint8_t head = _rxHead;
+        if ((uint8_t)(head - _rxTail) >= NRF24L01_RX_DEPTH) {
+            uint8_t discard[DEFAULT_PIPE_WIDTH];
+            readFIFO(discard);
+            _rxOverruns++;
+        } else {
+            uint8_t len = readFIFO(_rxRing[head & (NRF24L01_RX_DEPTH - 1)]);
+            if (len > 0) {
+                _rxLen[head & (NRF24L01_RX_DEPTH - 1)] = len;
+                _rxHead = head + 1;
+            }
+        }
+        regRead(REG_FIFO_STATUS, &fifostat, 1);
+    }
+}
+
+boolean nRF24L01::getStats(struct nrfstats *stats) {
+#ifdef NRF24L01_STATS
+    uint32_t s = disableInterrupts();
+    memcpy(stats, &_stats, sizeof(struct nrfstats));
     restoreInterrupts(s);
+    return true;
+#else
+    memset(stats, 0, sizeof(struct nrfstats));
+    return false;
+#endif
 }
 
 uint8_t nRF24L01::getStatus() {
     return _status;
 }
 
-void nRF24L01::setChannel(uint8_t chan) {
-    regWrite(REG_RF_CH, &chan, 1);
+// Frames already queued still go out on the channel they were queued
+// for.  The radio moves once it next goes back to listening.
+boolean nRF24L01::setChannel(uint8_t chan) {
+    uint32_t s = disableInterrupts();
+    _channel = chan;
+    _txChannel = chan;
+    if (_txTail == _txHead) {
+        regWrite(REG_RF_CH, &chan, 1);
+    }
+    restoreInterrupts(s);
+    return true;
+}
+
+// A pipe can only take dynamic payloads if it has auto acknowledge, so
+// that is pipe 0 alone: our own address, and the acknowledgements for
+// our unicasts.  Broadcasts and multicasts arrive on pipes 1 to 5, so
+// they still go out at the fixed width.  The nRF24L01 (no plus) ignores
+// the FEATURE write, which reading it back shows up.
+boolean nRF24L01::enableDynamicPayload() {
+    uint8_t feature = 0x04; // EN_DPL
+    regWrite(REG_FEATURE, &feature, 1);
+    regRead(REG_FEATURE, &feature, 1);
+    if (!(feature & 0x04)) {
+        return false;
+    }
+    uint8_t pipes = 0x01;
+    regWrite(REG_DYNPD, &pipes, 1);
+    _dynamic = true;
+    return true;
 }
 
 void nRF24L01::setDataRate(uint8_t mhz) {
@@ -13,9 +13,16 @@
 
 #define DEFAULT_PIPE_WIDTH      32
 
+// Number of received frames buffered in RAM by the interrupt handler.
+// Must be a power of two no larger than 128.
+#ifndef NRF24L01_RX_DEPTH
+#define NRF24L01_RX_DEPTH       8
+#endif
+
 #define CMD_REG_R       0x00
 #define CMD_REG_W       0x20
 #define CMD_RX          0x61
+#define CMD_RX_PL_WID   0x60
 #define CMD_TX          0xA0
 #define CMD_TX_FLUSH    0xE1
 #define CMD_RX_FLUSH    0xE2
@@ -46,6 +53,48 @@
 #define REG_RX_PW_P4    0x15
 #define REG_RX_PW_P5    0x16
 #define REG_FIFO_STATUS 0x17
+#define REG_DYNPD       0x1C
+#define REG_FEATURE     0x1D
+
+// Registers whose contents only ever change when we write them.  These
+// are mirrored in RAM so reads and redundant writes skip the SPI bus.
+// Defining it as 0 sends every access to the chip.
+#ifndef NRF24L01_SHADOW_REGS
+#define NRF24L01_SHADOW_REGS 0x007FFC7FUL
+#endif
+
+// Number of frames that can be waiting to be sent.  Must be a power of
+// two no larger than 128.
+#ifndef NRF24L01_TX_DEPTH
+#define NRF24L01_TX_DEPTH       8
+#endif
+
+// How long (ms) a transmission may go without a TX_DS or MAX_RT
+// interrupt before it is written off as failed.
+#ifndef NRF24L01_TX_TIMEOUT
+#define NRF24L01_TX_TIMEOUT     100
+#endif
+
+// Number of neighbours that unicast delivery counts are kept for.  The
+// least recently used is forgotten to make room for a new one.
+#ifndef NRF24L01_LINK_SLOTS
+#define NRF24L01_LINK_SLOTS     8
+#endif
+
+// Multicast groups are received on pipes 2 to 5.  Those share all but
+// the first byte of pipe 1's address, so pipe 1 takes broadcasts and
+// our own address moves to pipe 0 (which it has to borrow for the
+// acknowledgements when sending anyway).  A group's address is the
+// broadcast address with the first byte replaced.
+#define NRF24L01_GROUP_PIPES 4
+
+// Define NRF24L01_STATS to count interrupts, SPI traffic and transmit
+// outcomes, read with getStats().  Without it the counting compiles away.
+#ifdef NRF24L01_STATS
+#define NRF24L01_COUNT(field, n) (_stats.field += (n))
+#else
+#define NRF24L01_COUNT(field, n)
+#endif
 
 #define RATE_1MHZ       1
 #define RATE_2MHZ       2
@@ -55,6 +104,29 @@
 #define RF_TX_6DBM      2
 #define RF_TX_0DBM      3
 
+struct txframe {
+    uint8_t addr[5];
+    uint8_t data[DEFAULT_PIPE_WIDTH];
+    uint8_t len;
+    uint8_t channel;
+    boolean broadcast;
+};
+
+struct nrfstats {
+    uint32_t interrupts;
+    uint32_t spiBytes;
+    uint32_t rxFrames;    // Read out of the radio's FIFO
+    uint32_t txDelivered;
+    uint32_t txFailed;    // Hit MAX_RT or timed out
+    uint32_t txTimeouts;  // ... of which never raised an interrupt
+};
+
+struct nrflink {
+    uint8_t addr[5];
+    uint32_t lastused;
+    struct linkstats stats;
+};
+
 class nRF24L01 : public L2 {
 
     private:
@@ -69,13 +141,61 @@ class nRF24L01 : public L2 {
         uint8_t _bc[5];
         uint8_t _mode;
         uint8_t _pipeWidth;
+        boolean _dynamic; // Frames carry their own length
+
+        // Shadow copies of the configuration registers
+        uint8_t _shadow[REG_FIFO_STATUS];
+        uint8_t _shadowAddr[3][5];
+        uint32_t _shadowValid;
+        uint32_t _spiTransactions;
+
+        // Receive ring.  Only the ISR advances _rxHead and only the
+        // reader advances _rxTail, so neither side needs a lock.
+        uint8_t _rxRing[NRF24L01_RX_DEPTH][DEFAULT_PIPE_WIDTH];
+        uint8_t _rxLen[NRF24L01_RX_DEPTH];
+        volatile uint8_t _rxHead;
+        volatile uint8_t _rxTail;
+        volatile uint32_t _rxOverruns;
+        volatile uint32_t _rxFifoFull;
+
+        // Transmit queue.  Frames between _txTail and _txLoaded are in
+        // the radio's FIFO, _txLoaded to _txHead are still waiting.
+        struct txframe _txQueue[NRF24L01_TX_DEPTH];
+        volatile uint8_t _txHead;
+        volatile uint8_t _txTail;
+        volatile uint8_t _txLoaded;
+        volatile boolean _txActive;
+        uint32_t _txStarted;
+        void (*_txCallback)(uint8_t *, boolean);
+        uint8_t _channel;   // Where we listen
+        uint8_t _txChannel; // Where frames queued now will go
+
+        // The group each of pipes 2 to 5 is listening for
+        uint16_t _pipeGroup[NRF24L01_GROUP_PIPES];
+        uint8_t _pipesUsed;
+
+        // Per neighbour delivery counts, updated as each unicast ends
+        struct nrflink _links[NRF24L01_LINK_SLOTS];
+
+#ifdef NRF24L01_STATS
+        struct nrfstats _stats;
+#endif
+        boolean _powered;
 
         void regRead(uint8_t reg, uint8_t *buffer, uint8_t len);
         void regWrite(uint8_t reg, uint8_t *buffer, uint8_t len);
         void regSet(uint8_t reg, uint8_t bit);
         void regClr(uint8_t reg, uint8_t bit);
+        uint8_t *shadowOf(uint8_t reg, uint8_t len);
         void selectRX();
         void selectTX();
+        uint8_t readFIFO(uint8_t *buffer);
+        void drainRX();
+        void pumpTX();
+        void completeTX(boolean delivered);
+        void countTX(struct txframe *f, boolean delivered);
+        int queuePacket(uint8_t *addr, uint8_t *packet, uint8_t len, boolean broadcast);
+        void groupAddress(uint16_t group, uint8_t *addr);
 
     public:
         nRF24L01(DGSPI &spi, int csn, int ce, int intr);
@@ -85,16 +205,37 @@ class nRF24L01 : public L2 {
         void disablePower();
         void isrHandler();
         uint8_t getStatus();
-        void setChannel(uint8_t chan);
+        boolean setChannel(uint8_t chan);
+        void setTxChannel(uint8_t chan) { _txChannel = chan; }
         void setDataRate(uint8_t mhz);
         void setTXPower(uint8_t power);
+        /*! Only clock out and send the bytes each unicast uses.  Every
+         *  radio in the mesh has to do the same.  Broadcasts and multicasts
+         *  stay padded, as their pipes have no auto acknowledge.  False on
+         *  a chip without it */
+        boolean enableDynamicPayload();
+        uint32_t getSPITransactions() { return _spiTransactions; }
+        uint32_t getRXOverruns() { return _rxOverruns; }
+        uint32_t getRXFifoFull() { return _rxFifoFull; }
+        /*! Snapshot of the counters.  False (and all zero) without NRF24L01_STATS */
+        boolean getStats(struct nrfstats *stats);
+
+        /*! Called from interrupt context as each frame is delivered or given up on */
+        void setTXCallback(void (*func)(uint8_t *, boolean)) { _txCallback = func; }
 
         // L2 standard interface functions
         int getHardwareAddress(uint8_t *buffer);
-        void unicastPacket(uint8_t *addr, uint8_t *data);
-        void broadcastPacket(uint8_t *data);
+        boolean readLinkStats(uint8_t *addr, struct linkstats *stats);
+        int unicastPacket(uint8_t *addr, uint8_t *data);
+        int broadcastPacket(uint8_t *data);
         void readPacket(uint8_t *buffer);
-        int available();
+        int unicastFrame(uint8_t *addr, uint8_t *data, uint8_t len);
+        int broadcastFrame(uint8_t *data, uint8_t len);
+        uint8_t readFrame(uint8_t *buffer);
+        boolean joinGroup(uint16_t group);
+        void leaveGroup(uint16_t group);
+        int multicastFrame(uint16_t group, uint8_t *data, uint8_t len);
+        int available() { return (uint8_t)(_rxHead - _rxTail); }
 };
 
 #endif